@@ -78,6 +78,24 @@ extern "C" {
 		struct hid_device_;
 		typedef struct hid_device_ hid_device; /**< opaque hidapi structure */
 
+		struct hid_device_group_;
+		typedef struct hid_device_group_ hid_device_group; /**< opaque set of devices, see hid_group_write() */
+
+		/** @brief Policy applied when the input report queue of a device is full.
+
+			@ingroup API
+		*/
+		typedef enum hid_input_queue_policy_ {
+			/** Discard the oldest queued report to make room (default). */
+			HID_INPUT_QUEUE_DROP_OLDEST = 0,
+			/** Discard the newly received report. */
+			HID_INPUT_QUEUE_DROP_NEWEST = 1,
+			/** Stop reading from the device until hid_read() makes
+			    room in the queue. No report is dropped; the device
+			    is left to buffer (or NAK) further reports. */
+			HID_INPUT_QUEUE_BLOCK = 2
+		} hid_input_queue_policy;
+
 		/** hidapi info structure */
 		struct hid_device_info {
 			/** Platform-specific device path */
@@ -113,6 +131,92 @@ extern "C" {
 
 			/** Pointer to the next device */
 			struct hid_device_info *next;
+
+			/** Set while the strings of a record returned by
+			    hid_enumerate_lazy() haven't been read yet. Use
+			    hid_device_info_get_serial_number(),
+			    hid_device_info_get_manufacturer_string() and
+			    hid_device_info_get_product_string() to read them. */
+			int strings_pending;
+		};
+
+		/** @brief Type of a HID report.
+
+			@ingroup API
+		*/
+		typedef enum hid_report_type_ {
+			HID_REPORT_TYPE_INPUT = 0,
+			HID_REPORT_TYPE_OUTPUT = 1,
+			HID_REPORT_TYPE_FEATURE = 2
+		} hid_report_type;
+
+		/** @brief A data field of a HID report, as described by the
+			report descriptor.
+
+			A Variable field holds a single value. An Array field holds
+			@p count indices into the range of usages from @p usage to
+			@p usage_maximum. Constant (padding) fields are not listed.
+
+			@ingroup API
+		*/
+		struct hid_report_field {
+			/** Usage Page of the field */
+			unsigned short usage_page;
+			/** Usage of the field. For Array fields, the first Usage
+			    of the range the values select from. */
+			unsigned short usage;
+			/** For Array fields, the last Usage of the range the
+			    values select from. Same as usage for Variable fields. */
+			unsigned short usage_maximum;
+			/** Size of each value in bits (Report Size), 1 to 32 */
+			unsigned short bit_size;
+			/** Number of values: 1 for Variable fields, Report Count
+			    for Array fields */
+			unsigned short count;
+			/** Position of the first value in bits, from the start of
+			    the report data. The Report ID byte, if any, is not
+			    counted. */
+			unsigned int bit_offset;
+			/** Logical Minimum. Values are signed if it is negative. */
+			int logical_minimum;
+			/** Logical Maximum */
+			int logical_maximum;
+			/** Data of the Main item, e.g. bit 1 is set for Variable
+			    fields and bit 2 for Relative ones. See the HID
+			    specification, version 1.11, section 6.2.2.5. */
+			unsigned int flags;
+		};
+
+		/** @brief A HID report and its fields.
+
+			@ingroup API
+		*/
+		struct hid_report_info {
+			/** Report ID, 0 if the device doesn't use numbered reports */
+			unsigned char report_id;
+			/** Type of the report */
+			hid_report_type type;
+			/** Size of the report data in bytes, without the Report ID */
+			size_t size;
+			/** The fields of the report, ordered by bit_offset */
+			const struct hid_report_field *fields;
+			/** Number of elements in fields */
+			size_t num_fields;
+		};
+
+		/** @brief Layout of all reports of a device, compiled from its
+			report descriptor.
+
+			@ingroup API
+		*/
+		struct hid_report_layout {
+			/** Whether the device uses numbered reports, in which case
+			    the first byte of every report is the Report ID */
+			int uses_numbered_reports;
+			/** The reports of the device, ordered by type and Report ID */
+			const struct hid_report_info *reports;
+			/** Number of elements in reports */
+			size_t num_reports;
 		};
 
 
@@ -168,6 +272,161 @@ extern "C" {
 		*/
 		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
 
+		/** @brief Enumerate the HID Devices, without their strings.
+
+			This function works like hid_enumerate(), but leaves out the
+			serial number, manufacturer and product strings of the
+			devices. They take most of the time of an enumeration, on
+			libusb a USB request each. The strings of a record are read
+			on the first call of hid_device_info_get_serial_number(),
+			hid_device_info_get_manufacturer_string() or
+			hid_device_info_get_product_string() for it.
+
+			Backends which don't support this return the strings right
+			away.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the types of device
+				to open.
+			@param product_id The Product ID (PID) of the types of
+				device to open.
+
+		    @returns
+		    	This function returns a pointer to a linked list of type
+		    	struct #hid_device_info, or NULL in the case of failure.
+		    	Free this linked list by calling hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_lazy(unsigned short vendor_id, unsigned short product_id);
+
+		/** @brief Bus types, see struct #hid_enumerate_filter.
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** Any bus */
+			HID_API_BUS_ANY = 0,
+			HID_API_BUS_USB = 1,
+			HID_API_BUS_BLUETOOTH = 2,
+			HID_API_BUS_I2C = 3
+		} hid_bus_type;
+
+		/** @brief Flags of struct #hid_enumerate_filter.
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** Leave out the strings, like hid_enumerate_lazy() */
+			HID_API_ENUMERATE_LAZY = (1 << 0),
+
+			/** Only match devices with the interface number in
+			    hid_enumerate_filter::interface_number */
+			HID_API_ENUMERATE_MATCH_INTERFACE = (1 << 1)
+		} hid_enumerate_flag;
+
+		/** @brief Which devices hid_enumerate_ex() returns.
+
+			A zeroed filter matches every device, so set only the
+			fields which matter.
+
+			@ingroup API
+		*/
+		struct hid_enumerate_filter {
+			/** Vendor ID, or 0x0 for any */
+			unsigned short vendor_id;
+			/** Product ID, or 0x0 for any */
+			unsigned short product_id;
+			/** Usage Page, or 0x0 for any */
+			unsigned short usage_page;
+			/** Usage, or 0x0 for any */
+			unsigned short usage;
+			/** Bus the device is on */
+			hid_bus_type bus_type;
+			/** Interface number, only used with
+			    #HID_API_ENUMERATE_MATCH_INTERFACE */
+			int interface_number;
+			/** The serial number has to start with this, unless it
+			    is NULL */
+			const wchar_t *serial_number_prefix;
+			/** A combination of #hid_enumerate_flag values */
+			int flags;
+		};
+
+		/** @brief Enumerate the HID Devices which match a filter.
+
+			This function works like hid_enumerate(), but can select
+			the devices by more than their VID and PID. The filter is
+			applied while the system is scanned, so devices which don't
+			match cost little, and their strings aren't read.
+
+			Usage page and usage are matched against the records, which
+			have them set to 0 on backends that can't tell (e.g.
+			libusb). Such backends return no device for a filter with a
+			usage page or usage. Likewise, the Windows and Mac backends
+			don't know the bus type and return no device for a filter
+			with one.
+
+			A serial number prefix needs the serial number of the
+			devices, so on libusb the strings of the devices which
+			otherwise match are read even with
+			#HID_API_ENUMERATE_LAZY.
+
+			@ingroup API
+			@param filter The devices to return, or NULL for all.
+
+		    @returns
+		    	This function returns a pointer to a linked list of type
+		    	struct #hid_device_info, or NULL in the case of failure
+		    	or if no device matches. Free this linked list by
+		    	calling hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter);
+
+		/** @brief Get the serial number of an enumerated device.
+
+			Reads the strings of a record returned by
+			hid_enumerate_lazy() if that hasn't happened yet. This
+			modifies the record, so it must not be called for the same
+			list from several threads at once.
+
+			@ingroup API
+			@param info A record returned by hid_enumerate() or
+				hid_enumerate_lazy().
+
+			@returns
+				The serial number, or NULL if the device doesn't have
+				one or it couldn't be read. It is freed along with the
+				record.
+		*/
+		const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_serial_number(struct hid_device_info *info);
+
+		/** @brief Get the manufacturer string of an enumerated device.
+
+			See hid_device_info_get_serial_number().
+
+			@ingroup API
+			@param info A record returned by hid_enumerate() or
+				hid_enumerate_lazy().
+
+			@returns
+				The manufacturer string, or NULL if the device doesn't
+				have one or it couldn't be read.
+		*/
+		const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_manufacturer_string(struct hid_device_info *info);
+
+		/** @brief Get the product string of an enumerated device.
+
+			See hid_device_info_get_serial_number().
+
+			@ingroup API
+			@param info A record returned by hid_enumerate() or
+				hid_enumerate_lazy().
+
+			@returns
+				The product string, or NULL if the device doesn't have
+				one or it couldn't be read.
+		*/
+		const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_product_string(struct hid_device_info *info);
+
 		/** @brief Free an enumeration Linked List
 
 		    This function frees a linked list created by hid_enumerate().
@@ -178,6 +437,140 @@ extern "C" {
 		*/
 		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
 
+		/** @brief Callback handle.
+
+			Callbacks handles are generated by hid_hotplug_register_callback()
+			and can be used to deregister callbacks. Callback handles are
+			unique and positive.
+
+			@ingroup API
+		*/
+		typedef int hid_hotplug_callback_handle;
+
+		/** @brief Hotplug events.
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** A device has been plugged in and is ready to use */
+			HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED = (1 << 0),
+
+			/** A device has left and is no longer available.
+			    It is the user's responsibility to call hid_close()
+			    on a device that has left. */
+			HID_API_HOTPLUG_EVENT_DEVICE_LEFT = (1 << 1)
+		} hid_hotplug_event;
+
+		/** @brief Flags for hid_hotplug_register_callback().
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** Arm the callback and fire it for all matching
+			    currently attached devices. */
+			HID_API_HOTPLUG_ENUMERATE = (1 << 0)
+		} hid_hotplug_flag;
+
+		/** @brief Hotplug callback function type.
+
+			When requesting hotplug event notifications, you pass a
+			pointer to a callback function of this type.
+
+			The callback is called on a thread of hidapi (or, for
+			devices reported because of #HID_API_HOTPLUG_ENUMERATE, on
+			the thread registering it). The callback may call
+			hid_hotplug_register_callback() and
+			hid_hotplug_deregister_callback(), and open, read from
+			and close devices, but must not call hid_exit().
+
+			@ingroup API
+			@param callback_handle The hid_hotplug_callback_handle callback handle.
+			@param device The hid_device_info of the device this event
+				occurred on. It is only valid during the callback and
+				must not be freed. Its next pointer is NULL.
+			@param event Event that occurred.
+			@param user_data User data provided when this callback was registered.
+
+			@returns
+				The callback returns 0 to keep receiving events, and
+				any other value to be deregistered.
+		*/
+		typedef int (HID_API_CALL *hid_hotplug_callback_fn)(
+			hid_hotplug_callback_handle callback_handle,
+			struct hid_device_info *device,
+			hid_hotplug_event event,
+			void *user_data);
+
+		/** @brief Register a HID hotplug callback.
+
+			Register a callback which is called whenever a HID device
+			matching @p vendor_id and @p product_id is attached or
+			removed. This avoids calling hid_enumerate() periodically
+			to notice changes.
+
+			Not every backend supports this.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the devices to notify
+				about, or 0 for any vendor.
+			@param product_id The Product ID (PID) of the devices to notify
+				about, or 0 for any product.
+			@param events Bitwise or of the hotplug events which will
+				trigger this callback, see #hid_hotplug_event.
+			@param flags Bitwise or of the hotplug flags affecting
+				registration, see #hid_hotplug_flag.
+			@param callback The callback function which is invoked on
+				the events.
+			@param user_data User data which is passed to the callback
+				function.
+			@param callback_handle Pointer to store the handle of the
+				allocated callback (Optionally NULL).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, int flags, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle);
+
+		/** @brief Deregister a callback from a HID hotplug.
+
+			This function is safe to call from within a hotplug callback.
+
+			@ingroup API
+			@param callback_handle The handle of the callback to deregister.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle);
+
+		/** @brief Serve hid_enumerate() from a cached device list.
+
+			By default every hid_enumerate() call scans the system for
+			devices, which takes milliseconds and reads the strings of
+			each device. With the cache enabled, the list of attached
+			devices is built once and kept up to date by the hotplug
+			monitoring of hid_hotplug_register_callback(), so that
+			hid_enumerate() (and hid_open()) only copy the matching
+			records out of it.
+
+			A device which has just been attached or removed can be
+			missing from, or still be listed in, the cached list until
+			its hotplug event has been handled.
+
+			The monitoring keeps running until hid_exit(), even when the
+			cache is disabled again.
+
+			Not every backend supports this.
+
+			@ingroup API
+			@param enable 1 to enable the cache, 0 to scan the system on
+				every call again.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_enumeration_cache(int enable);
+
 		/** @brief Open a HID device using a Vendor ID (VID), Product ID
 			(PID) and optionally a serial number.
 
@@ -245,6 +638,161 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *dev, const unsigned char *data, size_t length);
 
+		/** @brief Completion callback of hid_write_async().
+
+			@ingroup API
+			@param dev The device written to.
+			@param result The number of bytes written, like the return
+				value of hid_write(), or -1 on error.
+			@param user_data The pointer passed to hid_write_async().
+		*/
+		typedef void (HID_API_CALL *hid_write_callback)(hid_device *dev, int result, void *user_data);
+
+		/** @brief Write an Output report to a HID device without
+			waiting for it.
+
+			This function works like hid_write(), but returns right
+			away. The data is copied, and @p callback is called once
+			the report has been sent, or has failed. Several reports
+			can be in flight for a device at the same time; they are
+			sent in the order of the calls.
+
+			The callback is called on a thread of hidapi. It may call
+			hid_write_async() for the same device, but not hid_close().
+			hid_close() cancels the writes which haven't completed yet;
+			their callbacks are called with -1 before it returns.
+
+			The libusb backend submits the report as a USB transfer,
+			from a pool of up to 16 per device. The hidraw backend
+			writes it on a thread of the device. Other backends don't
+			support this yet.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+			@param callback The function to call when the write is done.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns 0 if the report has been queued,
+				and -1 on error, e.g. if too many reports are in
+				flight. The callback is not called then.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data);
+
+		/** @brief Queue the Output reports of hid_write() and send
+			only the latest one of each report number.
+
+			With the output queue enabled, hid_write() doesn't wait
+			for the report to be sent. It puts the report into a queue
+			of the device and returns @p length right away; the reports
+			are written in the background, in order. A report replaces
+			one with the same report number which hasn't been sent yet,
+			at its place in the queue. This suits devices which are
+			sent their full state again and again: when the device
+			falls behind, the stale reports are dropped instead of
+			piling up.
+
+			Failures of queued reports are reported by the next call to
+			hid_write(), which returns -1 then and doesn't queue its
+			report. hid_close() sends the queued reports first, waiting
+			for at most the write timeout (see hid_set_timeout(); one
+			second on hidraw), and drops the ones which are still
+			unsent after that.
+
+			This is built on hid_write_async(), and the queued reports
+			count towards its limit of reports in flight. It is only
+			supported where hid_write_async() is.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param enable 1 to queue the reports of hid_write(), 0 to
+				write them right away again (the default). Turning the
+				queue off waits for the queued reports to be sent first,
+				like hid_close(), so hid_write() can't overtake them.
+
+			@returns
+				This function returns 0 on success and -1 on error. If
+				the queued reports couldn't be sent in time, the queue
+				stays on and -1 is returned.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_output_queue(hid_device *dev, int enable);
+
+		/** @brief Create an empty group of devices for hid_group_write().
+
+			@ingroup API
+
+			@returns
+				This function returns a pointer to the new group, or
+				NULL on failure. Free it with hid_group_free().
+		*/
+		hid_device_group HID_API_EXPORT * HID_API_CALL hid_group_create(void);
+
+		/** @brief Free a group of devices.
+
+			The devices themselves are not closed.
+
+			@ingroup API
+			@param group A group returned from hid_group_create().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_group_free(hid_device_group *group);
+
+		/** @brief Add a device to a group.
+
+			Remove the device from the group before closing it.
+
+			@ingroup API
+			@param group A group returned from hid_group_create().
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				This function returns the index of the device in the
+				group, which is where hid_group_write() puts its result,
+				or -1 on error, e.g. if the device is in the group
+				already.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_group_add(hid_device_group *group, hid_device *dev);
+
+		/** @brief Remove a device from a group.
+
+			The devices after it move up by one index.
+
+			@ingroup API
+			@param group A group returned from hid_group_create().
+			@param dev A device added with hid_group_add().
+
+			@returns
+				This function returns 0 on success and -1 if the device
+				is not in the group.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_group_remove(hid_device_group *group, hid_device *dev);
+
+		/** @brief Write the same Output report to all devices of a group.
+
+			The report is sent to all devices at the same time, and the
+			function returns once all writes are done, so it takes
+			about as long as a single hid_write() instead of one per
+			device. The libusb and hidraw backends do this with
+			hid_write_async(); don't call it from a callback of that.
+			Other backends write to one device after the other.
+
+			@ingroup API
+			@param group A group returned from hid_group_create().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+			@param results An array with an element for each device of
+				the group, which receives the result of hid_write() for
+				that device, in the order of the group. May be NULL.
+
+			@returns
+				This function returns the number of devices the report
+				has been written to, and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_group_write(hid_device_group *group, const unsigned char *data, size_t length, int *results);
+
 		/** @brief Read an Input report from a HID device with timeout.
 
 			Input reports are returned
@@ -290,6 +838,86 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *dev, unsigned char *data, size_t length);
 
+		/** @brief Read several Input reports from a HID device at once.
+
+			Waits up to the timeout for the first Input report, then
+			returns it together with all the other reports which are
+			already available, up to max_reports, without waiting any
+			further. This is cheaper than calling hid_read_timeout()
+			once per report when reports arrive in bursts.
+
+			Report i is put at data + i * report_stride, and its
+			length in bytes is put into lengths[i]. Reports longer than
+			report_stride are truncated, like with hid_read().
+
+			This function sets the return value of hid_error().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data A buffer of at least report_stride * max_reports
+				bytes to put the read reports into.
+			@param report_stride The number of bytes reserved for each
+				report in data. For devices with multiple reports, make
+				sure to reserve an extra byte for the report number.
+			@param max_reports The maximum number of reports to read.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+			@param lengths An array of at least max_reports elements
+				which receives the length of each report read.
+
+			@returns
+				This function returns the number of reports read and
+				-1 on error. If no report was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_read_many(hid_device *dev, unsigned char *data, size_t report_stride, size_t max_reports, int milliseconds, size_t *lengths);
+
+		/** @brief Get a file descriptor to wait for Input reports.
+
+			The returned file descriptor becomes readable when an Input
+			report can be read without blocking, or when the device has
+			been disconnected (hid_read() then returns -1). It can be
+			added to an existing poll(), epoll or similar event loop, in
+			which case the reports should be read with hid_read() or
+			hid_read_many() with a timeout of 0 once it is readable.
+
+			The file descriptor is owned by the device. Do not read
+			from, write to or close it. It stays valid until hid_close().
+
+			Not every backend supports this.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				This function returns a file descriptor on success and
+				-1 on error.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *dev);
+
+		/** @brief Wait until any of several HID devices has an Input report.
+
+			Blocks until at least one of the devices has an Input report
+			which can be read without blocking, or has been disconnected,
+			or the timeout expires. This allows one thread to service
+			many devices without polling each of them in turn.
+
+			Not every backend supports this.
+
+			@ingroup API
+			@param devs An array of device handles returned from hid_open().
+			@param num_devs The number of device handles in @p devs.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+			@param ready An array of @p num_devs elements. Element i is
+				set to 1 if devs[i] is ready to be read with hid_read() or
+				hid_read_many() without blocking, and to 0 otherwise.
+
+			@returns
+				This function returns the number of ready devices and
+				-1 on error. If no device became ready within the timeout
+				period, this function returns 0.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_wait_any(hid_device **devs, size_t num_devs, int milliseconds, int *ready);
+
 		/** @brief Set the device handle to be non-blocking.
 
 			In non-blocking mode calls to hid_read() will return
@@ -310,6 +938,120 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *dev, int nonblock);
 
+		/** @brief Set the number of input reports queued for a device.
+
+			Input reports which arrive while the application is not
+			reading are queued by HIDAPI (or the OS) until hid_read()
+			is called. This function sets how many reports can be
+			queued before the policy set by
+			hid_set_input_queue_policy() is applied. Reports already
+			queued are kept, except for the oldest ones if the new
+			size is smaller than the number of queued reports.
+
+			Only supported by the libusb and Windows implementations.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param size The number of reports to queue (must be at
+				least 1).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_queue_size(hid_device *dev, size_t size);
+
+		/** @brief Set what happens when the input report queue is full.
+
+			Only supported by the libusb implementation. The Windows
+			implementation accepts #HID_INPUT_QUEUE_DROP_OLDEST only.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param policy One of the #hid_input_queue_policy values.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_queue_policy(hid_device *dev, hid_input_queue_policy policy);
+
+		/** @brief Get the number of input reports dropped because the
+			input report queue was full.
+
+			Only supported by the libusb implementation.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param count Set to the number of reports dropped since
+				the device was opened.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_dropped_input_reports(hid_device *dev, unsigned long *count);
+
+		/** @brief The timeouts which can be set with hid_set_timeout().
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** The transfers which read Input reports. They are
+			    submitted again when they time out, so this is how
+			    often reading is restarted, not a timeout of
+			    hid_read(). The default is 5000 ms. */
+			HID_API_TIMEOUT_READ = 0,
+			/** Sending Output reports with hid_write() and
+			    hid_write_async(). The default is 1000 ms. */
+			HID_API_TIMEOUT_WRITE = 1,
+			/** hid_get_feature_report(), hid_send_feature_report()
+			    and hid_get_input_report(). The default is 1000 ms. */
+			HID_API_TIMEOUT_CONTROL = 2
+		} hid_timeout_type;
+
+		/** @brief Set a timeout of the transfers of a device.
+
+			Latency-sensitive applications can set short timeouts to
+			fail fast and retry, instead of being blocked for a second
+			when the device or the bus is busy. The timeout applies to
+			the transfers started after this call.
+
+			Only supported by the libusb implementation. The Windows
+			implementation supports #HID_API_TIMEOUT_WRITE only.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param type Which timeout to set.
+			@param milliseconds The timeout in milliseconds, or -1 to
+				wait forever.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_timeout(hid_device *dev, hid_timeout_type type, int milliseconds);
+
+		/** @brief Set the number of input transfers kept in flight for
+			a device.
+
+			With more than one transfer in flight, the host
+			controller always has a transfer queued for the INPUT
+			endpoint, even while a completed one is being handled,
+			so high-rate devices don't lose reports. The default
+			is 2.
+
+			The setting applies immediately: additional transfers
+			are submitted right away, and surplus transfers are
+			retired as they complete.
+
+			Only supported by the libusb implementation.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param count The number of transfers (1 to 64).
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_transfer_count(hid_device *dev, int count);
+
 		/** @brief Send a Feature report to the device.
 
 			Feature reports are sent over the Control endpoint as a
@@ -375,6 +1117,10 @@ extern "C" {
 			still contain the Report ID, and the report data will
 			start in data[1].
 
+			The report is requested from the device right away,
+			instead of waiting for it to send the next one. The
+			hidraw implementation needs Linux 5.11 or newer for this.
+
 			@ingroup API
 			@param device A device handle returned from hid_open().
 			@param data A buffer to put the read data into, including
@@ -450,6 +1196,59 @@ extern "C" {
 		*/
 		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen);
 
+		/** @brief Get the report layout of a HID device.
+
+			The report descriptor of the device is parsed once when the
+			device is opened. The returned layout lists every report
+			with the position, size, usage and logical range of its
+			fields, so Input reports can be decoded without parsing the
+			report descriptor again.
+
+			The layout is owned by the device and stays valid until
+			hid_close(). It must not be freed by the user.
+
+			Not every backend supports this.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				This function returns a pointer to the layout of the
+				device, or NULL if it is not available.
+		*/
+		HID_API_EXPORT const struct hid_report_layout * HID_API_CALL hid_get_report_layout(hid_device *dev);
+
+		/** @brief Decode the values of an Input report.
+
+			Extracts the values of all fields of an Input report, in the
+			order of the fields in the report layout (see
+			hid_get_report_layout()). Array fields contribute count
+			values each. Values of fields with a negative Logical
+			Minimum are sign extended.
+
+			The extraction uses tables which are prepared when the
+			device is opened, and vector instructions where available,
+			so it is cheap enough to call for every report read.
+
+			Not every backend supports this.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data An Input report as read by hid_read(). The
+				first byte is the Report ID if the device uses numbered
+				reports.
+			@param length The length of the report in bytes. Values
+				beyond it are decoded as 0.
+			@param values An array to put the decoded values into.
+			@param max_values The number of elements of @p values.
+				Values which don't fit are not decoded.
+
+			@returns
+				This function returns the number of values stored in
+				@p values and -1 on error, e.g. if the report is unknown.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_decode_report(hid_device *dev, const unsigned char *data, size_t length, int *values, size_t max_values);
+
 		/** @brief Get a string describing the last error which occurred.
 
 			Whether a function sets the last error is noted in its
@@ -0,0 +1,554 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Checks the report descriptor parser and the report decoder of the
+ hidraw implementation against descriptors of known layout. The
+ implementation is included, as neither is reachable without a
+ device otherwise. The vector paths of the decoder are forced on and
+ off, and all of them have to produce the same values.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+#include "../linux/hid.c"
+
+#include <stdio.h>
+
+/* Boot keyboard, from the HID specification, appendix B.1 */
+static unsigned char keyboard_descriptor[] = {
+	0x05, 0x01, /* Usage Page (Generic Desktop) */
+	0x09, 0x06, /* Usage (Keyboard) */
+	0xA1, 0x01, /* Collection (Application) */
+	0x05, 0x07, /*   Usage Page (Keyboard) */
+	0x19, 0xE0, /*   Usage Minimum (Left Control) */
+	0x29, 0xE7, /*   Usage Maximum (Right GUI) */
+	0x15, 0x00, /*   Logical Minimum (0) */
+	0x25, 0x01, /*   Logical Maximum (1) */
+	0x75, 0x01, /*   Report Size (1) */
+	0x95, 0x08, /*   Report Count (8) */
+	0x81, 0x02, /*   Input (Data, Variable, Absolute) */
+	0x95, 0x01, /*   Report Count (1) */
+	0x75, 0x08, /*   Report Size (8) */
+	0x81, 0x01, /*   Input (Constant) */
+	0x95, 0x05, /*   Report Count (5) */
+	0x75, 0x01, /*   Report Size (1) */
+	0x05, 0x08, /*   Usage Page (LEDs) */
+	0x19, 0x01, /*   Usage Minimum (Num Lock) */
+	0x29, 0x05, /*   Usage Maximum (Kana) */
+	0x91, 0x02, /*   Output (Data, Variable, Absolute) */
+	0x95, 0x01, /*   Report Count (1) */
+	0x75, 0x03, /*   Report Size (3) */
+	0x91, 0x01, /*   Output (Constant) */
+	0x95, 0x06, /*   Report Count (6) */
+	0x75, 0x08, /*   Report Size (8) */
+	0x15, 0x00, /*   Logical Minimum (0) */
+	0x25, 0x65, /*   Logical Maximum (101) */
+	0x05, 0x07, /*   Usage Page (Keyboard) */
+	0x19, 0x00, /*   Usage Minimum (0) */
+	0x29, 0x65, /*   Usage Maximum (101) */
+	0x81, 0x00, /*   Input (Data, Array) */
+	0xC0,       /* End Collection */
+};
+
+/* Mouse with three buttons and signed relative X, Y and wheel */
+static unsigned char mouse_descriptor[] = {
+	0x05, 0x01, /* Usage Page (Generic Desktop) */
+	0x09, 0x02, /* Usage (Mouse) */
+	0xA1, 0x01, /* Collection (Application) */
+	0x09, 0x01, /*   Usage (Pointer) */
+	0xA1, 0x00, /*   Collection (Physical) */
+	0x05, 0x09, /*     Usage Page (Button) */
+	0x19, 0x01, /*     Usage Minimum (1) */
+	0x29, 0x03, /*     Usage Maximum (3) */
+	0x15, 0x00, /*     Logical Minimum (0) */
+	0x25, 0x01, /*     Logical Maximum (1) */
+	0x95, 0x03, /*     Report Count (3) */
+	0x75, 0x01, /*     Report Size (1) */
+	0x81, 0x02, /*     Input (Data, Variable, Absolute) */
+	0x95, 0x01, /*     Report Count (1) */
+	0x75, 0x05, /*     Report Size (5) */
+	0x81, 0x01, /*     Input (Constant) */
+	0x05, 0x01, /*     Usage Page (Generic Desktop) */
+	0x09, 0x30, /*     Usage (X) */
+	0x09, 0x31, /*     Usage (Y) */
+	0x09, 0x38, /*     Usage (Wheel) */
+	0x15, 0x81, /*     Logical Minimum (-127) */
+	0x25, 0x7F, /*     Logical Maximum (127) */
+	0x75, 0x08, /*     Report Size (8) */
+	0x95, 0x03, /*     Report Count (3) */
+	0x81, 0x06, /*     Input (Data, Variable, Relative) */
+	0xC0,       /*   End Collection */
+	0xC0,       /* End Collection */
+};
+
+/* Vendor device with numbered reports. Input report 1 is a run of
+   unsigned bytes, and input report 3 one of signed bytes, for the SSE2
+   path. Input report 2 has 12-bit signed values and a 32-bit value,
+   for the AVX2 path. An output and a feature report follow. */
+static unsigned char vendor_descriptor[] = {
+	0x06, 0x00, 0xFF, /* Usage Page (Vendor 0xFF00) */
+	0x09, 0x01,       /* Usage (1) */
+	0xA1, 0x01,       /* Collection (Application) */
+	0x85, 0x01,       /*   Report ID (1) */
+	0x19, 0x01,       /*   Usage Minimum (0x01) */
+	0x29, 0x14,       /*   Usage Maximum (0x14) */
+	0x15, 0x00,       /*   Logical Minimum (0) */
+	0x26, 0xFF, 0x00, /*   Logical Maximum (255) */
+	0x75, 0x08,       /*   Report Size (8) */
+	0x95, 0x14,       /*   Report Count (20) */
+	0x81, 0x02,       /*   Input (Data, Variable, Absolute) */
+	0x85, 0x02,       /*   Report ID (2) */
+	0x19, 0x21,       /*   Usage Minimum (0x21) */
+	0x29, 0x28,       /*   Usage Maximum (0x28) */
+	0x16, 0x00, 0xF8, /*   Logical Minimum (-2048) */
+	0x26, 0xFF, 0x07, /*   Logical Maximum (2047) */
+	0x75, 0x0C,       /*   Report Size (12) */
+	0x95, 0x08,       /*   Report Count (8) */
+	0x81, 0x02,       /*   Input (Data, Variable, Absolute) */
+	0x09, 0x30,       /*   Usage (0x30) */
+	0x15, 0x00,       /*   Logical Minimum (0) */
+	0x27, 0xFF, 0xFF, 0xFF, 0x7F, /* Logical Maximum (0x7FFFFFFF) */
+	0x75, 0x20,       /*   Report Size (32) */
+	0x95, 0x01,       /*   Report Count (1) */
+	0x81, 0x02,       /*   Input (Data, Variable, Absolute) */
+	0x85, 0x03,       /*   Report ID (3) */
+	0x19, 0x41,       /*   Usage Minimum (0x41) */
+	0x29, 0x50,       /*   Usage Maximum (0x50) */
+	0x15, 0x80,       /*   Logical Minimum (-128) */
+	0x25, 0x7F,       /*   Logical Maximum (127) */
+	0x75, 0x08,       /*   Report Size (8) */
+	0x95, 0x10,       /*   Report Count (16) */
+	0x81, 0x02,       /*   Input (Data, Variable, Absolute) */
+	0x05, 0x09,       /*   Usage Page (Button) */
+	0x19, 0x01,       /*   Usage Minimum (1) */
+	0x29, 0x04,       /*   Usage Maximum (4) */
+	0x15, 0x00,       /*   Logical Minimum (0) */
+	0x25, 0x01,       /*   Logical Maximum (1) */
+	0x75, 0x01,       /*   Report Size (1) */
+	0x95, 0x04,       /*   Report Count (4) */
+	0x81, 0x02,       /*   Input (Data, Variable, Absolute) */
+	0x75, 0x04,       /*   Report Size (4) */
+	0x95, 0x01,       /*   Report Count (1) */
+	0x81, 0x03,       /*   Input (Constant, Variable) */
+	0x06, 0x00, 0xFF, /*   Usage Page (Vendor 0xFF00) */
+	0x85, 0x02,       /*   Report ID (2) */
+	0x19, 0x61,       /*   Usage Minimum (0x61) */
+	0x29, 0x68,       /*   Usage Maximum (0x68) */
+	0x75, 0x01,       /*   Report Size (1) */
+	0x95, 0x08,       /*   Report Count (8) */
+	0x91, 0x02,       /*   Output (Data, Variable, Absolute) */
+	0x85, 0x04,       /*   Report ID (4) */
+	0x09, 0x70,       /*   Usage (0x70) */
+	0x26, 0xFF, 0x00, /*   Logical Maximum (255) */
+	0x75, 0x08,       /*   Report Size (8) */
+	0x95, 0x01,       /*   Report Count (1) */
+	0xB1, 0x02,       /*   Feature (Data, Variable, Absolute) */
+	0xC0,             /* End Collection */
+};
+
+/* Consecutive fields which only differ in their Usage, and follow each
+   other in the report. Variable fields get one Usage each, from usage
+   on. An Array field has usage_maximum set, and repeat 1. */
+struct expected_fields {
+	unsigned short usage_page;
+	unsigned short usage;
+	unsigned short usage_maximum;
+	unsigned short bit_size;
+	unsigned short count;
+	unsigned int bit_offset;
+	int logical_minimum;
+	int logical_maximum;
+	unsigned int flags;
+	int repeat;
+};
+
+struct expected_report {
+	unsigned char report_id;
+	hid_report_type type;
+	size_t size;
+	const struct expected_fields *fields;
+	size_t num_fields;
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define REPORT(id, type, size, fields) { id, type, size, fields, ARRAY_SIZE(fields) }
+
+static const struct expected_fields keyboard_input[] = {
+	{ 0x07, 0xE0, 0, 1, 1, 0, 0, 1, 0x02, 8 },
+	{ 0x07, 0x00, 0x65, 8, 6, 16, 0, 101, 0x00, 1 },
+};
+static const struct expected_fields keyboard_output[] = {
+	{ 0x08, 0x01, 0, 1, 1, 0, 0, 1, 0x02, 5 },
+};
+static const struct expected_report keyboard_layout[] = {
+	REPORT(0, HID_REPORT_TYPE_INPUT, 8, keyboard_input),
+	REPORT(0, HID_REPORT_TYPE_OUTPUT, 1, keyboard_output),
+};
+
+static const struct expected_fields mouse_input[] = {
+	{ 0x09, 0x01, 0, 1, 1, 0, 0, 1, 0x02, 3 },
+	{ 0x01, 0x30, 0, 8, 1, 8, -127, 127, 0x06, 1 },
+	{ 0x01, 0x31, 0, 8, 1, 16, -127, 127, 0x06, 1 },
+	{ 0x01, 0x38, 0, 8, 1, 24, -127, 127, 0x06, 1 },
+};
+static const struct expected_report mouse_layout[] = {
+	REPORT(0, HID_REPORT_TYPE_INPUT, 4, mouse_input),
+};
+
+static const struct expected_fields vendor_input_1[] = {
+	{ 0xFF00, 0x01, 0, 8, 1, 0, 0, 255, 0x02, 20 },
+};
+static const struct expected_fields vendor_input_2[] = {
+	{ 0xFF00, 0x21, 0, 12, 1, 0, -2048, 2047, 0x02, 8 },
+	{ 0xFF00, 0x30, 0, 32, 1, 96, 0, 0x7FFFFFFF, 0x02, 1 },
+};
+static const struct expected_fields vendor_input_3[] = {
+	{ 0xFF00, 0x41, 0, 8, 1, 0, -128, 127, 0x02, 16 },
+	{ 0x09, 0x01, 0, 1, 1, 128, 0, 1, 0x02, 4 },
+};
+static const struct expected_fields vendor_output_2[] = {
+	{ 0xFF00, 0x61, 0, 1, 1, 0, 0, 1, 0x02, 8 },
+};
+static const struct expected_fields vendor_feature_4[] = {
+	{ 0xFF00, 0x70, 0, 8, 1, 0, 0, 255, 0x02, 1 },
+};
+static const struct expected_report vendor_layout[] = {
+	REPORT(1, HID_REPORT_TYPE_INPUT, 20, vendor_input_1),
+	REPORT(2, HID_REPORT_TYPE_INPUT, 16, vendor_input_2),
+	REPORT(3, HID_REPORT_TYPE_INPUT, 17, vendor_input_3),
+	REPORT(2, HID_REPORT_TYPE_OUTPUT, 1, vendor_output_2),
+	REPORT(4, HID_REPORT_TYPE_FEATURE, 1, vendor_feature_4),
+};
+
+static int failures = 0;
+
+static void fail(const char *name, const char *what)
+{
+	printf("FAIL %s: %s\n", name, what);
+	failures++;
+}
+
+static int field_matches(const struct hid_report_field *f, const struct expected_fields *e, int i)
+{
+	return f->usage_page == e->usage_page &&
+		f->usage == e->usage + i &&
+		f->usage_maximum == (e->usage_maximum ? e->usage_maximum : e->usage + i) &&
+		f->bit_size == e->bit_size &&
+		f->count == e->count &&
+		f->bit_offset == e->bit_offset + (unsigned int) i * e->bit_size &&
+		f->logical_minimum == e->logical_minimum &&
+		f->logical_maximum == e->logical_maximum &&
+		f->flags == e->flags;
+}
+
+static void check_layout(const char *name, const struct hid_report_layout *layout, int uses_numbered_reports, const struct expected_report *expected, size_t num_expected)
+{
+	size_t i, j, k;
+
+	if (!layout) {
+		fail(name, "no layout");
+		return;
+	}
+	if (layout->uses_numbered_reports != uses_numbered_reports)
+		fail(name, "uses_numbered_reports");
+	if (layout->num_reports != num_expected) {
+		fail(name, "number of reports");
+		return;
+	}
+
+	for (i = 0; i < num_expected; i++) {
+		const struct hid_report_info *report = &layout->reports[i];
+		const struct expected_report *e = &expected[i];
+		size_t num_fields = 0;
+		char what[64];
+
+		snprintf(what, sizeof(what), "report %zu", i);
+		if (report->report_id != e->report_id || report->type != e->type || report->size != e->size) {
+			fail(name, what);
+			continue;
+		}
+
+		for (j = 0; j < e->num_fields; j++)
+			num_fields += (size_t) e->fields[j].repeat;
+		if (report->num_fields != num_fields) {
+			fail(name, what);
+			continue;
+		}
+
+		num_fields = 0;
+		for (j = 0; j < e->num_fields; j++) {
+			for (k = 0; k < (size_t) e->fields[j].repeat; k++) {
+				if (!field_matches(&report->fields[num_fields++], &e->fields[j], (int) k)) {
+					snprintf(what, sizeof(what), "report %zu, field %zu", i, num_fields - 1);
+					fail(name, what);
+				}
+			}
+		}
+	}
+}
+
+/* Which of the vector paths hid_decode_report() may take */
+enum decode_mode {
+	DECODE_SCALAR,
+	DECODE_SSE2,
+	DECODE_AVX2,
+};
+
+static const char *decode_mode_names[] = { "scalar", "SSE2", "AVX2" };
+
+/* Force the decoders of a device to a mode, by turning off the runs and
+   the AVX2 flag it mustn't use. The run kinds are restored from
+   kinds. */
+static void set_decode_mode(hid_device *dev, enum decode_mode mode, enum decode_run_kind kinds[REPORT_ID_COUNT][64])
+{
+	int id;
+	size_t i;
+
+	for (id = 0; id < REPORT_ID_COUNT; id++) {
+		struct report_decoder *decoder = dev->input_decoders[id];
+		if (!decoder)
+			continue;
+
+		for (i = 0; i < decoder->num_runs && i < 64; i++)
+			decoder->runs[i].kind = (mode == DECODE_SCALAR) ? DECODE_RUN_SCALAR : kinds[id][i];
+		decoder->use_avx2 = (mode == DECODE_AVX2);
+	}
+}
+
+/* Whether a decoder has a run of the kind, so that a vector path is
+   actually taken. */
+static int has_run(const hid_device *dev, int report_id, enum decode_run_kind kind)
+{
+	const struct report_decoder *decoder = dev->input_decoders[report_id];
+	size_t i;
+
+	for (i = 0; decoder && i < decoder->num_runs; i++)
+		if (decoder->runs[i].kind == kind && decoder->runs[i].count >= 8)
+			return 1;
+	return 0;
+}
+
+static void check_decode(const char *name, hid_device *dev, const unsigned char *data, size_t length, const int *expected, size_t num_expected)
+{
+	int values[64];
+	int res;
+	size_t i;
+
+	memset(values, 0x55, sizeof(values));
+	res = hid_decode_report(dev, data, length, values, ARRAY_SIZE(values));
+	if (res != (int) num_expected) {
+		fail(name, "number of values");
+		return;
+	}
+
+	for (i = 0; i < num_expected; i++) {
+		if (values[i] != expected[i]) {
+			char what[64];
+			snprintf(what, sizeof(what), "value %zu is %d, not %d", i, values[i], expected[i]);
+			fail(name, what);
+		}
+	}
+}
+
+/* Write a value of bit_size bits at bit_offset, little endian. */
+static void put_bits(unsigned char *data, unsigned int bit_offset, unsigned int bit_size, unsigned int value)
+{
+	unsigned int i;
+
+	for (i = 0; i < bit_size; i++, bit_offset++) {
+		if (value & (1u << i))
+			data[bit_offset / 8] |= (unsigned char) (1u << (bit_offset % 8));
+	}
+}
+
+/* Set up a device as hid_open_path() does, from a report descriptor. */
+static int init_device(hid_device *dev, unsigned char *descriptor, size_t size)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->report_layout = create_report_layout(descriptor, (__u32) size);
+	if (!dev->report_layout)
+		return -1;
+	dev->uses_numbered_reports = dev->report_layout->uses_numbered_reports;
+	dev->input_decoders = create_report_decoders(dev->report_layout);
+	return dev->input_decoders ? 0 : -1;
+}
+
+static void free_device(hid_device *dev)
+{
+	free_report_decoders(dev->input_decoders);
+	free(dev->report_layout);
+	free_error(&dev->last_error);
+}
+
+static void check_keyboard(enum decode_mode mode)
+{
+	/* Left Shift and Right Alt, 'a' to 'f' */
+	static const unsigned char report[8] = { 0x42, 0x00, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
+	static const int expected[] = { 0, 1, 0, 0, 0, 0, 1, 0, 4, 5, 6, 7, 8, 9 };
+	static const int expected_short[] = { 0, 1, 0, 0, 0, 0, 1, 0, 4, 5, 0, 0, 0, 0 };
+	enum decode_run_kind kinds[REPORT_ID_COUNT][64];
+	hid_device dev;
+	size_t i;
+
+	if (init_device(&dev, keyboard_descriptor, sizeof(keyboard_descriptor)) < 0) {
+		fail("keyboard", "no layout");
+		free_device(&dev);
+		return;
+	}
+	if (mode == DECODE_SCALAR)
+		check_layout("keyboard", dev.report_layout, 0, keyboard_layout, ARRAY_SIZE(keyboard_layout));
+
+	for (i = 0; i < dev.input_decoders[0]->num_runs && i < 64; i++)
+		kinds[0][i] = dev.input_decoders[0]->runs[i].kind;
+	set_decode_mode(&dev, mode, kinds);
+
+	check_decode("keyboard", &dev, report, sizeof(report), expected, ARRAY_SIZE(expected));
+
+	/* The values missing from a short report are 0. */
+	check_decode("keyboard, short report", &dev, report, 4, expected_short, ARRAY_SIZE(expected_short));
+
+	free_device(&dev);
+}
+
+static void check_mouse(enum decode_mode mode)
+{
+	/* Buttons 1 and 3, X -5, Y 16, wheel -127 */
+	static const unsigned char report[4] = { 0x05, 0xFB, 0x10, 0x81 };
+	static const int expected[] = { 1, 0, 1, -5, 16, -127 };
+	enum decode_run_kind kinds[REPORT_ID_COUNT][64];
+	hid_device dev;
+	size_t i;
+
+	if (init_device(&dev, mouse_descriptor, sizeof(mouse_descriptor)) < 0) {
+		fail("mouse", "no layout");
+		free_device(&dev);
+		return;
+	}
+	if (mode == DECODE_SCALAR)
+		check_layout("mouse", dev.report_layout, 0, mouse_layout, ARRAY_SIZE(mouse_layout));
+
+	for (i = 0; i < dev.input_decoders[0]->num_runs && i < 64; i++)
+		kinds[0][i] = dev.input_decoders[0]->runs[i].kind;
+	set_decode_mode(&dev, mode, kinds);
+
+	check_decode("mouse", &dev, report, sizeof(report), expected, ARRAY_SIZE(expected));
+
+	free_device(&dev);
+}
+
+static void check_vendor(enum decode_mode mode)
+{
+	static const int axes[8] = { -2048, 2047, -1, 0, 1, -100, 1000, -1234 };
+	static const int buttons[4] = { 1, 0, 1, 1 };
+	enum decode_run_kind kinds[REPORT_ID_COUNT][64];
+	unsigned char report[21];
+	int expected[24];
+	hid_device dev;
+	int id;
+	size_t i;
+
+	if (init_device(&dev, vendor_descriptor, sizeof(vendor_descriptor)) < 0) {
+		fail("vendor", "no layout");
+		free_device(&dev);
+		return;
+	}
+	if (mode == DECODE_SCALAR) {
+		check_layout("vendor", dev.report_layout, 1, vendor_layout, ARRAY_SIZE(vendor_layout));
+
+		/* Make sure the vector paths are tried at all. */
+		if (!has_run(&dev, 1, DECODE_RUN_BYTES) || !has_run(&dev, 3, DECODE_RUN_BYTES))
+			fail("vendor", "no run of bytes");
+		if (!has_run(&dev, 2, DECODE_RUN_GATHER))
+			fail("vendor", "no run to gather");
+	}
+
+	for (id = 0; id < REPORT_ID_COUNT; id++)
+		for (i = 0; dev.input_decoders[id] && i < dev.input_decoders[id]->num_runs && i < 64; i++)
+			kinds[id][i] = dev.input_decoders[id]->runs[i].kind;
+	set_decode_mode(&dev, mode, kinds);
+
+	/* Report 1, unsigned bytes */
+	report[0] = 1;
+	for (i = 0; i < 20; i++) {
+		report[1 + i] = (unsigned char) (i * 13 + 200);
+		expected[i] = (unsigned char) (i * 13 + 200);
+	}
+	check_decode("vendor, report 1", &dev, report, 21, expected, 20);
+
+	/* Report 2, 12-bit signed values and a 32-bit value */
+	memset(report, 0, sizeof(report));
+	report[0] = 2;
+	for (i = 0; i < 8; i++) {
+		put_bits(report + 1, (unsigned int) i * 12, 12, (unsigned int) axes[i] & 0xfff);
+		expected[i] = axes[i];
+	}
+	put_bits(report + 1, 96, 32, 0x12345678);
+	expected[8] = 0x12345678;
+	check_decode("vendor, report 2", &dev, report, 17, expected, 9);
+
+	/* Report 3, signed bytes and buttons */
+	memset(report, 0, sizeof(report));
+	report[0] = 3;
+	for (i = 0; i < 16; i++) {
+		report[1 + i] = (unsigned char) (i * 17 - 128);
+		expected[i] = (signed char) (i * 17 - 128);
+	}
+	for (i = 0; i < 4; i++) {
+		put_bits(report + 1, 128 + (unsigned int) i, 1, (unsigned int) buttons[i]);
+		expected[16 + i] = buttons[i];
+	}
+	check_decode("vendor, report 3", &dev, report, 18, expected, 20);
+
+	/* Output and feature reports aren't decoded. */
+	report[0] = 4;
+	if (hid_decode_report(&dev, report, 2, expected, ARRAY_SIZE(expected)) != -1)
+		fail("vendor", "decoded an unknown report");
+
+	free_device(&dev);
+}
+
+int main(void)
+{
+	enum decode_mode mode;
+
+	for (mode = DECODE_SCALAR; mode <= DECODE_AVX2; mode++) {
+#ifndef HAVE_SSE2_DECODE
+		if (mode == DECODE_SSE2) {
+			printf("SKIP SSE2: not built in\n");
+			continue;
+		}
+#endif
+#ifdef HAVE_AVX2_DECODE
+		if (mode == DECODE_AVX2 && !__builtin_cpu_supports("avx2")) {
+			printf("SKIP AVX2: not supported by this CPU\n");
+			continue;
+		}
+#else
+		if (mode == DECODE_AVX2) {
+			printf("SKIP AVX2: not built in\n");
+			continue;
+		}
+#endif
+		printf("Decoding with the %s path\n", decode_mode_names[mode]);
+		check_keyboard(mode);
+		check_mouse(mode);
+		check_vendor(mode);
+	}
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Checks the sysfs enumeration of the hidraw implementation (see
+ HIDAPI_SYSFS_ENUMERATION) against a made-up sysfs tree. It has a
+ device directly below its USB interface, one behind a receiver, whose
+ HID device sits below the receiver's as with hid-logitech-dj, and a
+ uhid device. The implementation is included, so that it can be
+ pointed at the tree.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+#ifndef HIDAPI_SYSFS_ENUMERATION
+#define HIDAPI_SYSFS_ENUMERATION
+#endif
+#include "../linux/hid.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define USB_DEVICE "devices/pci0000:00/0000:00:14.0/usb1/1-1"
+#define RECEIVER USB_DEVICE "/1-1:1.2/0003:046D:C52B.0003"
+#define UHID "devices/virtual/misc/uhid"
+
+/* A mouse, so that the records get a usage */
+static const unsigned char report_descriptor[] = {
+	0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+	0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05,
+	0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81,
+	0x25, 0x7F, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06, 0xC0, 0xC0,
+};
+
+static char root[] = "/tmp/hidapi-sysfs-XXXXXX";
+static int failures = 0;
+
+static void fail(const char *name, const char *what)
+{
+	printf("FAIL %s: %s\n", name, what);
+	failures++;
+}
+
+/* Create a file, or a directory if contents is NULL, with its parents,
+   below the root. */
+static void create(const char *path, const char *contents, size_t length)
+{
+	char full[PATH_MAX];
+	char *p;
+	FILE *f;
+
+	snprintf(full, sizeof(full), "%s/%s", root, path);
+	for (p = full + strlen(root) + 1; (p = strchr(p, '/')) != NULL; p++) {
+		*p = '\0';
+		mkdir(full, 0755);
+		*p = '/';
+	}
+
+	if (!contents) {
+		mkdir(full, 0755);
+		return;
+	}
+
+	f = fopen(full, "w");
+	if (f) {
+		fwrite(contents, 1, length, f);
+		fclose(f);
+	}
+}
+
+static void create_file(const char *dir, const char *name, const char *contents)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	create(path, contents, strlen(contents));
+}
+
+/* Create a symbolic link below the root. */
+static void create_link(const char *path, const char *target)
+{
+	char full[PATH_MAX];
+
+	snprintf(full, sizeof(full), "%s/%s", root, path);
+	if (symlink(target, full) < 0)
+		fail("tree", full);
+}
+
+/* Create the directory of a device, with its uevent, and its subsystem
+   link, unless subsystem is NULL. depth is the number of directories
+   the device is below the root. */
+static void create_device(const char *dir, const char *subsystem, int depth, const char *uevent)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+	int i;
+
+	create(dir, NULL, 0);
+	create_file(dir, "uevent", uevent);
+
+	if (subsystem) {
+		target[0] = '\0';
+		for (i = 0; i < depth; i++)
+			strcat(target, "../");
+		strcat(target, "bus/");
+		strcat(target, subsystem);
+		snprintf(path, sizeof(path), "%s/subsystem", dir);
+		create_link(path, target);
+	}
+}
+
+/* Create a HID device with its hidraw node, and the node's entry in
+   class/hidraw. */
+static void create_hid_device(const char *dir, int depth, const char *uevent, const char *hidraw)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+
+	create_device(dir, "hid", depth, uevent);
+	snprintf(path, sizeof(path), "%s/report_descriptor", dir);
+	create(path, (const char*) report_descriptor, sizeof(report_descriptor));
+
+	snprintf(path, sizeof(path), "%s/hidraw/%s", dir, hidraw);
+	create_device(path, "hidraw", depth + 2, "MAJOR=243\nMINOR=0\n");
+	snprintf(path, sizeof(path), "%s/hidraw/%s/device", dir, hidraw);
+	create_link(path, "../..");
+
+	snprintf(path, sizeof(path), "class/hidraw/%s", hidraw);
+	snprintf(target, sizeof(target), "../../%s/hidraw/%s", dir, hidraw);
+	create_link(path, target);
+}
+
+static void create_tree(void)
+{
+	create("bus/usb", NULL, 0);
+	create("bus/hid", NULL, 0);
+	create("bus/hidraw", NULL, 0);
+	create("class/hidraw", NULL, 0);
+
+	/* /sys/devices has no uevent, the walk up the tree ends there. */
+	create_device("devices/pci0000:00", NULL, 2, "");
+	create_device("devices/pci0000:00/0000:00:14.0", "pci", 3, "DRIVER=xhci_hcd\n");
+	create_device("devices/pci0000:00/0000:00:14.0/usb1", "usb", 4, "DEVTYPE=usb_device\nDRIVER=usb\n");
+	create_file("devices/pci0000:00/0000:00:14.0/usb1", "bcdDevice", "0515\n");
+
+	create_device(USB_DEVICE, "usb", 5, "MAJOR=189\nMINOR=1\nDEVTYPE=usb_device\nDRIVER=usb\n");
+	create_file(USB_DEVICE, "bcdDevice", "1201\n");
+	create_file(USB_DEVICE, "manufacturer", "Logitech\n");
+	create_file(USB_DEVICE, "product", "USB Receiver\n");
+
+	/* Interface 0: a keyboard, directly below the interface */
+	create_device(USB_DEVICE "/1-1:1.0", "usb", 6, "DEVTYPE=usb_interface\nDRIVER=usbhid\n");
+	create_file(USB_DEVICE "/1-1:1.0", "bInterfaceNumber", "00\n");
+	create_hid_device(USB_DEVICE "/1-1:1.0/0003:046D:C52B.0001", 7,
+		"DRIVER=hid-generic\nHID_ID=0003:0000046D:0000C52B\nHID_NAME=Logitech USB Receiver\nHID_UNIQ=\n",
+		"hidraw0");
+
+	/* Interface 2: the receiver, and a mouse paired with it */
+	create_device(USB_DEVICE "/1-1:1.2", "usb", 6, "DEVTYPE=usb_interface\nDRIVER=usbhid\n");
+	create_file(USB_DEVICE "/1-1:1.2", "bInterfaceNumber", "02\n");
+	create_hid_device(RECEIVER, 7,
+		"DRIVER=logitech-djreceiver\nHID_ID=0003:0000046D:0000C52B\nHID_NAME=Logitech USB Receiver\nHID_UNIQ=\n",
+		"hidraw2");
+	create_hid_device(RECEIVER "/0003:046D:4082.0005", 8,
+		"DRIVER=logitech-hidpp-device\nHID_ID=0003:0000046D:00004082\nHID_NAME=Logitech MX Master 3\nHID_UNIQ=4082-5e-de-ad\n",
+		"hidraw5");
+
+	/* A uhid device claiming to be on USB */
+	create_device("devices/virtual", NULL, 2, "");
+	create("devices/virtual/misc", NULL, 0);
+	create_device(UHID, "misc", 4, "MAJOR=10\nMINOR=239\nDEVNAME=uhid\n");
+	create_hid_device(UHID "/0003:1234:5678.0007", 5,
+		"DRIVER=hid-generic\nHID_ID=0003:00001234:00005678\nHID_NAME=Virtual Mouse\nHID_UNIQ=v1\n",
+		"hidraw7");
+}
+
+static void check_device(int class_fd, const char *name, const struct hid_enumerate_filter *filter,
+	unsigned short product_id, unsigned short release_number, int interface_number,
+	const wchar_t *manufacturer, const wchar_t *product, const wchar_t *serial_number)
+{
+	struct hid_device_info *info;
+
+	info = create_device_info_for_sysfs_node(class_fd, name, filter, 1, NULL);
+	if (!info) {
+		fail(name, "no record");
+		return;
+	}
+
+	if (info->vendor_id != (product_id == 0x5678 ? 0x1234 : 0x046D) || info->product_id != product_id)
+		fail(name, "VID/PID");
+	if (info->release_number != release_number)
+		fail(name, "release number");
+	if (info->interface_number != interface_number)
+		fail(name, "interface number");
+	if (!info->manufacturer_string || wcscmp(info->manufacturer_string, manufacturer) != 0)
+		fail(name, "manufacturer");
+	if (!info->product_string || wcscmp(info->product_string, product) != 0)
+		fail(name, "product");
+	if (!info->serial_number || wcscmp(info->serial_number, serial_number) != 0)
+		fail(name, "serial number");
+	if (info->usage_page != 0x01 || info->usage != 0x02)
+		fail(name, "usage");
+
+	hid_free_enumeration(info);
+}
+
+int main(void)
+{
+	struct hid_enumerate_filter filter;
+	struct hid_device_info *info;
+	char path[PATH_MAX];
+	int class_fd;
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	create_tree();
+
+	snprintf(path, sizeof(path), "%s/class/hidraw", root);
+	class_fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (class_fd < 0) {
+		fail("tree", path);
+	}
+	else {
+		check_device(class_fd, "hidraw0", &match_all_devices, 0xC52B, 0x1201, 0, L"Logitech", L"USB Receiver", L"");
+		check_device(class_fd, "hidraw2", &match_all_devices, 0xC52B, 0x1201, 2, L"Logitech", L"USB Receiver", L"");
+		check_device(class_fd, "hidraw5", &match_all_devices, 0x4082, 0x1201, 2, L"Logitech", L"USB Receiver", L"4082-5e-de-ad");
+		check_device(class_fd, "hidraw7", &match_all_devices, 0x5678, 0, -1, L"", L"Virtual Mouse", L"v1");
+
+		/* The interface of the device behind the receiver is that of
+		   the receiver. */
+		memset(&filter, 0, sizeof(filter));
+		filter.flags = HID_API_ENUMERATE_MATCH_INTERFACE;
+		filter.interface_number = 2;
+		check_device(class_fd, "hidraw5", &filter, 0x4082, 0x1201, 2, L"Logitech", L"USB Receiver", L"4082-5e-de-ad");
+		filter.interface_number = 0;
+		info = create_device_info_for_sysfs_node(class_fd, "hidraw5", &filter, 1, NULL);
+		if (info) {
+			fail("hidraw5", "matched interface 0");
+			hid_free_enumeration(info);
+		}
+
+		close(class_fd);
+	}
+
+	snprintf(path, sizeof(path), "rm -rf %s", root);
+	if (system(path) != 0)
+		printf("Could not remove %s\n", root);
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
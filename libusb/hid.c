@@ -32,6 +32,7 @@
 #include <ctype.h>
 #include <locale.h>
 #include <errno.h>
+#include <limits.h>
 
 /* Unix */
 #include <unistd.h>
@@ -40,8 +41,12 @@
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <wchar.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 /* GNU / LibUSB */
 #include <libusb.h>
@@ -51,67 +56,6 @@
 
 #include "hidapi.h"
 
-#if defined(__ANDROID__) && __ANDROID_API__ < __ANDROID_API_N__
-
-/* Barrier implementation because Android/Bionic don't have pthread_barrier.
-   This implementation came from Brent Priddy and was posted on
-   StackOverflow. It is used with his permission. */
-typedef int pthread_barrierattr_t;
-typedef struct pthread_barrier {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int count;
-    int trip_count;
-} pthread_barrier_t;
-
-static int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
-{
-	if(count == 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	if(pthread_mutex_init(&barrier->mutex, 0) < 0) {
-		return -1;
-	}
-	if(pthread_cond_init(&barrier->cond, 0) < 0) {
-		pthread_mutex_destroy(&barrier->mutex);
-		return -1;
-	}
-	barrier->trip_count = count;
-	barrier->count = 0;
-
-	return 0;
-}
-
-static int pthread_barrier_destroy(pthread_barrier_t *barrier)
-{
-	pthread_cond_destroy(&barrier->cond);
-	pthread_mutex_destroy(&barrier->mutex);
-	return 0;
-}
-
-static int pthread_barrier_wait(pthread_barrier_t *barrier)
-{
-	pthread_mutex_lock(&barrier->mutex);
-	++(barrier->count);
-	if(barrier->count >= barrier->trip_count)
-	{
-		barrier->count = 0;
-		pthread_cond_broadcast(&barrier->cond);
-		pthread_mutex_unlock(&barrier->mutex);
-		return 1;
-	}
-	else
-	{
-		pthread_cond_wait(&barrier->cond, &(barrier->mutex));
-		pthread_mutex_unlock(&barrier->mutex);
-		return 0;
-	}
-}
-
-#endif
-
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -134,14 +78,43 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Default number of input reports which are buffered before the queue
+   policy is applied. This way we don't grow forever if the user never
+   reads anything from the device. See hid_set_input_queue_size(). */
+#define INPUT_REPORT_QUEUE_SIZE 32
+
+/* A slot in the ring of input reports received from the device. The
+   data of all slots lives in one buffer which is allocated once in
+   hid_open_path(), so queueing a report never allocates. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
-	struct input_report *next;
 };
 
 
+/* Number of writes of hid_write_async() which can be in flight for a
+   device. */
+#define MAX_OUTPUT_TRANSFERS 16
+
+/* A transfer of hid_write_async(), and what to do when it's done. */
+struct output_transfer {
+	hid_device *dev;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	size_t buffer_size;
+
+	int skipped_report_id; /* boolean */
+	hid_write_callback callback;
+	void *user_data;
+};
+
+/* A report of hid_write() waiting in the output queue */
+struct queued_report {
+	struct queued_report *next;
+	size_t length;
+	unsigned char data[];
+};
+
 struct hid_device_ {
 	/* Handle to the actual device. */
 	libusb_device_handle *device_handle;
@@ -159,20 +132,80 @@ struct hid_device_ {
 	int product_index;
 	int serial_index;
 
+	/* Language to read the strings in, see get_usb_language().
+	   Looked up on the first string read. */
+	uint16_t language_id;
+	int language_id_valid; /* boolean */
+
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
-	pthread_t thread;
+	/* Read objects. The transfers are handled by the event thread
+	   which is shared by all devices. */
 	pthread_mutex_t mutex; /* Protects input_reports */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
 	int transfer_loop_finished;
-	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
+	/* Interrupt IN transfers, all of which are kept in flight so
+	   that the host controller always has one queued. The arrays have
+	   room for MAX_INPUT_TRANSFERS. */
+	struct libusb_transfer **transfers;
+	int num_transfers;
+	int transfers_in_flight; /* Protected by mutex */
+	/* See hid_set_input_transfer_count(). Transfers beyond this
+	   number are retired when they complete, and kept for reuse.
+	   Protected by mutex. */
+	int input_transfer_count;
+	struct libusb_transfer **idle_transfers;
+	int num_idle_transfers;
+
+	/* Ring of received input reports. */
 	struct input_report *input_reports;
+	uint8_t *input_report_buf; /* Backing storage of all slots */
+	size_t input_report_capacity; /* Number of slots */
+	size_t input_report_head; /* Index of the oldest queued report */
+	size_t input_report_count; /* Number of queued reports */
+	hid_input_queue_policy input_queue_policy;
+	unsigned long dropped_input_reports;
+
+	/* Transfers whose reports didn't fit into a full queue, with the
+	   HID_INPUT_QUEUE_BLOCK policy, oldest first. They are resubmitted
+	   once hid_read() makes room. */
+	struct libusb_transfer **held_transfers;
+	int num_held_transfers;
+
+	/* File descriptor which is readable while input reports are
+	   queued or the device has been shut down, created on demand by
+	   hid_get_pollable_fd(). This is an eventfd where available (both
+	   entries are the same), otherwise the read and write ends of a
+	   pipe. Protected by mutex. */
+	int pollable_fd[2];
+	int pollable_fd_signalled; /* boolean */
+
+	/* Transfers for hid_write_async(), allocated on demand and kept
+	   for reuse. Protected by mutex. */
+	struct output_transfer *output_transfers[MAX_OUTPUT_TRANSFERS];
+	int num_output_transfers;
+	struct output_transfer *idle_output_transfers[MAX_OUTPUT_TRANSFERS];
+	int num_idle_output_transfers;
+	/* Writes whose callbacks haven't returned yet */
+	int writes_in_flight;
+
+	/* Timeouts of the transfers in milliseconds, 0 for none, see
+	   hid_set_timeout(). Protected by mutex. */
+	unsigned int read_timeout;
+	unsigned int write_timeout;
+	unsigned int control_timeout;
+
+	/* hid_set_output_queue(). The reports of hid_write() are sent one
+	   at a time with hid_write_async(); the rest wait here, at most one
+	   per Report ID. Protected by mutex. */
+	int output_queue;
+	struct queued_report *queued_reports;
+	struct queued_report **queued_reports_tail;
+	int queued_report_in_flight; /* boolean */
+	int queued_report_failed; /* boolean */
 
 	/* Was kernel driver detached by libusb */
 #ifdef DETACH_KERNEL_DRIVER
@@ -188,25 +221,97 @@ static struct hid_api_version api_version = {
 
 static libusb_context *usb_context = NULL;
 
+/* USB language ID of the locale, looked up by hid_init(). */
+static uint16_t locale_language_id = 0x0;
+
+#if !defined(__ANDROID__) && !defined(NO_ICONV)
+/* Converter from USB strings to wchar_t, opened on first use and shared
+   by all threads. */
+static pthread_mutex_t usb_string_iconv_mutex = PTHREAD_MUTEX_INITIALIZER;
+static iconv_t usb_string_iconv = (iconv_t)-1;
+#endif
+
+/* Thread which handles the libusb events, and thereby runs
+   read_callback(), for all open devices. It is started along with the
+   first device and stopped when the last device is closed. */
+static pthread_mutex_t event_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t event_thread;
+static int event_thread_refcount = 0;
+static int event_thread_shutdown = 0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+#endif
+
+/* Number of interrupt IN transfers kept in flight for a device, see
+   hid_set_input_transfer_count(). With two, one is queued at the host
+   controller while the other is being handled. */
+#define DEFAULT_INPUT_TRANSFERS 2
+#define MAX_INPUT_TRANSFERS 64
+
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static void hid_hotplug_exit(void);
+static int hid_hotplug_enumerate_cached(const struct hid_enumerate_filter *filter, struct hid_device_info **devs);
 
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = (hid_device*) calloc(1, sizeof(hid_device));
 	dev->blocking = 1;
+	dev->pollable_fd[0] = -1;
+	dev->pollable_fd[1] = -1;
+	dev->queued_reports_tail = &dev->queued_reports;
+	dev->input_transfer_count = DEFAULT_INPUT_TRANSFERS;
+	dev->read_timeout = 5000;
+	dev->write_timeout = 1000;
+	dev->control_timeout = 1000;
 
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
 
 	return dev;
 }
 
 static void free_hid_device(hid_device *dev)
 {
+	int i;
+
+	/* Free the transfers. They must not be in flight anymore. */
+	for (i = 0; i < dev->num_transfers; i++) {
+		if (dev->transfers[i]) {
+			free(dev->transfers[i]->buffer);
+			libusb_free_transfer(dev->transfers[i]);
+		}
+	}
+	free(dev->transfers);
+	free(dev->held_transfers);
+	free(dev->idle_transfers);
+
+	/* And those of hid_write_async() */
+	for (i = 0; i < dev->num_output_transfers; i++) {
+		libusb_free_transfer(dev->output_transfers[i]->transfer);
+		free(dev->output_transfers[i]->buffer);
+		free(dev->output_transfers[i]);
+	}
+
+	/* And the reports of the output queue which weren't sent */
+	while (dev->queued_reports) {
+		struct queued_report *report = dev->queued_reports;
+		dev->queued_reports = report->next;
+		free(report);
+	}
+
+	/* Free the input report ring */
+	free(dev->input_report_buf);
+	free(dev->input_reports);
+
+	/* Close the pollable file descriptor */
+	if (dev->pollable_fd[0] >= 0)
+		close(dev->pollable_fd[0]);
+	if (dev->pollable_fd[1] >= 0 && dev->pollable_fd[1] != dev->pollable_fd[0])
+		close(dev->pollable_fd[1]);
+
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
@@ -346,65 +451,54 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 #endif
 
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
+/* Pick the language to read the strings of a device in out of its USB
+   string #0: the one of the locale if the device supports it, otherwise
+   the first one it lists. */
+static uint16_t choose_usb_language(const unsigned char *buf, int len)
 {
-	uint16_t buf[32];
-	int len;
+	int i;
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
 	if (len < 4)
 		return 0x0;
 
-	return buf[1]; /* First two bytes are len and descriptor type. */
+	/* Start at 2 because there are two bytes of protocol data.
+	   language IDs are two-bytes each. */
+	for (i = 2; i + 1 < len; i += 2) {
+		if ((buf[i] | (buf[i+1] << 8)) == locale_language_id)
+			return locale_language_id;
+	}
+
+	return buf[2] | (buf[3] << 8);
 }
 
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+/* Get the language to read the strings of a device in, see
+   choose_usb_language(). */
+static uint16_t get_usb_language(libusb_device_handle *dev)
 {
-	uint16_t buf[32];
+	unsigned char buf[64];
 	int len;
-	int i;
 
 	/* Get the string from libusb. */
 	len = libusb_get_string_descriptor(dev,
 			0x0, /* String ID */
 			0x0, /* Language */
-			(unsigned char*)buf,
+			buf,
 			sizeof(buf));
-	if (len < 4)
-		return 0x0;
-
-
-	len /= 2; /* language IDs are two-bytes each. */
-	/* Start at index 1 because there are two bytes of protocol data. */
-	for (i = 1; i < len; i++) {
-		if (buf[i] == lang)
-			return 1;
-	}
 
-	return 0;
+	return choose_usb_language(buf, len);
 }
 
 
 /* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+   string descriptor in buf. The returned string must be freed by using
+   free(). */
+static wchar_t *usb_string_to_wchar(char *buf, int len)
 {
-	char buf[512];
-	int len;
 	wchar_t *str = NULL;
 
 #if !defined(__ANDROID__) && !defined(NO_ICONV) /* we don't use iconv on Android, or when it is explicitly disabled */
 	wchar_t wbuf[256];
 	/* iconv variables */
-	iconv_t ic;
 	size_t inbytes;
 	size_t outbytes;
 	size_t res;
@@ -412,19 +506,7 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	char *outptr;
 #endif
 
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
-
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			idx,
-			lang,
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 0)
+	if (len < 2)
 		return NULL;
 
 #if defined(__ANDROID__) || defined(NO_ICONV)
@@ -449,20 +531,26 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	/* buf does not need to be explicitly NULL-terminated because
 	   it is only passed into iconv() which does not need it. */
 
-	/* Initialize iconv. */
-	ic = iconv_open("WCHAR_T", "UTF-16LE");
-	if (ic == (iconv_t)-1) {
-		LOG("iconv_open() failed\n");
-		return NULL;
+	/* Initialize iconv, once. */
+	pthread_mutex_lock(&usb_string_iconv_mutex);
+	if (usb_string_iconv == (iconv_t)-1) {
+		usb_string_iconv = iconv_open("WCHAR_T", "UTF-16LE");
+		if (usb_string_iconv == (iconv_t)-1) {
+			pthread_mutex_unlock(&usb_string_iconv_mutex);
+			LOG("iconv_open() failed\n");
+			return NULL;
+		}
 	}
 
 	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
-	   Skip the first character (2-bytes). */
+	   Skip the first character (2-bytes). Start from the initial
+	   conversion state, a previous conversion may have failed. */
+	iconv(usb_string_iconv, NULL, NULL, NULL, NULL);
 	inptr = buf+2;
 	inbytes = len-2;
 	outptr = (char*) wbuf;
 	outbytes = sizeof(wbuf);
-	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
+	res = iconv(usb_string_iconv, &inptr, &inbytes, &outptr, &outbytes);
 	if (res == (size_t)-1) {
 		LOG("iconv() failed\n");
 		goto err;
@@ -477,13 +565,34 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	str = wcsdup(wbuf);
 
 err:
-	iconv_close(ic);
+	pthread_mutex_unlock(&usb_string_iconv_mutex);
 
 #endif
 
 	return str;
 }
 
+/* This function returns a newly allocated wide string containing the USB
+   device string numbered by the index, in the language lang (see
+   get_usb_language()). The returned string must be freed by using
+   free(). */
+static wchar_t *get_usb_string(libusb_device_handle *dev, uint16_t lang, uint8_t idx)
+{
+	char buf[512];
+	int len;
+
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			idx,
+			lang,
+			(unsigned char*)buf,
+			sizeof(buf));
+	if (len < 0)
+		return NULL;
+
+	return usb_string_to_wchar(buf, len);
+}
+
 static char *make_path(libusb_device *dev, int interface_number)
 {
 	char str[64];
@@ -496,6 +605,19 @@ static char *make_path(libusb_device *dev, int interface_number)
 	return strdup(str);
 }
 
+/* Take a path of make_path() apart.
+   Returns 0 on success and -1 if the path is malformed. */
+static int parse_path(const char *path, unsigned int *bus_number, unsigned int *device_address, unsigned int *interface_number)
+{
+	int path_len = 0;
+
+	if (sscanf(path, "%x:%x:%x%n", bus_number, device_address, interface_number, &path_len) != 3 ||
+	    path[path_len] != '\0')
+		return -1;
+
+	return 0;
+}
+
 HID_API_EXPORT const struct hid_api_version* HID_API_CALL hid_version()
 {
 	return &api_version;
@@ -519,6 +641,10 @@ int HID_API_EXPORT hid_init(void)
 		locale = setlocale(LC_CTYPE, NULL);
 		if (!locale)
 			setlocale(LC_CTYPE, "");
+
+		/* Look up the language for USB strings once, rather than
+		   for each string. */
+		locale_language_id = get_usb_code_for_current_locale();
 	}
 
 	return 0;
@@ -526,364 +652,1600 @@ int HID_API_EXPORT hid_init(void)
 
 int HID_API_EXPORT hid_exit(void)
 {
+	hid_hotplug_exit();
+
 	if (usb_context) {
 		libusb_exit(usb_context);
 		usb_context = NULL;
 	}
 
+#if !defined(__ANDROID__) && !defined(NO_ICONV)
+	pthread_mutex_lock(&usb_string_iconv_mutex);
+	if (usb_string_iconv != (iconv_t)-1) {
+		iconv_close(usb_string_iconv);
+		usb_string_iconv = (iconv_t)-1;
+	}
+	pthread_mutex_unlock(&usb_string_iconv_mutex);
+#endif
+
 	return 0;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Matches every device, see hid_enumerate_ex(). */
+static const struct hid_enumerate_filter match_all_devices;
+
+/* Whether a record matches the filter. All devices are on USB, which
+   enumerate_devices() checks. */
+static int device_info_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
+	return (filter->vendor_id == 0x0 || filter->vendor_id == info->vendor_id) &&
+	       (filter->product_id == 0x0 || filter->product_id == info->product_id) &&
+	       (filter->usage_page == 0x0 || filter->usage_page == info->usage_page) &&
+	       (filter->usage == 0x0 || filter->usage == info->usage) &&
+	       (!(filter->flags & HID_API_ENUMERATE_MATCH_INTERFACE) || filter->interface_number == info->interface_number) &&
+	       (!filter->serial_number_prefix ||
+	        wcsncmp(info->serial_number ? info->serial_number : L"", filter->serial_number_prefix, wcslen(filter->serial_number_prefix)) == 0);
+}
 
+/* Create the records for the HID interfaces of a device which match
+   the VID, PID and interface number of the filter. The other fields
+   need the strings or the usage, which the caller checks. The strings
+   are only read from the device if read_strings is set. */
+static struct hid_device_info *create_device_info_for_device(libusb_device *dev, const struct hid_enumerate_filter *filter, int read_strings)
+{
+	libusb_device_handle *handle;
 	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int j, k;
+	int interface_num = 0;
 
-	if(hid_init() < 0)
-		return NULL;
-
-	num_devs = libusb_get_device_list(usb_context, &devs);
-	if (num_devs < 0)
-		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
-
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
+	int res = libusb_get_device_descriptor(dev, &desc);
+	unsigned short dev_vid = desc.idVendor;
+	unsigned short dev_pid = desc.idProduct;
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
-
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-						    (product_id == 0x0 || product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
+	res = libusb_get_active_config_descriptor(dev, &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+	if (conf_desc) {
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					interface_num = intf_desc->bInterfaceNumber;
+
+					/* Check the VID/PID and interface against the filter */
+					if ((filter->vendor_id == 0x0 || filter->vendor_id == dev_vid) &&
+					    (filter->product_id == 0x0 || filter->product_id == dev_pid) &&
+					    (!(filter->flags & HID_API_ENUMERATE_MATCH_INTERFACE) || filter->interface_number == interface_num)) {
+						struct hid_device_info *tmp;
+
+						/* VID/PID match. Create the record. */
+						tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
+						if (cur_dev) {
+							cur_dev->next = tmp;
+						}
+						else {
+							root = tmp;
+						}
+						cur_dev = tmp;
 
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
+						/* Fill out the record */
+						cur_dev->next = NULL;
+						cur_dev->path = make_path(dev, interface_num);
 
+						res = LIBUSB_ERROR_NOT_SUPPORTED;
+#ifndef INVASIVE_GET_USAGE
+						/* The device only needs to be opened for its
+						   strings. */
+						if (read_strings)
+#endif
 							res = libusb_open(dev, &handle);
 
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
-
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+						if (res >= 0 && read_strings) {
+							/* The language is the same for all strings. */
+							uint16_t lang = 0x0;
+							if (desc.iSerialNumber > 0 || desc.iManufacturer > 0 || desc.iProduct > 0)
+								lang = get_usb_language(handle);
+
+							/* Serial Number */
+							if (desc.iSerialNumber > 0)
+								cur_dev->serial_number =
+									get_usb_string(handle, lang, desc.iSerialNumber);
+
+							/* Manufacturer and Product strings */
+							if (desc.iManufacturer > 0)
+								cur_dev->manufacturer_string =
+									get_usb_string(handle, lang, desc.iManufacturer);
+							if (desc.iProduct > 0)
+								cur_dev->product_string =
+									get_usb_string(handle, lang, desc.iProduct);
+						}
+
+						if (res >= 0) {
 
 #ifdef INVASIVE_GET_USAGE
 {
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								unsigned char data[256];
+						/*
+						This section is removed because it is too
+						invasive on the system. Getting a Usage Page
+						and Usage requires parsing the HID Report
+						descriptor. Getting a HID Report descriptor
+						involves claiming the interface. Claiming the
+						interface involves detaching the kernel driver.
+						Detaching the kernel driver is hard on the system
+						because it will unclaim interfaces (if another
+						app has them claimed) and the re-attachment of
+						the driver will sometimes change /dev entry names.
+						It is for these reasons that this section is
+						#if 0. For composite devices, use the interface
+						field in the hid_device_info struct to distinguish
+						between interfaces. */
+							unsigned char data[256];
 #ifdef DETACH_KERNEL_DRIVER
-								int detached = 0;
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
+							int detached = 0;
+							/* Usage Page and Usage */
+							res = libusb_kernel_driver_active(handle, interface_num);
+							if (res == 1) {
+								res = libusb_detach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+								else
+									detached = 1;
+							}
 #endif
-								res = libusb_claim_interface(handle, interface_num);
+							res = libusb_claim_interface(handle, interface_num);
+							if (res >= 0) {
+								/* Get the HID Report Descriptor. */
+								res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
 								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
+									unsigned short page=0, usage=0;
+									/* Parse the usage and usage page
+									   out of the report descriptor. */
+									get_usage(data, res,  &page, &usage);
+									cur_dev->usage_page = page;
+									cur_dev->usage = usage;
 								}
 								else
-									LOG("Can't claim interface %d\n", res);
+									LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+								/* Release the interface */
+								res = libusb_release_interface(handle, interface_num);
+								if (res < 0)
+									LOG("Can't release the interface.\n");
+							}
+							else
+								LOG("Can't claim interface %d\n", res);
 #ifdef DETACH_KERNEL_DRIVER
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
+							/* Re-attach kernel driver if necessary. */
+							if (detached) {
+								res = libusb_attach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't re-attach kernel driver.\n");
+							}
 #endif
 }
 #endif /* INVASIVE_GET_USAGE */
 
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
+							libusb_close(handle);
+						}
+						/* VID/PID */
+						cur_dev->vendor_id = dev_vid;
+						cur_dev->product_id = dev_pid;
 
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
+						/* Release Number */
+						cur_dev->release_number = desc.bcdDevice;
 
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
+						/* Interface Number */
+						cur_dev->interface_number = interface_num;
 					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
-		}
+				}
+			} /* altsettings */
+		} /* interfaces */
+		libusb_free_config_descriptor(conf_desc);
 	}
 
-	libusb_free_device_list(devs, 1);
-
 	return root;
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
-{
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
-	}
-}
+/* Number of devices whose strings read_strings() reads at the same
+   time. Each of them has to be opened. */
+#define STRING_READ_BATCH_SIZE 32
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
-{
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+/* The string descriptors of one device, read by read_strings(). */
+struct string_read {
+	libusb_device *device;
+	libusb_device_handle *handle;
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (cur_dev->serial_number &&
-				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
-		}
-		cur_dev = cur_dev->next;
-	}
+	/* The records of the device, which all get the same strings */
+	struct hid_device_info *infos;
+	int num_infos;
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	}
+	/* Indexes of serial number, manufacturer and product string */
+	uint8_t index[3];
+	wchar_t *strings[3];
 
-	hid_free_enumeration(devs);
+	/* USB string #0 for the language, then the strings */
+	struct libusb_transfer *transfers[4];
 
-	return handle;
-}
+	struct string_read_batch *batch;
+};
 
-static void read_callback(struct libusb_transfer *transfer)
+/* Devices whose strings are read at the same time. */
+struct string_read_batch {
+	pthread_mutex_t mutex; /* Protects remaining */
+	int remaining; /* Transfers in flight, plus 1 while submitting */
+	int completed; /* Set once remaining drops to 0 */
+};
+
+static void string_read_callback(struct libusb_transfer *transfer);
+
+/* Submit the transfer for USB string idx in language lang into slot of
+   read->transfers.
+   Returns 0 on success and -1 on failure. */
+static int submit_string_read(struct string_read *read, int slot, uint8_t idx, uint16_t lang)
 {
-	hid_device *dev = transfer->user_data;
-	int res;
+	struct libusb_transfer *transfer;
+	unsigned char *buf;
 
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	transfer = libusb_alloc_transfer(0);
+	buf = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + 255);
+	if (!transfer || !buf)
+		goto err;
 
-		struct input_report *rpt = (struct input_report*) malloc(sizeof(*rpt));
-		rpt->data = (uint8_t*) malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+	libusb_fill_control_setup(buf,
+		LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		(LIBUSB_DT_STRING << 8) | idx,
+		lang,
+		255);
+	/* The same timeout as libusb_get_string_descriptor() */
+	libusb_fill_control_transfer(transfer, read->handle, buf,
+		string_read_callback, read, 1000);
+
+	/* The callback may run on the event thread right away, and finds
+	   out what the transfer is for from its slot. */
+	read->transfers[slot] = transfer;
+	pthread_mutex_lock(&read->batch->mutex);
+	if (libusb_submit_transfer(transfer) < 0) {
+		pthread_mutex_unlock(&read->batch->mutex);
+		read->transfers[slot] = NULL;
+		goto err;
+	}
+	read->batch->remaining++;
+	pthread_mutex_unlock(&read->batch->mutex);
 
-		pthread_mutex_lock(&dev->mutex);
+	return 0;
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
-		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
+err:
+	free(buf);
+	if (transfer)
+		libusb_free_transfer(transfer);
+	return -1;
+}
 
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}
+/* Called by libusb, on the event thread or in read_strings(), when one
+   of the transfers of submit_string_read() is done. */
+static void string_read_callback(struct libusb_transfer *transfer)
+{
+	struct string_read *read = (struct string_read*) transfer->user_data;
+	struct string_read_batch *batch = read->batch;
+	char *data = (char*) libusb_control_transfer_get_data(transfer);
+	int len = transfer->status == LIBUSB_TRANSFER_COMPLETED ? transfer->actual_length : -1;
+	int i;
+
+	if (transfer == read->transfers[0]) {
+		/* The language is known, read the strings in it. A device
+		   which fails string #0 gets language 0, like in
+		   get_usb_language(). */
+		uint16_t lang = choose_usb_language((unsigned char*) data, len);
+		for (i = 0; i < 3; i++) {
+			if (read->index[i] > 0)
+				submit_string_read(read, i + 1, read->index[i], lang);
 		}
-		pthread_mutex_unlock(&dev->mutex);
-	}
-	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-	}
-	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-	}
-	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
-		//LOG("Timeout (normal)\n");
 	}
 	else {
-		LOG("Unknown transfer code: %d\n", transfer->status);
+		for (i = 0; i < 3; i++) {
+			if (transfer == read->transfers[i + 1] && len >= 0)
+				read->strings[i] = usb_string_to_wchar(data, len);
+		}
 	}
 
-	if (dev->shutdown_thread) {
-		dev->transfer_loop_finished = 1;
-		return;
-	}
+	pthread_mutex_lock(&batch->mutex);
+	if (--batch->remaining == 0)
+		batch->completed = 1;
+	pthread_mutex_unlock(&batch->mutex);
+}
 
-	/* Re-submit the transfer object. */
-	res = libusb_submit_transfer(transfer);
-	if (res != 0) {
-		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->transfer_loop_finished = 1;
+/* Give the strings read for a device to its records, and release the
+   device. */
+static void finish_string_read(struct string_read *read)
+{
+	struct hid_device_info *info = read->infos;
+	int i, j;
+
+	for (i = 0; i < 4; i++) {
+		if (read->transfers[i]) {
+			free(read->transfers[i]->buffer);
+			libusb_free_transfer(read->transfers[i]);
+		}
+	}
+	if (read->handle)
+		libusb_close(read->handle);
+
+	for (i = 0; i < read->num_infos; i++, info = info->next) {
+		wchar_t **dest[3];
+		dest[0] = &info->serial_number;
+		dest[1] = &info->manufacturer_string;
+		dest[2] = &info->product_string;
+		for (j = 0; j < 3; j++) {
+			if (!read->strings[j])
+				continue;
+			/* The last record takes the string itself. */
+			*dest[j] = (i == read->num_infos - 1) ? read->strings[j] : wcsdup(read->strings[j]);
+		}
 	}
 }
 
-
-static void *read_thread(void *param)
+/* Read the strings of several devices, with the string descriptors of
+   up to STRING_READ_BATCH_SIZE devices requested at the same time. */
+static void read_strings(struct string_read *reads, int num_reads)
 {
-	hid_device *dev = param;
+	int start, i;
+
+	for (start = 0; start < num_reads; start += STRING_READ_BATCH_SIZE) {
+		int end = start + STRING_READ_BATCH_SIZE < num_reads ? start + STRING_READ_BATCH_SIZE : num_reads;
+		struct string_read_batch batch;
+
+		pthread_mutex_init(&batch.mutex, NULL);
+		batch.remaining = 1;
+		batch.completed = 0;
+
+		for (i = start; i < end; i++) {
+			struct string_read *read = &reads[i];
+			read->batch = &batch;
+			if (libusb_open(read->device, &read->handle) < 0) {
+				read->handle = NULL;
+				continue;
+			}
+			if (submit_string_read(read, 0, 0x0, 0x0) < 0) {
+				/* Read them one after the other, then. */
+				uint16_t lang = get_usb_language(read->handle);
+				int j;
+				for (j = 0; j < 3; j++) {
+					if (read->index[j] > 0)
+						read->strings[j] = get_usb_string(read->handle, lang, read->index[j]);
+				}
+			}
+		}
+
+		/* The callbacks run on whichever thread handles the events,
+		   which may be the event thread of the open devices. The
+		   transfers time out, so this comes to an end. completed is
+		   only tested under the mutex: once it is seen set here, the
+		   last callback has unlocked the mutex, and it can be
+		   destroyed along with the batch. libusb itself tests it
+		   under its event lock, which the callbacks run with. */
+		pthread_mutex_lock(&batch.mutex);
+		if (--batch.remaining == 0)
+			batch.completed = 1;
+		while (!batch.completed) {
+			pthread_mutex_unlock(&batch.mutex);
+			libusb_handle_events_completed(usb_context, &batch.completed);
+			pthread_mutex_lock(&batch.mutex);
+		}
+		pthread_mutex_unlock(&batch.mutex);
+
+		for (i = start; i < end; i++)
+			finish_string_read(&reads[i]);
+
+		pthread_mutex_destroy(&batch.mutex);
+	}
+}
+
+/* See hid_enumerate_ex(). */
+static struct hid_device_info *enumerate_devices(const struct hid_enumerate_filter *filter)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	ssize_t num_devs;
+	int i = 0;
+	struct string_read *reads = NULL;
+	int num_reads = 0;
+	/* The serial number prefix can only be checked with the strings. */
+	int lazy = (filter->flags & HID_API_ENUMERATE_LAZY) && !filter->serial_number_prefix;
+
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	if (filter->bus_type != HID_API_BUS_ANY && filter->bus_type != HID_API_BUS_USB)
+		return NULL;
+#ifndef INVASIVE_GET_USAGE
+	/* The usage of a device isn't known. */
+	if (filter->usage_page != 0x0 || filter->usage != 0x0)
+		return NULL;
+#endif
+
+	/* See hid_set_enumeration_cache(). */
+	if (hid_hotplug_enumerate_cached(filter, &root))
+		return root;
+
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return NULL;
+
+#ifndef INVASIVE_GET_USAGE
+	/* The strings of all devices are read at the same time below,
+	   rather than one device after the other. */
+	if (!lazy)
+		reads = (struct string_read*) calloc(num_devs > 0 ? num_devs : 1, sizeof(struct string_read));
+#endif
+
+	while ((dev = devs[i++]) != NULL) {
+		struct hid_device_info *tmp = create_device_info_for_device(dev, filter, !lazy && reads == NULL);
+		if (!tmp)
+			continue;
+
+		if (lazy) {
+			struct hid_device_info *info;
+			for (info = tmp; info; info = info->next)
+				info->strings_pending = 1;
+		}
+
+		if (cur_dev) {
+			cur_dev->next = tmp;
+		}
+		else {
+			root = tmp;
+		}
+		cur_dev = tmp;
+
+		if (reads) {
+			struct libusb_device_descriptor desc;
+			struct string_read *read = &reads[num_reads++];
+
+			libusb_get_device_descriptor(dev, &desc);
+			read->device = dev;
+			read->infos = tmp;
+			read->num_infos = 1;
+			read->index[0] = desc.iSerialNumber;
+			read->index[1] = desc.iManufacturer;
+			read->index[2] = desc.iProduct;
+			while (cur_dev->next) {
+				cur_dev = cur_dev->next;
+				read->num_infos++;
+			}
+		}
+		else {
+			while (cur_dev->next)
+				cur_dev = cur_dev->next;
+		}
+	}
+
+	if (reads) {
+		read_strings(reads, num_reads);
+		free(reads);
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	/* Now that the strings (and with INVASIVE_GET_USAGE, the usages)
+	   are known, drop the records which don't match after all. */
+	if (filter->usage_page != 0x0 || filter->usage != 0x0 || filter->serial_number_prefix) {
+		struct hid_device_info **link = &root;
+		while (*link) {
+			struct hid_device_info *tmp = *link;
+			if (device_info_matches(filter, tmp)) {
+				link = &tmp->next;
+				continue;
+			}
+			*link = tmp->next;
+			tmp->next = NULL;
+			hid_free_enumeration(tmp);
+		}
+	}
+
+	return root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enumerate_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	return enumerate_devices(&filter);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_lazy(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enumerate_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	filter.flags = HID_API_ENUMERATE_LAZY;
+	return enumerate_devices(&filter);
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter)
+{
+	return enumerate_devices(filter ? filter : &match_all_devices);
+}
+
+/* Read the strings of a record of hid_enumerate_lazy(). */
+static void read_device_info_strings(struct hid_device_info *info)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	unsigned int bus_number, device_address, interface_num;
+	int i = 0;
+
+	/* Only look once. If the device is gone, the strings stay NULL. */
+	info->strings_pending = 0;
+
+	if (!info->path ||
+	    parse_path(info->path, &bus_number, &device_address, &interface_num) < 0)
+		return;
+
+	if (libusb_get_device_list(usb_context, &devs) < 0)
+		return;
+
+	while ((dev = devs[i++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct string_read read;
+
+		/* The address may have been given to another device since
+		   the enumeration. Then its strings aren't read. */
+		if (libusb_get_bus_number(dev) != bus_number ||
+		    libusb_get_device_address(dev) != device_address ||
+		    libusb_get_device_descriptor(dev, &desc) < 0 ||
+		    desc.idVendor != info->vendor_id ||
+		    desc.idProduct != info->product_id)
+			continue;
+
+		memset(&read, 0, sizeof(read));
+		read.device = dev;
+		read.infos = info;
+		read.num_infos = 1;
+		read.index[0] = desc.iSerialNumber;
+		read.index[1] = desc.iManufacturer;
+		read.index[2] = desc.iProduct;
+		read_strings(&read, 1);
+		break;
+	}
+
+	libusb_free_device_list(devs, 1);
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_serial_number(struct hid_device_info *info)
+{
+	if (info->strings_pending)
+		read_device_info_strings(info);
+	return info->serial_number;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_manufacturer_string(struct hid_device_info *info)
+{
+	if (info->strings_pending)
+		read_device_info_strings(info);
+	return info->manufacturer_string;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_product_string(struct hid_device_info *info)
+{
+	if (info->strings_pending)
+		read_device_info_strings(info);
+	return info->product_string;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+/* Get the number of the first HID interface of a device.
+   Returns -1 if the device has none. */
+static int get_first_hid_interface(libusb_device *dev)
+{
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int interface_num = -1;
+	int j, k;
+
+	if (libusb_get_active_config_descriptor(dev, &conf_desc) < 0)
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+	if (!conf_desc)
+		return -1;
+
+	for (j = 0; j < conf_desc->bNumInterfaces && interface_num < 0; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			if (intf->altsetting[k].bInterfaceClass == LIBUSB_CLASS_HID) {
+				interface_num = intf->altsetting[k].bInterfaceNumber;
+				break;
+			}
+		}
+	}
+	libusb_free_config_descriptor(conf_desc);
+
+	return interface_num;
+}
+
+/* Find the path of the first HID interface of the first device with the
+   given VID/PID and, unless it is NULL, serial number. Unlike
+   hid_enumerate(), only devices with the right IDs are opened, and only
+   if their serial number has to be read.
+   Returns a path to be freed, or NULL. */
+static char *find_device_path(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	char *path = NULL;
+	int i = 0;
+
+	if (libusb_get_device_list(usb_context, &devs) < 0)
+		return NULL;
+
+	while (!path && (dev = devs[i++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		int interface_num;
+
+		/* The device descriptor is cached by libusb, this
+		   doesn't talk to the device. */
+		if (libusb_get_device_descriptor(dev, &desc) < 0 ||
+		    desc.idVendor != vendor_id ||
+		    desc.idProduct != product_id)
+			continue;
+
+		interface_num = get_first_hid_interface(dev);
+		if (interface_num < 0)
+			continue;
+
+		if (serial_number) {
+			libusb_device_handle *handle;
+			wchar_t *serial = NULL;
+			int match;
+
+			if (desc.iSerialNumber == 0 || libusb_open(dev, &handle) < 0)
+				continue;
+			serial = get_usb_string(handle, get_usb_language(handle), desc.iSerialNumber);
+			libusb_close(handle);
+
+			match = serial && wcscmp(serial_number, serial) == 0;
+			free(serial);
+			if (!match)
+				continue;
+		}
+
+		path = make_path(dev, interface_num);
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	return path;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct hid_enumerate_filter filter;
+	struct hid_device_info *devs, *cur_dev;
+	char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	if (hid_init() < 0)
+		return NULL;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	if (hid_hotplug_enumerate_cached(&filter, &devs)) {
+		/* The cached list is quicker to search than opening devices. */
+		for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
+			if (cur_dev->vendor_id == vendor_id &&
+			    cur_dev->product_id == product_id &&
+			    (!serial_number ||
+			     (cur_dev->serial_number && wcscmp(serial_number, cur_dev->serial_number) == 0))) {
+				path_to_open = cur_dev->path ? strdup(cur_dev->path) : NULL;
+				break;
+			}
+		}
+		hid_free_enumeration(devs);
+	}
+	else {
+		path_to_open = find_device_path(vendor_id, product_id, serial_number);
+	}
+
+	if (path_to_open) {
+		/* Open the device */
+		handle = hid_open_path(path_to_open);
+	}
+
+	free(path_to_open);
+
+	return handle;
+}
+
+/* Make the pollable file descriptor readable, if there is one.
+   This should be called with dev->mutex locked. */
+static void signal_pollable_fd(hid_device *dev)
+{
+	if (dev->pollable_fd[1] < 0 || dev->pollable_fd_signalled)
+		return;
+
+#ifdef __linux__
+	{
+		uint64_t value = 1;
+		if (write(dev->pollable_fd[1], &value, sizeof(value)) < 0)
+			LOG("Unable to signal the eventfd: %d\n", errno);
+	}
+#else
+	{
+		uint8_t value = 1;
+		if (write(dev->pollable_fd[1], &value, sizeof(value)) < 0)
+			LOG("Unable to signal the pipe: %d\n", errno);
+	}
+#endif
+	dev->pollable_fd_signalled = 1;
+}
+
+/* Make the pollable file descriptor not readable anymore, unless the
+   device has been shut down, since hid_read() then returns right away.
+   This should be called with dev->mutex locked. */
+static void clear_pollable_fd(hid_device *dev)
+{
+	if (!dev->pollable_fd_signalled || dev->shutdown_thread)
+		return;
+
+#ifdef __linux__
+	{
+		uint64_t value;
+		if (read(dev->pollable_fd[0], &value, sizeof(value)) < 0)
+			LOG("Unable to clear the eventfd: %d\n", errno);
+	}
+#else
+	{
+		uint8_t value;
+		if (read(dev->pollable_fd[0], &value, sizeof(value)) < 0)
+			LOG("Unable to clear the pipe: %d\n", errno);
+	}
+#endif
+	dev->pollable_fd_signalled = 0;
+}
+
+/* (Re)allocate the ring of input reports with room for capacity
+   reports. Each slot is large enough to hold one packet of the INPUT
+   endpoint. Reports already queued are moved into the new ring; if
+   there are more of them than fit, the oldest ones are dropped.
+   This should be called with dev->mutex locked once the read thread
+   is running.
+   Returns 0 on success and -1 on failure. */
+static int alloc_input_reports(hid_device *dev, size_t capacity)
+{
+	size_t i;
+	const size_t slot_size = dev->input_ep_max_packet_size;
+	struct input_report *reports;
 	uint8_t *buf;
+
+	reports = (struct input_report*) calloc(capacity, sizeof(struct input_report));
+	buf = (uint8_t*) malloc(capacity * slot_size);
+	if (!reports || (!buf && slot_size > 0)) {
+		free(reports);
+		free(buf);
+		return -1;
+	}
+
+	for (i = 0; i < capacity; i++)
+		reports[i].data = buf + i * slot_size;
+
+	/* Drop whatever doesn't fit, then move the rest over. */
+	while (dev->input_report_count > capacity) {
+		return_data(dev, NULL, 0);
+		dev->dropped_input_reports++;
+	}
+	for (i = 0; i < dev->input_report_count; i++) {
+		struct input_report *rpt = &dev->input_reports[(dev->input_report_head + i) % dev->input_report_capacity];
+		memcpy(reports[i].data, rpt->data, rpt->len);
+		reports[i].len = rpt->len;
+	}
+
+	free(dev->input_reports);
+	free(dev->input_report_buf);
+	dev->input_reports = reports;
+	dev->input_report_buf = buf;
+	dev->input_report_capacity = capacity;
+	dev->input_report_head = 0;
+
+	return 0;
+}
+
+/* Copy a received report into the next free slot of the ring. If the
+   ring is full, the report is dropped according to the queue policy.
+   This should be called with dev->mutex locked. */
+static void queue_input_report(hid_device *dev, const uint8_t *data, size_t length)
+{
+	struct input_report *rpt;
+	size_t tail;
+
+	if (dev->input_report_count == dev->input_report_capacity) {
+		dev->dropped_input_reports++;
+		if (dev->input_queue_policy == HID_INPUT_QUEUE_DROP_NEWEST)
+			return;
+
+		/* Drop the oldest report. */
+		return_data(dev, NULL, 0);
+	}
+
+	tail = (dev->input_report_head + dev->input_report_count) % dev->input_report_capacity;
+	rpt = &dev->input_reports[tail];
+	rpt->len = (length < (size_t) dev->input_ep_max_packet_size)? length: (size_t) dev->input_ep_max_packet_size;
+	memcpy(rpt->data, data, rpt->len);
+
+	if (dev->input_report_count++ == 0) {
+		/* The queue was empty. Wake up a waiting reader. */
+		pthread_cond_signal(&dev->condition);
+		signal_pollable_fd(dev);
+	}
+}
+
+/* Once reading from the device has stopped, wake up any threads
+   waiting for data (in hid_read_timeout()). When the last transfer
+   is back, the transfer loop is finished and hid_close() can go on.
+   This should be called with dev->mutex locked. */
+static void notify_shutdown(hid_device *dev)
+{
+	if (!dev->shutdown_thread)
+		return;
+
+	if (dev->transfers_in_flight == 0)
+		dev->transfer_loop_finished = 1;
+	pthread_cond_broadcast(&dev->condition);
+	signal_pollable_fd(dev);
+}
+
+/* Submit an interrupt IN transfer and account for it. If the
+   submission fails, reading from the device is shut down.
+   This should be called with dev->mutex locked. */
+static int submit_input_transfer(hid_device *dev, struct libusb_transfer *transfer)
+{
+	int res;
+
+	/* The timeout may have changed since the last submission */
+	transfer->timeout = dev->read_timeout;
+	res = libusb_submit_transfer(transfer);
+	if (res != 0) {
+		LOG("Unable to submit URB. libusb error code: %d\n", res);
+		dev->shutdown_thread = 1;
+		return res;
+	}
+
+	dev->transfers_in_flight++;
+	return 0;
+}
+
+/* Submit a transfer again after its report has been handled, or retire
+   it if hid_set_input_transfer_count() has lowered the number of
+   transfers. Held transfers count as in flight, they will be submitted
+   again. This should be called with dev->mutex locked. */
+static void resubmit_input_transfer(hid_device *dev, struct libusb_transfer *transfer)
+{
+	if (dev->shutdown_thread)
+		return;
+
+	if (dev->transfers_in_flight + dev->num_held_transfers >= dev->input_transfer_count) {
+		dev->idle_transfers[dev->num_idle_transfers++] = transfer;
+		return;
+	}
+
+	submit_input_transfer(dev, transfer);
+}
+
+static void read_callback(struct libusb_transfer *transfer)
+{
+	hid_device *dev = transfer->user_data;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->transfers_in_flight--;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		if (dev->input_queue_policy == HID_INPUT_QUEUE_BLOCK &&
+		    !dev->shutdown_thread &&
+		    (dev->num_held_transfers > 0 ||
+		     dev->input_report_count == dev->input_report_capacity)) {
+			/* Keep the report in the transfer and stop reading
+			   from the device until hid_read() makes room. If
+			   an earlier transfer is already held, this one has
+			   to wait behind it to keep the reports in order. */
+			dev->held_transfers[dev->num_held_transfers++] = transfer;
+			pthread_mutex_unlock(&dev->mutex);
+			return;
+		}
+		queue_input_report(dev, transfer->buffer, transfer->actual_length);
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		dev->shutdown_thread = 1;
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		dev->shutdown_thread = 1;
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+		//LOG("Timeout (normal)\n");
+	}
+	else {
+		LOG("Unknown transfer code: %d\n", transfer->status);
+	}
+
+	/* Re-submit the transfer object. */
+	resubmit_input_transfer(dev, transfer);
+
+	notify_shutdown(dev);
+
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+
+/* Allocate an interrupt IN transfer for the device, with a buffer of
+   the size of the INPUT endpoint, and add it to dev->transfers.
+   Returns the transfer, or NULL on failure. */
+static struct libusb_transfer *alloc_input_transfer(hid_device *dev)
+{
 	const size_t length = dev->input_ep_max_packet_size;
+	struct libusb_transfer *transfer;
+	uint8_t *buf;
+
+	if (dev->num_transfers == MAX_INPUT_TRANSFERS)
+		return NULL;
 
-	/* Set up the transfer object. */
 	buf = (uint8_t*) malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer || (!buf && length > 0)) {
+		free(buf);
+		if (transfer)
+			libusb_free_transfer(transfer);
+		return NULL;
+	}
+	libusb_fill_interrupt_transfer(transfer,
 		dev->device_handle,
 		dev->input_endpoint,
 		buf,
 		length,
 		read_callback,
 		dev,
-		5000/*timeout*/);
+		dev->read_timeout);
+
+	dev->transfers[dev->num_transfers++] = transfer;
+	return transfer;
+}
+
+/* Allocate the interrupt IN transfers of a device which is being
+   opened. Returns 0 on success and -1 on failure. */
+static int alloc_input_transfers(hid_device *dev)
+{
+	int i;
+
+	dev->transfers = (struct libusb_transfer**) calloc(MAX_INPUT_TRANSFERS, sizeof(struct libusb_transfer*));
+	dev->held_transfers = (struct libusb_transfer**) calloc(MAX_INPUT_TRANSFERS, sizeof(struct libusb_transfer*));
+	dev->idle_transfers = (struct libusb_transfer**) calloc(MAX_INPUT_TRANSFERS, sizeof(struct libusb_transfer*));
+	if (!dev->transfers || !dev->held_transfers || !dev->idle_transfers)
+		return -1;
+
+	for (i = 0; i < dev->input_transfer_count; i++) {
+		if (!alloc_input_transfer(dev))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Make the first submissions. Further submissions are made from
+   inside read_callback(), on the event thread. */
+static void start_input_transfers(hid_device *dev)
+{
+	int i;
+
+	pthread_mutex_lock(&dev->mutex);
+	for (i = 0; i < dev->num_transfers && !dev->shutdown_thread; i++)
+		submit_input_transfer(dev, dev->transfers[i]);
+	notify_shutdown(dev);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+static void *event_thread_main(void *param)
+{
+	(void)param;
+
+	/* Handle all the events. */
+	while (!event_thread_shutdown) {
+		int res;
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+		res = libusb_handle_events_completed(usb_context, &event_thread_shutdown);
+#else
+		/* Without libusb_interrupt_event_handler(), wake up
+		   regularly to notice the shutdown request. */
+		struct timeval tv = { 0, 100000 };
+		res = libusb_handle_events_timeout_completed(usb_context, &tv, &event_thread_shutdown);
+#endif
+		if (res < 0 &&
+		    res != LIBUSB_ERROR_BUSY &&
+		    res != LIBUSB_ERROR_TIMEOUT &&
+		    res != LIBUSB_ERROR_OVERFLOW &&
+		    res != LIBUSB_ERROR_INTERRUPTED) {
+			/* There was an error. Keep going, the devices
+			   depend on this thread. */
+			LOG("event_thread_main(): libusb reports error # %d\n", res);
+		}
+	}
+
+	return NULL;
+}
+
+/* Take a reference on the event thread, starting it if this is the
+   first device.
+   Returns 0 on success and -1 on failure. */
+static int event_thread_ref(void)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&event_thread_mutex);
+	if (event_thread_refcount == 0) {
+		event_thread_shutdown = 0;
+		if (pthread_create(&event_thread, NULL, event_thread_main, NULL) != 0)
+			res = -1;
+	}
+	if (res == 0)
+		event_thread_refcount++;
+	pthread_mutex_unlock(&event_thread_mutex);
+
+	return res;
+}
+
+/* Drop a reference on the event thread, stopping it if this was the
+   last device. */
+static void event_thread_unref(void)
+{
+	pthread_mutex_lock(&event_thread_mutex);
+	if (--event_thread_refcount == 0) {
+		event_thread_shutdown = 1;
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+		libusb_interrupt_event_handler(usb_context);
+#endif
+		pthread_join(event_thread, NULL);
+	}
+	pthread_mutex_unlock(&event_thread_mutex);
+}
+
+
+/* A registered hotplug callback. */
+struct hid_hotplug_callback {
+	hid_hotplug_callback_handle handle;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	int events; /* 0 once deregistered, until it is freed */
+	hid_hotplug_callback_fn callback;
+	void *user_data;
+
+	struct hid_hotplug_callback *next;
+};
+
+/* A device event received from libusb, waiting to be handled on the
+   hotplug thread. */
+struct hid_hotplug_queued_event {
+	libusb_device *device; /* referenced */
+	libusb_hotplug_event event;
+
+	struct hid_hotplug_queued_event *next;
+};
+
+/* State of hotplug monitoring. libusb reports devices coming and going
+   to hid_libusb_hotplug_callback() on the event thread, which queues the
+   events. The hotplug thread turns them into hid_device_info records,
+   keeps a list of the devices which are currently attached and calls
+   the callbacks. The event thread is never blocked by the callbacks, so
+   they can read from and close devices. Monitoring starts with the
+   first registration of a callback, or with the enumeration cache, and
+   runs until hid_exit(). */
+static struct hid_hotplug_context {
+	/* Protects everything below but the queue. Recursive, so that
+	   callbacks can register and deregister callbacks. */
+	pthread_mutex_t mutex;
+
+	int running;
+	libusb_hotplug_callback_handle libusb_handle;
+	pthread_t thread;
+
+	/* The currently attached devices */
+	struct hid_device_info *devs;
+	/* hid_enumerate() copies from devs, see hid_set_enumeration_cache() */
+	int cache_enabled;
+
+	struct hid_hotplug_callback *callbacks;
+	hid_hotplug_callback_handle next_handle;
+	/* Callbacks are being called. Deregistered ones are only freed
+	   when this drops to 0. */
+	int callbacks_in_use;
+	int callbacks_to_free;
+
+	/* Events from libusb. queue_mutex is only held briefly and never
+	   while calling into libusb, as libusb holds its own locks when it
+	   calls hid_libusb_hotplug_callback(). queue_cond is signalled when
+	   an event is queued, or the thread is asked to stop. */
+	pthread_mutex_t queue_mutex;
+	pthread_cond_t queue_cond;
+	struct hid_hotplug_queued_event *queue;
+	int thread_shutdown;
+} hid_hotplug_context = {
+	.queue_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.queue_cond = PTHREAD_COND_INITIALIZER,
+	.next_handle = 1,
+};
+
+static pthread_once_t hid_hotplug_once = PTHREAD_ONCE_INIT;
+
+static void hid_hotplug_init_mutex(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&hid_hotplug_context.mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Free the callbacks which have been deregistered while callbacks were
+   being called.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_free_callbacks(void)
+{
+	struct hid_hotplug_callback **cur = &hid_hotplug_context.callbacks;
+
+	if (hid_hotplug_context.callbacks_in_use || !hid_hotplug_context.callbacks_to_free)
+		return;
+
+	while (*cur) {
+		struct hid_hotplug_callback *cb = *cur;
+		if (cb->events == 0) {
+			*cur = cb->next;
+			free(cb);
+		}
+		else {
+			cur = &cb->next;
+		}
+	}
+	hid_hotplug_context.callbacks_to_free = 0;
+}
+
+/* Call a callback if it is interested in the event and device. A
+   callback which returns non-zero is deregistered.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_call(struct hid_hotplug_callback *cb, struct hid_device_info *info, hid_hotplug_event event)
+{
+	struct hid_device_info *next;
+
+	if (!(cb->events & event) ||
+	    (cb->vendor_id != 0x0 && cb->vendor_id != info->vendor_id) ||
+	    (cb->product_id != 0x0 && cb->product_id != info->product_id))
+		return;
+
+	/* Hand out the device on its own. */
+	next = info->next;
+	info->next = NULL;
+
+	hid_hotplug_context.callbacks_in_use++;
+	if (cb->callback(cb->handle, info, event, cb->user_data)) {
+		cb->events = 0;
+		hid_hotplug_context.callbacks_to_free = 1;
+	}
+	hid_hotplug_context.callbacks_in_use--;
+
+	info->next = next;
+}
+
+/* Tell all callbacks about an event.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_notify(struct hid_device_info *info, hid_hotplug_event event)
+{
+	struct hid_hotplug_callback *cb;
+
+	hid_hotplug_context.callbacks_in_use++;
+	for (cb = hid_hotplug_context.callbacks; cb; cb = cb->next)
+		hid_hotplug_call(cb, info, event);
+	hid_hotplug_context.callbacks_in_use--;
+
+	hid_hotplug_free_callbacks();
+}
+
+/* A USB device is gone. Drop the records of its interfaces and tell
+   the callbacks.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_device_left(libusb_device *device)
+{
+	struct hid_device_info **cur = &hid_hotplug_context.devs;
+	char prefix[16];
+	size_t prefix_len;
+
+	/* See make_path(). The interface number follows. */
+	snprintf(prefix, sizeof(prefix), "%04x:%04x:",
+		libusb_get_bus_number(device),
+		libusb_get_device_address(device));
+	prefix_len = strlen(prefix);
+
+	while (*cur) {
+		struct hid_device_info *info = *cur;
+		if (info->path && strncmp(info->path, prefix, prefix_len) == 0) {
+			*cur = info->next;
+			info->next = NULL;
+			hid_hotplug_notify(info, HID_API_HOTPLUG_EVENT_DEVICE_LEFT);
+			hid_free_enumeration(info);
+		}
+		else {
+			cur = &info->next;
+		}
+	}
+}
+
+/* A USB device has been attached. Record its HID interfaces, which
+   are passed in infos, and tell the callbacks.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_device_arrived(struct hid_device_info *infos)
+{
+	struct hid_device_info *info, **tail;
+
+	if (!infos)
+		return;
+
+	/* A device which is attached while hid_hotplug_start() enumerates
+	   can be seen twice. Don't list it twice. */
+	for (tail = &hid_hotplug_context.devs; *tail; tail = &(*tail)->next) {
+		if ((*tail)->path && infos->path && strcmp((*tail)->path, infos->path) == 0) {
+			hid_free_enumeration(infos);
+			return;
+		}
+	}
+	*tail = infos;
+
+	for (info = infos; info; info = info->next)
+		hid_hotplug_notify(info, HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED);
+}
+
+/* Take the events which libusb reported off the queue. With wait set,
+   wait for events until the thread is asked to stop. */
+static struct hid_hotplug_queued_event *hid_hotplug_take_queue(int wait)
+{
+	struct hid_hotplug_queued_event *queue;
+
+	pthread_mutex_lock(&hid_hotplug_context.queue_mutex);
+	while (wait && !hid_hotplug_context.queue && !hid_hotplug_context.thread_shutdown)
+		pthread_cond_wait(&hid_hotplug_context.queue_cond, &hid_hotplug_context.queue_mutex);
+	queue = hid_hotplug_context.queue;
+	hid_hotplug_context.queue = NULL;
+	pthread_mutex_unlock(&hid_hotplug_context.queue_mutex);
+
+	return queue;
+}
+
+static void hid_hotplug_free_queue(struct hid_hotplug_queued_event *queue)
+{
+	while (queue) {
+		struct hid_hotplug_queued_event *next = queue->next;
+		libusb_unref_device(queue->device);
+		free(queue);
+		queue = next;
+	}
+}
+
+/* Handle the hotplug events which libusb queues, until hid_exit(). */
+static void *hid_hotplug_thread(void *param)
+{
+	struct hid_hotplug_queued_event *queue, *ev;
+
+	(void)param;
+
+	while ((queue = hid_hotplug_take_queue(1)) != NULL) {
+		for (ev = queue; ev; ev = ev->next) {
+			struct hid_device_info *infos = NULL;
+
+			/* Reading the strings of a new device takes a while,
+			   so it is done without holding the mutex. */
+			if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+				infos = create_device_info_for_device(ev->device, &match_all_devices, 1);
+
+			pthread_mutex_lock(&hid_hotplug_context.mutex);
+			if (!hid_hotplug_context.running)
+				hid_free_enumeration(infos);
+			else if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+				hid_hotplug_device_arrived(infos);
+			else
+				hid_hotplug_device_left(ev->device);
+			pthread_mutex_unlock(&hid_hotplug_context.mutex);
+		}
+
+		hid_hotplug_free_queue(queue);
+	}
+
+	return NULL;
+}
+
+static int hid_libusb_hotplug_callback(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	struct hid_hotplug_queued_event *ev, **tail;
+
+	(void)ctx;
+	(void)user_data;
+
+	ev = (struct hid_hotplug_queued_event*) calloc(1, sizeof(struct hid_hotplug_queued_event));
+	if (!ev) {
+		LOG("hid_libusb_hotplug_callback(): out of memory, event lost\n");
+		return 0;
+	}
+	ev->device = libusb_ref_device(device);
+	ev->event = event;
+
+	pthread_mutex_lock(&hid_hotplug_context.queue_mutex);
+	tail = &hid_hotplug_context.queue;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = ev;
+	pthread_cond_signal(&hid_hotplug_context.queue_cond);
+	pthread_mutex_unlock(&hid_hotplug_context.queue_mutex);
+
+	/* Keep the libusb callback registered. */
+	return 0;
+}
+
+/* Start watching for devices.
+   This should be called with hid_hotplug_context.mutex locked.
+   Returns 0 on success and -1 on failure. */
+static int hid_hotplug_start(void)
+{
+	int res;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		LOG("hid_hotplug_start(): libusb has no hotplug support on this platform\n");
+		return -1;
+	}
+
+	/* The events of the devices found by hid_enumerate() below are
+	   queued already, so no device can be missed in between. */
+	res = libusb_hotplug_register_callback(usb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_NO_FLAGS,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hid_libusb_hotplug_callback, NULL,
+		&hid_hotplug_context.libusb_handle);
+	if (res != LIBUSB_SUCCESS) {
+		LOG("libusb_hotplug_register_callback() failed with %d\n", res);
+		return -1;
+	}
+
+	/* The event thread receives the events from libusb, the hotplug
+	   thread handles them. */
+	if (event_thread_ref() < 0) {
+		libusb_hotplug_deregister_callback(usb_context, hid_hotplug_context.libusb_handle);
+		hid_hotplug_free_queue(hid_hotplug_take_queue(0));
+		return -1;
+	}
+
+	hid_hotplug_context.thread_shutdown = 0;
+	if (pthread_create(&hid_hotplug_context.thread, NULL, hid_hotplug_thread, NULL) != 0) {
+		LOG("hid_hotplug_start(): can't create the hotplug thread\n");
+		libusb_hotplug_deregister_callback(usb_context, hid_hotplug_context.libusb_handle);
+		event_thread_unref();
+		hid_hotplug_free_queue(hid_hotplug_take_queue(0));
+		return -1;
+	}
+
+	hid_hotplug_context.devs = hid_enumerate(0x0, 0x0);
+	hid_hotplug_context.running = 1;
+
+	return 0;
+}
+
+/* Stop watching for devices and drop all callbacks. Called by
+   hid_exit(). */
+static void hid_hotplug_exit(void)
+{
+	int running;
+
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+	running = hid_hotplug_context.running;
+	if (running)
+		libusb_hotplug_deregister_callback(usb_context, hid_hotplug_context.libusb_handle);
+	hid_hotplug_context.running = 0;
+	hid_hotplug_context.cache_enabled = 0;
+
+	hid_free_enumeration(hid_hotplug_context.devs);
+	hid_hotplug_context.devs = NULL;
+	while (hid_hotplug_context.callbacks) {
+		struct hid_hotplug_callback *cb = hid_hotplug_context.callbacks;
+		hid_hotplug_context.callbacks = cb->next;
+		free(cb);
+	}
+	hid_hotplug_context.callbacks_to_free = 0;
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	/* The hotplug thread may be waiting for the mutex to handle events,
+	   so it can only be stopped now. */
+	if (running) {
+		pthread_mutex_lock(&hid_hotplug_context.queue_mutex);
+		hid_hotplug_context.thread_shutdown = 1;
+		pthread_cond_signal(&hid_hotplug_context.queue_cond);
+		pthread_mutex_unlock(&hid_hotplug_context.queue_mutex);
+		pthread_join(hid_hotplug_context.thread, NULL);
+
+		event_thread_unref();
+	}
+
+	hid_hotplug_free_queue(hid_hotplug_take_queue(0));
+}
+
+static struct hid_device_info *copy_device_info(const struct hid_device_info *info)
+{
+	struct hid_device_info *copy;
+
+	copy = (struct hid_device_info*) malloc(sizeof(struct hid_device_info));
+	if (!copy)
+		return NULL;
+
+	*copy = *info;
+	copy->path = info->path ? strdup(info->path) : NULL;
+	copy->serial_number = info->serial_number ? wcsdup(info->serial_number) : NULL;
+	copy->manufacturer_string = info->manufacturer_string ? wcsdup(info->manufacturer_string) : NULL;
+	copy->product_string = info->product_string ? wcsdup(info->product_string) : NULL;
+	copy->next = NULL;
+
+	return copy;
+}
+
+/* Copy the records of the attached devices which match the filter, if
+   the enumeration cache is enabled.
+   Returns 1 if *devs has been set from the cache, and 0 if the devices
+   have to be opened and read. */
+static int hid_hotplug_enumerate_cached(const struct hid_enumerate_filter *filter, struct hid_device_info **devs)
+{
+	const struct hid_device_info *info;
+	struct hid_device_info **tail = devs;
+	int cached;
+
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+
+	cached = hid_hotplug_context.cache_enabled;
+	if (cached) {
+		*devs = NULL;
+		for (info = hid_hotplug_context.devs; info; info = info->next) {
+			if (!device_info_matches(filter, info))
+				continue;
+
+			*tail = copy_device_info(info);
+			if (!*tail)
+				break;
+			tail = &(*tail)->next;
+		}
+	}
+
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	return cached;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_enumeration_cache(int enable)
+{
+	int res = 0;
+
+	if (hid_init() < 0)
+		return -1;
+
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+
+	if (enable && !hid_hotplug_context.running)
+		res = hid_hotplug_start();
+	if (res == 0)
+		hid_hotplug_context.cache_enabled = enable ? 1 : 0;
+
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	return res;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, int flags, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	struct hid_hotplug_callback *cb, **tail;
+
+	if (!callback || !events ||
+	    (events & ~(HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED | HID_API_HOTPLUG_EVENT_DEVICE_LEFT)) ||
+	    (flags & ~HID_API_HOTPLUG_ENUMERATE))
+		return -1;
+
+	if (hid_init() < 0)
+		return -1;
+
+	cb = (struct hid_hotplug_callback*) calloc(1, sizeof(struct hid_hotplug_callback));
+	if (!cb)
+		return -1;
+	cb->vendor_id = vendor_id;
+	cb->product_id = product_id;
+	cb->events = events;
+	cb->callback = callback;
+	cb->user_data = user_data;
+
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+
+	if (!hid_hotplug_context.running && hid_hotplug_start() < 0) {
+		pthread_mutex_unlock(&hid_hotplug_context.mutex);
+		free(cb);
+		return -1;
+	}
 
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+	/* Handles are positive, and reused only after wrapping around. */
+	cb->handle = hid_hotplug_context.next_handle++;
+	if (hid_hotplug_context.next_handle == INT_MAX)
+		hid_hotplug_context.next_handle = 1;
 
-	/* Notify the main thread that the read thread is up and running. */
-	pthread_barrier_wait(&dev->barrier);
+	tail = &hid_hotplug_context.callbacks;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = cb;
 
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
-		int res;
-		res = libusb_handle_events(usb_context);
-		if (res < 0) {
-			/* There was an error. */
-			LOG("read_thread(): libusb reports error # %d\n", res);
-
-			/* Break out of this loop only on fatal error.*/
-			if (res != LIBUSB_ERROR_BUSY &&
-			    res != LIBUSB_ERROR_TIMEOUT &&
-			    res != LIBUSB_ERROR_OVERFLOW &&
-			    res != LIBUSB_ERROR_INTERRUPTED) {
-				dev->shutdown_thread = 1;
-				break;
-			}
-		}
+	if (callback_handle)
+		*callback_handle = cb->handle;
+
+	if (flags & HID_API_HOTPLUG_ENUMERATE) {
+		struct hid_device_info *info;
+
+		hid_hotplug_context.callbacks_in_use++;
+		for (info = hid_hotplug_context.devs; info; info = info->next)
+			hid_hotplug_call(cb, info, HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED);
+		hid_hotplug_context.callbacks_in_use--;
+		hid_hotplug_free_callbacks();
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
 
-	while (!dev->transfer_loop_finished)
-		libusb_handle_events_completed(usb_context, &dev->transfer_loop_finished);
+	return 0;
+}
 
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition actually will go to sleep before the condition is
-	   signaled. */
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
-	pthread_mutex_unlock(&dev->mutex);
+int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	struct hid_hotplug_callback *cb;
+	int res = -1;
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
 
-	return NULL;
-}
+	for (cb = hid_hotplug_context.callbacks; cb; cb = cb->next) {
+		if (cb->handle == callback_handle && cb->events) {
+			/* Freed right away, unless callbacks are running. */
+			cb->events = 0;
+			hid_hotplug_context.callbacks_to_free = 1;
+			hid_hotplug_free_callbacks();
+			res = 0;
+			break;
+		}
+	}
 
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	return res;
+}
 
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
 {
@@ -894,10 +2256,18 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	int res;
 	int d = 0;
 	int good_open = 0;
+	unsigned int bus_number, device_address, interface_num;
 
 	if(hid_init() < 0)
 		return NULL;
 
+	/* Take the path apart, so that devices can be compared by number
+	   instead of building a path for each of them. */
+	if (parse_path(path, &bus_number, &device_address, &interface_num) < 0) {
+		LOG("invalid path %s\n", path);
+		return NULL;
+	}
+
 	dev = new_hid_device();
 
 	libusb_get_device_list(usb_context, &devs);
@@ -905,25 +2275,28 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
 		int i,j,k;
+
+		if (libusb_get_bus_number(usb_dev) != bus_number ||
+		    libusb_get_device_address(usb_dev) != device_address)
+			continue;
+
 		libusb_get_device_descriptor(usb_dev, &desc);
 
 		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
-			continue;
+			break;
 		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
 			const struct libusb_interface *intf = &conf_desc->interface[j];
 			for (k = 0; k < intf->num_altsetting; k++) {
 				const struct libusb_interface_descriptor *intf_desc;
 				intf_desc = &intf->altsetting[k];
 				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
-					if (!strcmp(dev_path, path)) {
+					if (intf_desc->bInterfaceNumber == interface_num) {
 						/* Matched Paths. Open this device */
 
 						/* OPEN HERE */
 						res = libusb_open(usb_dev, &dev->device_handle);
 						if (res < 0) {
 							LOG("can't open device\n");
-							free(dev_path);
 							break;
 						}
 						good_open = 1;
@@ -936,7 +2309,6 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							if (res < 0) {
 								libusb_close(dev->device_handle);
 								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
 								good_open = 0;
 								break;
 							}
@@ -949,7 +2321,6 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
 						if (res < 0) {
 							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
-							free(dev_path);
 							libusb_close(dev->device_handle);
 							good_open = 0;
 							break;
@@ -995,100 +2366,577 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-
-						/* Wait here for the read thread to be initialized. */
-						pthread_barrier_wait(&dev->barrier);
+						/* Allocate the transfers and the ring of input
+						   reports up front, so the read path doesn't
+						   need to allocate. */
+						if (alloc_input_transfers(dev) < 0 ||
+						    alloc_input_reports(dev, INPUT_REPORT_QUEUE_SIZE) < 0 ||
+						    event_thread_ref() < 0) {
+							LOG("can't set up reading from the device\n");
+							libusb_release_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+#ifdef DETACH_KERNEL_DRIVER
+							if (dev->is_driver_detached)
+								libusb_attach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
+#endif
+							libusb_close(dev->device_handle);
+							good_open = 0;
+							break;
+						}
 
+						start_input_transfers(dev);
 					}
-					free(dev_path);
 				}
 			}
 		}
 		libusb_free_config_descriptor(conf_desc);
 
+		/* No other device has this bus number and address. */
+		break;
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	/* If we have a good handle, return it. */
+	if (good_open) {
+		return dev;
+	}
+	else {
+		/* Unable to open any devices. */
+		free_hid_device(dev);
+		return NULL;
+	}
+}
+
+
+/* Read a timeout of the device, see hid_set_timeout(). For the
+   functions which don't hold dev->mutex. */
+static unsigned int get_timeout(hid_device *dev, const unsigned int *timeout)
+{
+	unsigned int ret;
+
+	pthread_mutex_lock(&dev->mutex);
+	ret = *timeout;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return ret;
+}
+
+static int queue_output_report(hid_device *dev, const unsigned char *data, size_t length);
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int res;
+	int report_number = data[0];
+	int skipped_report_id = 0;
+	int output_queue;
+	unsigned int timeout;
+
+	pthread_mutex_lock(&dev->mutex);
+	output_queue = dev->output_queue;
+	timeout = dev->write_timeout;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (output_queue)
+		return queue_output_report(dev, data, length);
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrupt out endpoint. Use the Control Endpoint */
+		res = libusb_control_transfer(dev->device_handle,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			(unsigned char *)data, length,
+			timeout);
+
+		if (res < 0)
+			return -1;
+
+		if (skipped_report_id)
+			length++;
+
+		return length;
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		int actual_length;
+		res = libusb_interrupt_transfer(dev->device_handle,
+			dev->output_endpoint,
+			(unsigned char*)data,
+			length,
+			&actual_length, timeout);
+
+		if (res < 0)
+			return -1;
+
+		if (skipped_report_id)
+			actual_length++;
+
+		return actual_length;
+	}
+}
+
+/* Called by libusb on the event thread when a write of
+   hid_write_async() is done. */
+static void write_callback(struct libusb_transfer *transfer)
+{
+	struct output_transfer *out = (struct output_transfer*) transfer->user_data;
+	hid_device *dev = out->dev;
+	hid_write_callback callback = out->callback;
+	void *user_data = out->user_data;
+	int res = -1;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		res = transfer->actual_length + out->skipped_report_id;
+
+	/* The transfer can be reused from here on, e.g. by the callback. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->idle_output_transfers[dev->num_idle_output_transfers++] = out;
+	pthread_mutex_unlock(&dev->mutex);
+
+	callback(dev, res, user_data);
+
+	pthread_mutex_lock(&dev->mutex);
+	if (--dev->writes_in_flight == 0)
+		pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	struct output_transfer *out = NULL;
+	int report_number;
+	int skipped_report_id = 0;
+	size_t size;
+
+	if (!data || length == 0 || !callback)
+		return -1;
+
+	report_number = data[0];
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+
+	/* hid_close() is waiting for the writes to end, or the device is
+	   gone. */
+	if (dev->shutdown_thread)
+		goto err;
+
+	if (dev->num_idle_output_transfers > 0) {
+		out = dev->idle_output_transfers[--dev->num_idle_output_transfers];
+	}
+	else if (dev->num_output_transfers < MAX_OUTPUT_TRANSFERS) {
+		out = (struct output_transfer*) calloc(1, sizeof(struct output_transfer));
+		if (!out)
+			goto err;
+		out->transfer = libusb_alloc_transfer(0);
+		if (!out->transfer) {
+			free(out);
+			out = NULL;
+			goto err;
+		}
+		out->dev = dev;
+		dev->output_transfers[dev->num_output_transfers++] = out;
+	}
+	else {
+		LOG("hid_write_async(): too many writes in flight\n");
+		goto err;
+	}
+
+	size = LIBUSB_CONTROL_SETUP_SIZE + length;
+	if (out->buffer_size < size) {
+		unsigned char *buffer = (unsigned char*) realloc(out->buffer, size);
+		if (!buffer)
+			goto err;
+		out->buffer = buffer;
+		out->buffer_size = size;
+	}
+
+	out->skipped_report_id = skipped_report_id;
+	out->callback = callback;
+	out->user_data = user_data;
+
+	/* The same transfers as hid_write() makes */
+	if (dev->output_endpoint <= 0) {
+		/* No interrupt out endpoint. Use the Control Endpoint */
+		libusb_fill_control_setup(out->buffer,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			length);
+		memcpy(out->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+		libusb_fill_control_transfer(out->transfer, dev->device_handle,
+			out->buffer, write_callback, out, dev->write_timeout);
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		memcpy(out->buffer, data, length);
+		libusb_fill_interrupt_transfer(out->transfer, dev->device_handle,
+			dev->output_endpoint, out->buffer, length,
+			write_callback, out, dev->write_timeout);
+	}
+
+	if (libusb_submit_transfer(out->transfer) < 0)
+		goto err;
+	dev->writes_in_flight++;
+
+	pthread_mutex_unlock(&dev->mutex);
+	return 0;
+
+err:
+	if (out)
+		dev->idle_output_transfers[dev->num_idle_output_transfers++] = out;
+	pthread_mutex_unlock(&dev->mutex);
+	return -1;
+}
+
+static void queued_report_written(hid_device *dev, int result, void *user_data);
+
+/* Submit the next report of the output queue, unless one is in flight
+   already. Called without dev->mutex locked. */
+static void submit_queued_report(hid_device *dev)
+{
+	for (;;) {
+		struct queued_report *report;
+		int res;
+
+		pthread_mutex_lock(&dev->mutex);
+		report = dev->queued_reports;
+		if (!report || dev->queued_report_in_flight || dev->shutdown_thread) {
+			/* For drain_output_queue(), when nothing is in flight
+			   any more */
+			if (!dev->queued_report_in_flight)
+				pthread_cond_broadcast(&dev->condition);
+			pthread_mutex_unlock(&dev->mutex);
+			return;
+		}
+		dev->queued_reports = report->next;
+		if (!dev->queued_reports)
+			dev->queued_reports_tail = &dev->queued_reports;
+		dev->queued_report_in_flight = 1;
+		pthread_mutex_unlock(&dev->mutex);
+
+		res = hid_write_async(dev, report->data, report->length, queued_report_written, NULL);
+		free(report);
+		if (res == 0)
+			return;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->queued_report_in_flight = 0;
+		dev->queued_report_failed = 1;
+		pthread_mutex_unlock(&dev->mutex);
+	}
+}
+
+static void queued_report_written(hid_device *dev, int result, void *user_data)
+{
+	(void) user_data;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->queued_report_in_flight = 0;
+	/* Reports cancelled by hid_close() don't count */
+	if (result < 0 && !dev->shutdown_thread)
+		dev->queued_report_failed = 1;
+	pthread_mutex_unlock(&dev->mutex);
+
+	submit_queued_report(dev);
+}
+
+/* Queue a report of hid_write(). It replaces an unsent report with the
+   same Report ID. */
+static int queue_output_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	struct queued_report *report, **link;
+
+	if (!data || length == 0)
+		return -1;
+
+	report = (struct queued_report*) malloc(sizeof(*report) + length);
+	if (!report)
+		return -1;
+	report->next = NULL;
+	report->length = length;
+	memcpy(report->data, data, length);
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (dev->queued_report_failed) {
+		dev->queued_report_failed = 0;
+		pthread_mutex_unlock(&dev->mutex);
+		free(report);
+		LOG("hid_write(): a queued report could not be written\n");
+		return -1;
+	}
+
+	for (link = &dev->queued_reports; *link; link = &(*link)->next) {
+		struct queued_report *old = *link;
+
+		if (old->data[0] == data[0]) {
+			report->next = old->next;
+			if (!report->next)
+				dev->queued_reports_tail = &report->next;
+			*link = report;
+			pthread_mutex_unlock(&dev->mutex);
+			free(old);
+			return (int) length;
+		}
+	}
+
+	*dev->queued_reports_tail = report;
+	dev->queued_reports_tail = &report->next;
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	submit_queued_report(dev);
+
+	return (int) length;
+}
+
+/* Wait for the reports of the output queue to be sent, for at most the
+   write timeout. Called with dev->mutex locked. Returns 0 when they are
+   sent (or failed, or the device is gone), and -1 on timeout. */
+static int drain_output_queue(hid_device *dev)
+{
+	unsigned int timeout = dev->write_timeout;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	/* Nothing more is submitted once the device is gone */
+	while (dev->queued_report_in_flight ||
+	       (dev->queued_reports && !dev->shutdown_thread)) {
+		if (timeout == 0)
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		else if (pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts) == ETIMEDOUT)
+			return -1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_output_queue(hid_device *dev, int enable)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (enable) {
+		dev->output_queue = 1;
+	}
+	else if (dev->output_queue) {
+		/* hid_write() would overtake the queued reports otherwise.
+		   The queue stays on if they aren't sent in time. */
+		res = drain_output_queue(dev);
+		if (res == 0)
+			dev->output_queue = 0;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (res < 0)
+		LOG("hid_set_output_queue(): timed out sending the queued reports\n");
+
+	return res;
+}
+
+struct hid_device_group_ {
+	hid_device **devices;
+	size_t num_devices;
+	size_t capacity;
+};
+
+hid_device_group HID_API_EXPORT * HID_API_CALL hid_group_create(void)
+{
+	return (hid_device_group*) calloc(1, sizeof(hid_device_group));
+}
+
+void HID_API_EXPORT HID_API_CALL hid_group_free(hid_device_group *group)
+{
+	if (!group)
+		return;
+
+	free(group->devices);
+	free(group);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_group_add(hid_device_group *group, hid_device *dev)
+{
+	size_t i;
+
+	if (!group || !dev)
+		return -1;
+
+	/* A device added twice would get the report twice */
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev)
+			return -1;
+	}
+
+	if (group->num_devices == group->capacity) {
+		size_t capacity = group->capacity? group->capacity * 2: 8;
+		hid_device **devices = (hid_device**) realloc(group->devices, capacity * sizeof(hid_device*));
+		if (!devices)
+			return -1;
+		group->devices = devices;
+		group->capacity = capacity;
 	}
 
-	libusb_free_device_list(devs, 1);
+	group->devices[group->num_devices] = dev;
+	return (int) group->num_devices++;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_group_remove(hid_device_group *group, hid_device *dev)
+{
+	size_t i;
+
+	if (!group)
+		return -1;
 
-	/* If we have a good handle, return it. */
-	if (good_open) {
-		return dev;
-	}
-	else {
-		/* Unable to open any devices. */
-		free_hid_device(dev);
-		return NULL;
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev) {
+			memmove(&group->devices[i], &group->devices[i + 1],
+				(group->num_devices - i - 1) * sizeof(hid_device*));
+			group->num_devices--;
+			return 0;
+		}
 	}
+
+	return -1;
 }
 
+/* A hid_group_write() in progress */
+struct group_write {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t writes_pending;
+};
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+/* The write to one device of a group */
+struct group_write_member {
+	struct group_write *state;
+	int result;
+};
+
+static void group_write_callback(hid_device *dev, int result, void *user_data)
 {
-	int res;
-	int report_number = data[0];
-	int skipped_report_id = 0;
+	struct group_write_member *member = (struct group_write_member*) user_data;
+	struct group_write *state = member->state;
 
-	if (report_number == 0x0) {
-		data++;
-		length--;
-		skipped_report_id = 1;
-	}
+	(void) dev;
 
+	pthread_mutex_lock(&state->mutex);
+	member->result = result;
+	if (--state->writes_pending == 0)
+		pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+}
 
-	if (dev->output_endpoint <= 0) {
-		/* No interrupt out endpoint. Use the Control Endpoint */
-		res = libusb_control_transfer(dev->device_handle,
-			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
-			0x09/*HID Set_Report*/,
-			(2/*HID output*/ << 8) | report_number,
-			dev->interface,
-			(unsigned char *)data, length,
-			1000/*timeout millis*/);
+int HID_API_EXPORT HID_API_CALL hid_group_write(hid_device_group *group, const unsigned char *data, size_t length, int *results)
+{
+	struct group_write state;
+	struct group_write_member *members;
+	int written = 0;
+	size_t i;
 
-		if (res < 0)
-			return -1;
+	if (!group || !data || length == 0)
+		return -1;
+	if (group->num_devices == 0)
+		return 0;
 
-		if (skipped_report_id)
-			length++;
+	members = (struct group_write_member*) calloc(group->num_devices, sizeof(struct group_write_member));
+	if (!members)
+		return -1;
 
-		return length;
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	state.writes_pending = group->num_devices;
+
+	/* Submit all writes before waiting for any of them */
+	for (i = 0; i < group->num_devices; i++) {
+		members[i].state = &state;
+		members[i].result = -1;
+		if (hid_write_async(group->devices[i], data, length, group_write_callback, &members[i]) < 0) {
+			pthread_mutex_lock(&state.mutex);
+			state.writes_pending--;
+			pthread_mutex_unlock(&state.mutex);
+		}
 	}
-	else {
-		/* Use the interrupt out endpoint */
-		int actual_length;
-		res = libusb_interrupt_transfer(dev->device_handle,
-			dev->output_endpoint,
-			(unsigned char*)data,
-			length,
-			&actual_length, 1000);
-
-		if (res < 0)
-			return -1;
 
-		if (skipped_report_id)
-			actual_length++;
+	pthread_mutex_lock(&state.mutex);
+	while (state.writes_pending > 0)
+		pthread_cond_wait(&state.cond, &state.mutex);
+	pthread_mutex_unlock(&state.mutex);
 
-		return actual_length;
+	for (i = 0; i < group->num_devices; i++) {
+		if (members[i].result >= 0)
+			written++;
+		if (results)
+			results[i] = members[i].result;
 	}
+
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.mutex);
+	free(members);
+
+	return written;
 }
 
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	/* Copy the data out of the oldest slot of the ring (rpt) into the
+	   return buffer (data), and release the slot. */
+	struct input_report *rpt = &dev->input_reports[dev->input_report_head];
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+	dev->input_report_head = (dev->input_report_head + 1) % dev->input_report_capacity;
+	if (--dev->input_report_count == 0)
+		clear_pollable_fd(dev);
 	return len;
 }
 
+/* Queue the reports of transfers which were held back because the
+   queue was full, and resubmit the transfers. Called whenever there may
+   be room in the queue again, or the queue policy has changed.
+   This should be called with dev->mutex locked. */
+static void resume_held_transfers(hid_device *dev)
+{
+	while (dev->num_held_transfers > 0) {
+		struct libusb_transfer *transfer = dev->held_transfers[0];
+
+		if (dev->input_queue_policy == HID_INPUT_QUEUE_BLOCK &&
+		    dev->input_report_count == dev->input_report_capacity)
+			return;
+
+		dev->num_held_transfers--;
+		memmove(dev->held_transfers, dev->held_transfers + 1,
+			dev->num_held_transfers * sizeof(dev->held_transfers[0]));
+		queue_input_report(dev, transfer->buffer, transfer->actual_length);
+
+		resubmit_input_transfer(dev, transfer);
+	}
+
+	notify_shutdown(dev);
+}
+
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = param;
@@ -1096,45 +2944,28 @@ static void cleanup_mutex(void *param)
 }
 
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Wait until there is an input report in the queue.
+   Returns 1 when there is one, 0 on timeout and -1 when the device
+   has been disconnected or on error.
+   This should be called with dev->mutex locked. */
+static int wait_for_input_report(hid_device *dev, int milliseconds)
 {
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
-	/* by initialising this variable right here, GCC gives a compilation warning/error: */
-	/* error: variable ‘bytes_read’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered] */
-	int bytes_read; /* = -1; */
-
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
-
-	bytes_read = -1;
-
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	/* There's an input report queued up. */
+	if (dev->input_report_count)
+		return 1;
 
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
 
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->input_report_count && !dev->shutdown_thread) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
+		return dev->input_report_count? 1: -1;
 	}
 	else if (milliseconds > 0) {
 		/* Non-blocking, but called with timeout. */
@@ -1148,42 +2979,91 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->input_report_count && !dev->shutdown_thread) {
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
 			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
+				if (dev->input_report_count)
+					return 1;
 
 				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
+				   or the device was shut down. Run the
 				   loop again (ie: don't break). */
 			}
 			else if (res == ETIMEDOUT) {
 				/* Timed out. */
-				bytes_read = 0;
-				break;
+				return 0;
 			}
 			else {
 				/* Error. */
-				bytes_read = -1;
-				break;
+				return -1;
 			}
 		}
+		return dev->input_report_count? 1: -1;
 	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
+
+	/* Purely non-blocking */
+	return 0;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+#if 0
+	int transferred;
+	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
+	LOG("transferred: %d\n", transferred);
+	return transferred;
+#endif
+	/* by initialising this variable right here, GCC gives a compilation warning/error: */
+	/* error: variable ‘bytes_read’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered] */
+	int bytes_read; /* = -1; */
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	bytes_read = wait_for_input_report(dev, milliseconds);
+	if (bytes_read > 0) {
+		/* Return the first one */
+		bytes_read = return_data(dev, data, length);
+		resume_held_transfers(dev);
 	}
 
-ret:
 	pthread_mutex_unlock(&dev->mutex);
 	pthread_cleanup_pop(0);
 
 	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_many(hid_device *dev, unsigned char *data, size_t report_stride, size_t max_reports, int milliseconds, size_t *lengths)
+{
+	int num_reports; /* see hid_read_timeout() */
+
+	if (max_reports == 0)
+		return 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	num_reports = wait_for_input_report(dev, milliseconds);
+	if (num_reports > 0) {
+		/* Take everything that is queued up, under the one lock. */
+		num_reports = 0;
+		while (dev->input_report_count && (size_t) num_reports < max_reports) {
+			lengths[num_reports] = return_data(dev, data + num_reports * report_stride, report_stride);
+			num_reports++;
+
+			/* Queueing held reports makes room for more. */
+			if (!dev->input_report_count)
+				resume_held_transfers(dev);
+		}
+		resume_held_transfers(dev);
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return num_reports;
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
@@ -1196,6 +3076,207 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	return 0;
 }
 
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_size(hid_device *dev, size_t size)
+{
+	int res;
+
+	if (size == 0)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	res = alloc_input_reports(dev, size);
+	if (res == 0)
+		resume_held_transfers(dev);
+	pthread_mutex_unlock(&dev->mutex);
+
+	return res;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_policy(hid_device *dev, hid_input_queue_policy policy)
+{
+	switch (policy) {
+	case HID_INPUT_QUEUE_DROP_OLDEST:
+	case HID_INPUT_QUEUE_DROP_NEWEST:
+	case HID_INPUT_QUEUE_BLOCK:
+		break;
+	default:
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->input_queue_policy = policy;
+	resume_held_transfers(dev);
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_transfer_count(hid_device *dev, int count)
+{
+	int res = 0;
+
+	if (count < 1 || count > MAX_INPUT_TRANSFERS)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (dev->shutdown_thread) {
+		/* Not reading any more */
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+
+	dev->input_transfer_count = count;
+
+	/* Submit more transfers, the retired ones first. With fewer, the
+	   surplus transfers are retired as they complete. */
+	while (dev->transfers_in_flight + dev->num_held_transfers < count) {
+		struct libusb_transfer *transfer;
+
+		if (dev->num_idle_transfers > 0)
+			transfer = dev->idle_transfers[--dev->num_idle_transfers];
+		else
+			transfer = alloc_input_transfer(dev);
+
+		if (!transfer || submit_input_transfer(dev, transfer) < 0) {
+			res = -1;
+			break;
+		}
+	}
+	notify_shutdown(dev);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	return res;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_dropped_input_reports(hid_device *dev, unsigned long *count)
+{
+	pthread_mutex_lock(&dev->mutex);
+	*count = dev->dropped_input_reports;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_timeout(hid_device *dev, hid_timeout_type type, int milliseconds)
+{
+	unsigned int timeout;
+
+	if (milliseconds == 0 || milliseconds < -1)
+		return -1;
+
+	/* libusb waits forever for a timeout of 0 */
+	timeout = (milliseconds == -1)? 0: (unsigned int) milliseconds;
+
+	pthread_mutex_lock(&dev->mutex);
+	switch (type) {
+	case HID_API_TIMEOUT_READ:
+		dev->read_timeout = timeout;
+		break;
+	case HID_API_TIMEOUT_WRITE:
+		dev->write_timeout = timeout;
+		break;
+	case HID_API_TIMEOUT_CONTROL:
+		dev->control_timeout = timeout;
+		break;
+	default:
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+
+int HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *dev)
+{
+	int fd;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->pollable_fd[0] < 0) {
+#ifdef __linux__
+		dev->pollable_fd[0] = dev->pollable_fd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#else
+		if (pipe(dev->pollable_fd) == 0) {
+			int i;
+			for (i = 0; i < 2; i++) {
+				fcntl(dev->pollable_fd[i], F_SETFD, FD_CLOEXEC);
+				fcntl(dev->pollable_fd[i], F_SETFL, O_NONBLOCK);
+			}
+		}
+		else {
+			dev->pollable_fd[0] = dev->pollable_fd[1] = -1;
+		}
+#endif
+		if (dev->pollable_fd[0] < 0)
+			LOG("Unable to create the pollable file descriptor: %d\n", errno);
+
+		/* Catch up with what happened before. */
+		if (dev->input_report_count || dev->shutdown_thread)
+			signal_pollable_fd(dev);
+	}
+	fd = dev->pollable_fd[0];
+	pthread_mutex_unlock(&dev->mutex);
+
+	return fd;
+}
+
+/* Number of devices hid_wait_any() handles without allocating. */
+#define WAIT_ANY_STACK_FDS 32
+
+int HID_API_EXPORT HID_API_CALL hid_wait_any(hid_device **devs, size_t num_devs, int milliseconds, int *ready)
+{
+	struct pollfd stack_fds[WAIT_ANY_STACK_FDS];
+	struct pollfd *fds = stack_fds;
+	size_t i;
+	int ret;
+
+	if (!devs || !ready) {
+		LOG("hid_wait_any(): invalid argument\n");
+		return -1;
+	}
+
+	if (num_devs > WAIT_ANY_STACK_FDS) {
+		fds = (struct pollfd*) calloc(num_devs, sizeof(struct pollfd));
+		if (!fds) {
+			LOG("hid_wait_any(): out of memory\n");
+			return -1;
+		}
+	}
+
+	/* A single poll() over all devices. This avoids setting up an
+	   epoll instance for every call. */
+	for (i = 0; i < num_devs; i++) {
+		fds[i].fd = hid_get_pollable_fd(devs[i]);
+		/* poll() would skip the device, and never report it */
+		if (fds[i].fd < 0) {
+			LOG("hid_wait_any(): device %zu has no pollable file descriptor\n", i);
+			ret = -1;
+			goto end;
+		}
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+
+	ret = poll(fds, num_devs, milliseconds);
+	if (ret < 0) {
+		LOG("hid_wait_any(): poll failed: %d\n", errno);
+	}
+	else {
+		/* Errors on a file descriptor count as ready too, so the
+		   disconnection is reported by the next read. */
+		for (i = 0; i < num_devs; i++)
+			ready[i] = (fds[i].revents != 0);
+	}
+
+end:
+	if (fds != stack_fds)
+		free(fds);
+
+	return ret;
+}
 
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
@@ -1215,7 +3296,7 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 		(3/*HID feature*/ << 8) | report_number,
 		dev->interface,
 		(unsigned char *)data, length,
-		1000/*timeout millis*/);
+		get_timeout(dev, &dev->control_timeout));
 
 	if (res < 0)
 		return -1;
@@ -1246,7 +3327,7 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 		(3/*HID feature*/ << 8) | report_number,
 		dev->interface,
 		(unsigned char *)data, length,
-		1000/*timeout millis*/);
+		get_timeout(dev, &dev->control_timeout));
 
 	if (res < 0)
 		return -1;
@@ -1276,7 +3357,7 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 		(1/*HID Input*/ << 8) | report_number,
 		dev->interface,
 		(unsigned char *)data, length,
-		1000/*timeout millis*/);
+		get_timeout(dev, &dev->control_timeout));
 
 	if (res < 0)
 		return -1;
@@ -1289,19 +3370,43 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	int i;
+
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
+	/* hid_write() has reported the queued reports as written, so send
+	   them before cancelling anything. */
+	pthread_mutex_lock(&dev->mutex);
+	if (drain_output_queue(dev) < 0)
+		LOG("hid_close(): timed out sending the queued reports\n");
+	pthread_mutex_unlock(&dev->mutex);
+
+	/* Stop reading. Held transfers are not in flight, so they can
+	   simply be dropped. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->num_held_transfers = 0;
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	notify_shutdown(dev);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	/* Cancel any transfers that may be pending. This call will fail
+	   for transfers which are not pending, but that's OK. */
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	/* Wait for the event thread to hand back all transfers. */
+	pthread_mutex_lock(&dev->mutex);
+	while (!dev->transfer_loop_finished)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+
+	/* Cancel the writes of hid_write_async(), and wait for their
+	   callbacks. No new ones are submitted after shutdown_thread. */
+	for (i = 0; i < dev->num_output_transfers; i++)
+		libusb_cancel_transfer(dev->output_transfers[i]->transfer);
+	while (dev->writes_in_flight > 0)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1315,16 +3420,14 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	}
 #endif
 
-	/* Close the handle */
+	/* Close the handle. This waits for the event thread to finish
+	   handling the events of the device. */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
+	event_thread_unref();
 
+	/* The transfers and the queue of received reports are freed
+	   along with the device. */
 	free_hid_device(dev);
 }
 
@@ -1348,7 +3451,12 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 {
 	wchar_t *str;
 
-	str = get_usb_string(dev->device_handle, string_index);
+	if (!dev->language_id_valid) {
+		dev->language_id = get_usb_language(dev->device_handle);
+		dev->language_id_valid = 1;
+	}
+
+	str = get_usb_string(dev->device_handle, dev->language_id, string_index);
 	if (str) {
 		wcsncpy(string, str, maxlen);
 		string[maxlen-1] = L'\0';
@@ -1360,6 +3468,25 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+HID_API_EXPORT const struct hid_report_layout * HID_API_CALL hid_get_report_layout(hid_device *dev)
+{
+	(void)dev;
+	/* The report descriptor isn't read when the device is opened. */
+	return NULL;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_decode_report(hid_device *dev, const unsigned char *data, size_t length, int *values, size_t max_values)
+{
+	(void)dev;
+	(void)data;
+	(void)length;
+	(void)values;
+	(void)max_values;
+	/* There is no report layout to decode with. */
+	return -1;
+}
+
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	(void)dev;
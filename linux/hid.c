@@ -25,8 +25,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <ctype.h>
 #include <locale.h>
 #include <errno.h>
+#include <endian.h>
 
 /* Unix */
 #include <unistd.h>
@@ -35,7 +39,9 @@
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <poll.h>
+#include <pthread.h>
 
 /* Linux */
 #include <linux/hidraw.h>
@@ -45,6 +51,12 @@
 
 #include "hidapi.h"
 
+/* Linux 5.11 added HIDIOCGINPUT. Define it for older kernel headers;
+   older kernels fail it with ENOTTY. */
+#ifndef HIDIOCGINPUT
+#define HIDIOCGINPUT(len)    _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x0A, len)
+#endif
+
 
 /* USB HID device property names */
 const char *device_string_names[] = {
@@ -62,11 +74,66 @@ enum device_string_id {
 	DEVICE_STRING_COUNT,
 };
 
+/* The last error of a device, or the last global error. Recording an
+   error is on the hot path of every read and write, so only the failed
+   operation and the errno value are stored. The message is built when
+   hid_error() asks for it. */
+struct hid_error_state {
+	const char *op; /* What failed, a string constant. NULL if nothing. */
+	int err; /* errno value of the failure, 0 if none. */
+	char *msg; /* Preformatted message overriding op and err, or NULL. */
+	wchar_t *str; /* Message returned by hid_error(), built on demand. */
+	int str_valid; /* Whether str matches op, err and msg. */
+};
+
+/* A report queued by hid_write_async(), or by hid_write() with the
+   output queue enabled. The latter have no callback. */
+struct pending_write {
+	struct pending_write *next;
+	hid_write_callback callback;
+	void *user_data;
+	size_t length;
+	unsigned char data[];
+};
+
+/* Limit of hid_write_async() reports queued for a device */
+#define MAX_PENDING_WRITES 16
+
+/* How long hid_close() and hid_set_output_queue() wait for the output
+   queue to be sent, in milliseconds. The default write timeout of the
+   libusb backend. */
+#define OUTPUT_QUEUE_DRAIN_TIMEOUT 1000
+
 struct hid_device_ {
 	int device_handle;
 	int blocking;
 	int uses_numbered_reports;
-	wchar_t *last_error_str;
+	struct hid_report_layout *report_layout;
+	struct report_decoder **input_decoders; /* by Report ID */
+	struct hid_error_state last_error;
+
+	/* Writer thread of hid_write_async(). It is started with the
+	   first call and stopped by hid_close(). The mutex protects
+	   everything below. */
+	pthread_mutex_t write_mutex;
+	pthread_cond_t write_cond;
+	pthread_t write_thread;
+	int write_thread_running;
+	int write_shutdown;
+	/* FIFO of reports still to be written */
+	struct pending_write *write_queue;
+	struct pending_write **write_queue_tail;
+	/* Queued reports, plus the one being written */
+	int num_pending_writes;
+	/* hid_set_output_queue() */
+	int output_queue;
+	/* Reports of the output queue in the FIFO or being written.
+	   write_drained_cond is signalled when this drops to 0. */
+	int num_queued_reports;
+	pthread_cond_t write_drained_cond;
+	/* errno of a report of the output queue which failed, reported
+	   by the next hid_write() */
+	int output_queue_error;
 };
 
 static struct hid_api_version api_version = {
@@ -75,9 +142,12 @@ static struct hid_api_version api_version = {
 	.patch = HID_API_VERSION_PATCH
 };
 
-/* Global error message that is not specific to a device, e.g. for
+/* Global error that is not specific to a device, e.g. for
    hid_open(). It is thread-local like errno. */
-__thread wchar_t *last_global_error_str = NULL;
+static __thread struct hid_error_state last_global_error;
+
+static void hid_hotplug_exit(void);
+static int hid_hotplug_enumerate_cached(const struct hid_enumerate_filter *filter, struct hid_device_info **devs);
 
 static hid_device *new_hid_device(void)
 {
@@ -85,11 +155,22 @@ static hid_device *new_hid_device(void)
 	dev->device_handle = -1;
 	dev->blocking = 1;
 	dev->uses_numbered_reports = 0;
-	dev->last_error_str = NULL;
+	pthread_mutex_init(&dev->write_mutex, NULL);
+	pthread_cond_init(&dev->write_cond, NULL);
+	pthread_cond_init(&dev->write_drained_cond, NULL);
+	dev->write_queue_tail = &dev->write_queue;
 
 	return dev;
 }
 
+static void free_hid_device(hid_device *dev)
+{
+	pthread_cond_destroy(&dev->write_drained_cond);
+	pthread_cond_destroy(&dev->write_cond);
+	pthread_mutex_destroy(&dev->write_mutex);
+	free(dev);
+}
+
 
 /* The caller must free the returned string with free(). */
 static wchar_t *utf8_to_wchar_t(const char *utf8)
@@ -110,48 +191,67 @@ static wchar_t *utf8_to_wchar_t(const char *utf8)
 }
 
 
-/* Set the last global error to be reported by hid_error(NULL).
- * The given error message will be copied (and decoded according to the
- * currently locale, so do not pass in string constants).
- * The last stored global error message is freed.
- * Use register_global_error(NULL) to indicate "no error". */
-static void register_global_error(const char *msg)
+/* Record an error. This doesn't allocate unless a previous
+   preformatted message has to be freed. */
+static void set_error(struct hid_error_state *error, const char *op, int err)
 {
-	if (last_global_error_str)
-		free(last_global_error_str);
+	if (error->msg) {
+		free(error->msg);
+		error->msg = NULL;
+	}
+	error->op = op;
+	error->err = err;
+	error->str_valid = 0;
+}
 
-	last_global_error_str = utf8_to_wchar_t(msg);
+/* Free the memory held by an error. */
+static void free_error(struct hid_error_state *error)
+{
+	set_error(error, NULL, 0);
+	free(error->str);
+	error->str = NULL;
 }
 
-/* See register_global_error, but you can pass a format string into this function. */
-static void register_global_error_format(const char *format, ...)
+/* Build the message of an error, as returned by hid_error(). */
+static const wchar_t *get_error_str(struct hid_error_state *error)
 {
-	va_list args;
-	va_start(args, format);
+	if (!error->msg && !error->op && !error->err)
+		return L"Success";
 
-	char msg[100];
-	vsnprintf(msg, sizeof(msg), format, args);
+	if (!error->str_valid) {
+		char buf[256];
+		const char *msg = buf;
 
-	va_end(args);
+		if (error->msg)
+			msg = error->msg;
+		else if (error->op && error->err)
+			snprintf(buf, sizeof(buf), "%s: %s", error->op, strerror(error->err));
+		else if (error->op)
+			msg = error->op;
+		else
+			msg = strerror(error->err);
 
-	register_global_error(msg);
+		free(error->str);
+		error->str = utf8_to_wchar_t(msg);
+		error->str_valid = 1;
+	}
+
+	return error->str;
 }
 
-/* Set the last error for a device to be reported by hid_error(device).
- * The given error message will be copied (and decoded according to the
- * currently locale, so do not pass in string constants).
- * The last stored global error message is freed.
- * Use register_device_error(device, NULL) to indicate "no error". */
-static void register_device_error(hid_device *dev, const char *msg)
+/* Set the last global error to be reported by hid_error(NULL).
+ * op describes what failed and must be a string constant, err is the
+ * errno value of the failure. Either one may be left out.
+ * Use register_global_error(NULL, 0) to indicate "no error". */
+static void register_global_error(const char *op, int err)
 {
-	if (dev->last_error_str)
-		free(dev->last_error_str);
-
-	dev->last_error_str = utf8_to_wchar_t(msg);
+	set_error(&last_global_error, op, err);
 }
 
-/* See register_device_error, but you can pass a format string into this function. */
-static void register_device_error_format(hid_device *dev, const char *format, ...)
+/* Like register_global_error, but you can pass a format string into this
+   function. The message is formatted right away, so this is only meant
+   for paths where the cost doesn't matter. */
+static void register_global_error_format(const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
@@ -161,14 +261,17 @@ static void register_device_error_format(hid_device *dev, const char *format, ..
 
 	va_end(args);
 
-	register_device_error(dev, msg);
+	set_error(&last_global_error, NULL, 0);
+	last_global_error.msg = strdup(msg);
 }
 
-/* Get an attribute value from a udev_device and return it as a whar_t
-   string. The returned string must be freed with free() when done.*/
-static wchar_t *copy_udev_string(struct udev_device *dev, const char *udev_name)
+/* Set the last error for a device to be reported by hid_error(device).
+ * op describes what failed and must be a string constant, err is the
+ * errno value of the failure. Either one may be left out.
+ * Use register_device_error(device, NULL, 0) to indicate "no error". */
+static void register_device_error(hid_device *dev, const char *op, int err)
 {
-	return utf8_to_wchar_t(udev_device_get_sysattr_value(dev, udev_name));
+	set_error(&dev->last_error, op, err);
 }
 
 /*
@@ -274,10 +377,10 @@ static __u32 get_hid_report_bytes(__u8 *rpt, size_t len, size_t num_bytes, size_
 		return (rpt[cur + 2] * 256 + rpt[cur + 1]);
 	else if (num_bytes == 4)
 		return (
-			rpt[cur + 4] * 0x01000000 +
-			rpt[cur + 3] * 0x00010000 +
-			rpt[cur + 2] * 0x00000100 +
-			rpt[cur + 1] * 0x00000001
+			(__u32) rpt[cur + 4] * 0x01000000 +
+			(__u32) rpt[cur + 3] * 0x00010000 +
+			(__u32) rpt[cur + 2] * 0x00000100 +
+			(__u32) rpt[cur + 1] * 0x00000001
 		);
 	else
 		return 0;
@@ -361,16 +464,706 @@ static int get_next_hid_usage(__u8 *report_descriptor, __u32 size, unsigned int
 	return 1; /* finished processing */
 }
 
+/* Number of possible Report IDs, including 0 for unnumbered reports. */
+#define REPORT_ID_COUNT 256
+/* Number of report types, see hid_report_type. */
+#define REPORT_TYPE_COUNT 3
+/* Depth of the Push/Pop stack of global items. */
+#define GLOBAL_STACK_SIZE 16
+/* Largest report the parser accepts, in bits. This is the maximum
+   report size of the kernel (HID_MAX_BUFFER_SIZE). */
+#define MAX_REPORT_BITS (16384 * 8)
+
+/* Global items, 6.2.2.7. They stay in effect until they are changed,
+   and can be saved and restored with Push and Pop. */
+struct hid_parser_globals {
+	unsigned short usage_page;
+	__s32 logical_minimum;
+	__s32 logical_maximum;
+	__u32 logical_maximum_unsigned;
+	__u32 report_size;
+	__u32 report_count;
+	__u32 report_id;
+};
+
+/* A Usage local item. Short usages are combined with the Usage Page
+   in effect at the Main item, extended (4 byte) usages carry their own
+   Usage Page in the upper 16 bits. */
+struct hid_parser_usage {
+	__u32 value;
+	int extended;
+};
+
+/* A field, tagged with the report it belongs to. */
+struct hid_parser_field {
+	unsigned char report_id;
+	hid_report_type type;
+	struct hid_report_field field;
+};
+
+struct hid_parser {
+	struct hid_parser_globals global;
+	struct hid_parser_globals global_stack[GLOBAL_STACK_SIZE];
+	unsigned int global_stack_depth;
+
+	/* Local items, 6.2.2.8. They are reset by every Main item. */
+	struct hid_parser_usage *usages;
+	size_t num_usages;
+	size_t usages_capacity;
+	struct hid_parser_usage usage_minimum;
+	struct hid_parser_usage usage_maximum;
+	int has_usage_minimum;
+	int has_usage_maximum;
+
+	/* Fields found so far */
+	struct hid_parser_field *fields;
+	size_t num_fields;
+	size_t fields_capacity;
+
+	/* Size of each report so far, in bits, by type and Report ID */
+	__u32 report_bits[REPORT_TYPE_COUNT][REPORT_ID_COUNT];
+	int uses_numbered_reports;
+};
+
+/* Get the signed value of an item, see get_hid_report_bytes(). */
+static __s32 get_hid_report_signed(__u8 *rpt, size_t len, size_t num_bytes, size_t cur)
+{
+	__u32 value = get_hid_report_bytes(rpt, len, num_bytes, cur);
+
+	if (num_bytes == 1)
+		return (__s8) value;
+	else if (num_bytes == 2)
+		return (__s16) value;
+	return (__s32) value;
+}
+
+static void reset_local_items(struct hid_parser *parser)
+{
+	parser->num_usages = 0;
+	parser->has_usage_minimum = 0;
+	parser->has_usage_maximum = 0;
+}
+
+/* Returns 0 on success and -1 if out of memory. */
+static int add_local_usage(struct hid_parser *parser, __u32 value, int extended)
+{
+	if (parser->num_usages == parser->usages_capacity) {
+		size_t capacity = parser->usages_capacity? parser->usages_capacity * 2: 16;
+		struct hid_parser_usage *usages = (struct hid_parser_usage*) realloc(parser->usages, capacity * sizeof(*usages));
+		if (!usages)
+			return -1;
+		parser->usages = usages;
+		parser->usages_capacity = capacity;
+	}
+
+	parser->usages[parser->num_usages].value = value;
+	parser->usages[parser->num_usages].extended = extended;
+	parser->num_usages++;
+	return 0;
+}
+
+/* Number of usages in scope: the Usage items followed by the range of
+   Usage Minimum to Usage Maximum, if there is one. */
+static size_t get_num_local_usages(const struct hid_parser *parser)
+{
+	size_t num = parser->num_usages;
+
+	if (parser->has_usage_minimum && parser->has_usage_maximum &&
+	    parser->usage_minimum.value <= parser->usage_maximum.value)
+		num += parser->usage_maximum.value - parser->usage_minimum.value + 1;
+
+	return num;
+}
+
+/* Get the i-th usage in scope as Usage Page and Usage. If there are
+   fewer usages than values, the last one applies to the rest, 6.2.2.8. */
+static void get_local_usage(const struct hid_parser *parser, size_t i, unsigned short *usage_page, unsigned short *usage)
+{
+	size_t num = get_num_local_usages(parser);
+	struct hid_parser_usage u;
+
+	if (num == 0) {
+		*usage_page = parser->global.usage_page;
+		*usage = 0;
+		return;
+	}
+
+	if (i >= num)
+		i = num - 1;
+
+	if (i < parser->num_usages) {
+		u = parser->usages[i];
+	}
+	else {
+		u = parser->usage_minimum;
+		u.value += (__u32) (i - parser->num_usages);
+	}
+
+	*usage_page = u.extended? (unsigned short) (u.value >> 16): parser->global.usage_page;
+	*usage = (unsigned short) (u.value & 0xffff);
+}
+
+/* Returns 0 on success and -1 if out of memory. */
+static int add_report_field(struct hid_parser *parser, hid_report_type type, const struct hid_report_field *field)
+{
+	struct hid_parser_field *f;
+
+	if (parser->num_fields == parser->fields_capacity) {
+		size_t capacity = parser->fields_capacity? parser->fields_capacity * 2: 32;
+		struct hid_parser_field *fields = (struct hid_parser_field*) realloc(parser->fields, capacity * sizeof(*fields));
+		if (!fields)
+			return -1;
+		parser->fields = fields;
+		parser->fields_capacity = capacity;
+	}
+
+	f = &parser->fields[parser->num_fields++];
+	f->report_id = (unsigned char) parser->global.report_id;
+	f->type = type;
+	f->field = *field;
+	return 0;
+}
+
+/* Handle an Input, Output or Feature item, 6.2.2.4.
+   Returns 0 on success and -1 on a malformed report or if out of memory. */
+static int add_main_item(struct hid_parser *parser, hid_report_type type, __u32 flags)
+{
+	const struct hid_parser_globals *g = &parser->global;
+	__u32 *report_bits = &parser->report_bits[type][g->report_id];
+	__u64 bits = (__u64) g->report_size * g->report_count;
+	struct hid_report_field field;
+	size_t i;
+
+	if (*report_bits + bits > MAX_REPORT_BITS)
+		return -1;
+
+	/* Constant items are padding. Values larger than 32 bits are
+	   not supported and just take up their space. */
+	if (!(flags & 0x1/*Constant*/) &&
+	    g->report_size >= 1 && g->report_size <= 32 && g->report_count > 0) {
+		memset(&field, 0, sizeof(field));
+		field.bit_size = (unsigned short) g->report_size;
+		field.logical_minimum = g->logical_minimum;
+		field.logical_maximum = g->logical_maximum;
+		/* A Logical Maximum which only makes sense unsigned, e.g.
+		   0xff in one byte, 6.2.2.7. */
+		if (g->logical_minimum >= 0 && g->logical_maximum < g->logical_minimum)
+			field.logical_maximum = (g->logical_maximum_unsigned > INT_MAX)? INT_MAX: (int) g->logical_maximum_unsigned;
+		field.flags = flags;
+
+		if (flags & 0x2/*Variable*/) {
+			/* One field per value, each with its own usage. */
+			field.count = 1;
+			for (i = 0; i < g->report_count; i++) {
+				get_local_usage(parser, i, &field.usage_page, &field.usage);
+				field.usage_maximum = field.usage;
+				field.bit_offset = *report_bits + i * g->report_size;
+				if (add_report_field(parser, type, &field) < 0)
+					return -1;
+			}
+		}
+		else {
+			/* Array: the values select from all usages in scope. */
+			unsigned short last_page;
+			size_t num = get_num_local_usages(parser);
+			field.count = (g->report_count > 0xffff)? 0xffff: (unsigned short) g->report_count;
+			get_local_usage(parser, 0, &field.usage_page, &field.usage);
+			get_local_usage(parser, num? num - 1: 0, &last_page, &field.usage_maximum);
+			field.bit_offset = *report_bits;
+			if (add_report_field(parser, type, &field) < 0)
+				return -1;
+		}
+	}
+
+	*report_bits += (__u32) bits;
+	return 0;
+}
+
+/* Parse all items of the report descriptor.
+   Returns 0 on success and -1 on a malformed report or if out of memory. */
+static int parse_report_descriptor(struct hid_parser *parser, __u8 *report_descriptor, __u32 size)
+{
+	unsigned int pos = 0;
+	int data_len, key_size;
+
+	while (pos < size) {
+		int key = report_descriptor[pos];
+		int key_cmd = key & 0xfc;
+		__u32 value;
+
+		/* Determine data_len and key_size */
+		if (!get_hid_item_size(report_descriptor, pos, size, &data_len, &key_size))
+			return -1; /* malformed report */
+		if (pos + key_size + data_len > size)
+			return -1; /* truncated item */
+
+		/* Long items (0xfe) aren't used by any defined item. */
+		if ((key & 0xf0) == 0xf0) {
+			pos += data_len + key_size;
+			continue;
+		}
+
+		value = get_hid_report_bytes(report_descriptor, size, data_len, pos);
+
+		switch (key_cmd) {
+		/* Main items, 6.2.2.4 */
+		case 0x80: /* Input */
+			if (add_main_item(parser, HID_REPORT_TYPE_INPUT, value) < 0)
+				return -1;
+			reset_local_items(parser);
+			break;
+		case 0x90: /* Output */
+			if (add_main_item(parser, HID_REPORT_TYPE_OUTPUT, value) < 0)
+				return -1;
+			reset_local_items(parser);
+			break;
+		case 0xb0: /* Feature */
+			if (add_main_item(parser, HID_REPORT_TYPE_FEATURE, value) < 0)
+				return -1;
+			reset_local_items(parser);
+			break;
+		case 0xa0: /* Collection */
+		case 0xc0: /* End Collection */
+			reset_local_items(parser);
+			break;
+
+		/* Global items, 6.2.2.7 */
+		case 0x04: /* Usage Page */
+			parser->global.usage_page = (unsigned short) value;
+			break;
+		case 0x14: /* Logical Minimum */
+			parser->global.logical_minimum = get_hid_report_signed(report_descriptor, size, data_len, pos);
+			break;
+		case 0x24: /* Logical Maximum */
+			parser->global.logical_maximum = get_hid_report_signed(report_descriptor, size, data_len, pos);
+			parser->global.logical_maximum_unsigned = value;
+			break;
+		case 0x74: /* Report Size */
+			parser->global.report_size = value;
+			break;
+		case 0x84: /* Report ID */
+			if (value == 0 || value >= REPORT_ID_COUNT)
+				return -1;
+			parser->global.report_id = value;
+			parser->uses_numbered_reports = 1;
+			break;
+		case 0x94: /* Report Count */
+			parser->global.report_count = value;
+			break;
+		case 0xa4: /* Push */
+			if (parser->global_stack_depth == GLOBAL_STACK_SIZE)
+				return -1;
+			parser->global_stack[parser->global_stack_depth++] = parser->global;
+			break;
+		case 0xb4: /* Pop */
+			if (parser->global_stack_depth == 0)
+				return -1;
+			parser->global = parser->global_stack[--parser->global_stack_depth];
+			break;
+
+		/* Local items, 6.2.2.8 */
+		case 0x08: /* Usage */
+			if (add_local_usage(parser, value, data_len == 4) < 0)
+				return -1;
+			break;
+		case 0x18: /* Usage Minimum */
+			parser->usage_minimum.value = value;
+			parser->usage_minimum.extended = (data_len == 4);
+			parser->has_usage_minimum = 1;
+			break;
+		case 0x28: /* Usage Maximum */
+			parser->usage_maximum.value = value;
+			parser->usage_maximum.extended = (data_len == 4);
+			parser->has_usage_maximum = 1;
+			break;
+		}
+
+		/* Skip over this key and it's associated data */
+		pos += data_len + key_size;
+	}
+
+	return 0;
+}
+
+/* Compile the report descriptor into the layout of the reports of the
+   device. The layout is allocated as a single block, to be freed with
+   free(). Returns NULL on a malformed report or if out of memory. */
+static struct hid_report_layout *create_report_layout(__u8 *report_descriptor, __u32 size)
+{
+	struct hid_parser *parser;
+	struct hid_report_layout *layout = NULL;
+	struct hid_report_info *reports;
+	struct hid_report_field *fields;
+	size_t num_reports = 0;
+	size_t *field_pos = NULL;
+	size_t i, pos;
+	int type, id;
+
+	parser = (struct hid_parser*) calloc(1, sizeof(struct hid_parser));
+	if (!parser)
+		return NULL;
+
+	if (parse_report_descriptor(parser, report_descriptor, size) < 0)
+		goto end;
+
+	/* Every report which takes up any bits gets an entry. */
+	for (type = 0; type < REPORT_TYPE_COUNT; type++)
+		for (id = 0; id < REPORT_ID_COUNT; id++)
+			if (parser->report_bits[type][id])
+				num_reports++;
+
+	layout = (struct hid_report_layout*) calloc(1,
+		sizeof(struct hid_report_layout) +
+		num_reports * sizeof(struct hid_report_info) +
+		parser->num_fields * sizeof(struct hid_report_field));
+	field_pos = (size_t*) calloc(REPORT_TYPE_COUNT * REPORT_ID_COUNT, sizeof(size_t));
+	if (!layout || !field_pos) {
+		free(layout);
+		layout = NULL;
+		goto end;
+	}
+	reports = (struct hid_report_info*) (layout + 1);
+	fields = (struct hid_report_field*) (reports + num_reports);
+
+	/* Count the fields of each report, ... */
+	for (i = 0; i < parser->num_fields; i++)
+		field_pos[parser->fields[i].type * REPORT_ID_COUNT + parser->fields[i].report_id]++;
+
+	/* ... lay out the reports and find where their fields start, ... */
+	num_reports = 0;
+	pos = 0;
+	for (type = 0; type < REPORT_TYPE_COUNT; type++) {
+		for (id = 0; id < REPORT_ID_COUNT; id++) {
+			size_t count = field_pos[type * REPORT_ID_COUNT + id];
+			field_pos[type * REPORT_ID_COUNT + id] = pos;
+			if (!parser->report_bits[type][id])
+				continue;
+
+			reports[num_reports].report_id = (unsigned char) id;
+			reports[num_reports].type = (hid_report_type) type;
+			reports[num_reports].size = (parser->report_bits[type][id] + 7) / 8;
+			reports[num_reports].fields = fields + pos;
+			reports[num_reports].num_fields = count;
+			num_reports++;
+			pos += count;
+		}
+	}
+
+	/* ... and copy the fields over, keeping their order. */
+	for (i = 0; i < parser->num_fields; i++) {
+		const struct hid_parser_field *f = &parser->fields[i];
+		fields[field_pos[f->type * REPORT_ID_COUNT + f->report_id]++] = f->field;
+	}
+
+	layout->uses_numbered_reports = parser->uses_numbered_reports;
+	layout->reports = reports;
+	layout->num_reports = num_reports;
+
+end:
+	free(field_pos);
+	free(parser->usages);
+	free(parser->fields);
+	free(parser);
+	return layout;
+}
+
+/* Decoding of Input reports. For every Input report, a decoder is
+   prepared from the layout with the byte offset, shift, mask and sign
+   bit of each value, as separate arrays so that several values can be
+   extracted at once with vector instructions. */
+
+/* Runs of at least this many consecutive byte-aligned 8-bit values are
+   decoded 16 at a time with SSE2. */
+#define DECODE_BYTE_RUN_MIN 16
+
+enum decode_run_kind {
+	DECODE_RUN_SCALAR, /* any values, one at a time */
+	DECODE_RUN_BYTES, /* consecutive byte-aligned 8-bit values */
+	DECODE_RUN_GATHER, /* values within 32 bits read from their first byte */
+};
+
+struct decode_run {
+	enum decode_run_kind kind;
+	size_t first; /* index of the first value */
+	size_t count;
+};
+
+struct report_decoder {
+	size_t num_values;
+	/* Size of the report as read by hid_read(), with the Report ID */
+	size_t report_size;
+
+	/* Per value, offsets from the start of the report as read */
+	__u32 *byte_offset;
+	__u32 *shift;
+	__u32 *mask;
+	__u32 *sign_bit; /* 0 for unsigned values */
+
+	struct decode_run *runs;
+	size_t num_runs;
+	int use_avx2;
+};
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_DECODE
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#include <immintrin.h>
+#define HAVE_AVX2_DECODE
+#endif
+
+/* Sign extend (or not) a value which has been masked to its size. */
+static inline int extend_value(__u32 value, __u32 sign_bit)
+{
+	return (int) ((value ^ sign_bit) - sign_bit);
+}
+
+static void decode_scalar(const struct report_decoder *decoder, size_t first, size_t count, const unsigned char *data, size_t length, int *values)
+{
+	size_t i;
+
+	for (i = first; i < first + count; i++) {
+		size_t offset = decoder->byte_offset[i];
+		__u64 raw = 0;
+
+		if (offset + sizeof(raw) <= length) {
+			memcpy(&raw, data + offset, sizeof(raw));
+			raw = le64toh(raw);
+		}
+		else {
+			/* Near the end of the report. A value spans at most
+			   5 bytes. */
+			size_t k;
+			for (k = 0; k < 5 && offset + k < length; k++)
+				raw |= (__u64) data[offset + k] << (8 * k);
+		}
+
+		values[i] = extend_value((__u32) (raw >> decoder->shift[i]) & decoder->mask[i], decoder->sign_bit[i]);
+	}
+}
+
+#ifdef HAVE_SSE2_DECODE
+static void decode_bytes_sse2(const struct report_decoder *decoder, size_t first, size_t count, const unsigned char *data, int *values)
+{
+	const unsigned char *src = data + decoder->byte_offset[first];
+	int *dst = values + first;
+	const int is_signed = decoder->sign_bit[first] != 0;
+	const __m128i zero = _mm_setzero_si128();
+	size_t k;
+
+	for (k = 0; k + 16 <= count; k += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*) (src + k));
+		__m128i lo, hi;
+
+		if (is_signed) {
+			/* Put each byte into the upper half of a 16-bit lane
+			   (and then of a 32-bit lane) and shift it back down
+			   arithmetically. */
+			lo = _mm_srai_epi16(_mm_unpacklo_epi8(bytes, bytes), 8);
+			hi = _mm_srai_epi16(_mm_unpackhi_epi8(bytes, bytes), 8);
+			_mm_storeu_si128((__m128i*) (dst + k), _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16));
+			_mm_storeu_si128((__m128i*) (dst + k + 4), _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16));
+			_mm_storeu_si128((__m128i*) (dst + k + 8), _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16));
+			_mm_storeu_si128((__m128i*) (dst + k + 12), _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16));
+		}
+		else {
+			lo = _mm_unpacklo_epi8(bytes, zero);
+			hi = _mm_unpackhi_epi8(bytes, zero);
+			_mm_storeu_si128((__m128i*) (dst + k), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128((__m128i*) (dst + k + 4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128((__m128i*) (dst + k + 8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128((__m128i*) (dst + k + 12), _mm_unpackhi_epi16(hi, zero));
+		}
+	}
+
+	/* The rest, one at a time. The run is within the report, so no
+	   bounds need to be checked. */
+	decode_scalar(decoder, first + k, count - k, data, decoder->report_size, values);
+}
+#endif
+
+#ifdef HAVE_AVX2_DECODE
+__attribute__((target("avx2")))
+static void decode_gather_avx2(const struct report_decoder *decoder, size_t first, size_t count, const unsigned char *data, int *values)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= count; k += 8) {
+		size_t i = first + k;
+		__m256i offset = _mm256_loadu_si256((const __m256i*) (decoder->byte_offset + i));
+		__m256i shift = _mm256_loadu_si256((const __m256i*) (decoder->shift + i));
+		__m256i mask = _mm256_loadu_si256((const __m256i*) (decoder->mask + i));
+		__m256i sign_bit = _mm256_loadu_si256((const __m256i*) (decoder->sign_bit + i));
+
+		/* Read 32 bits from the first byte of each value, ... */
+		__m256i v = _mm256_i32gather_epi32((const int*) data, offset, 1);
+
+		/* ... shift and mask them, ... */
+		v = _mm256_and_si256(_mm256_srlv_epi32(v, shift), mask);
+
+		/* ... and sign extend them. */
+		v = _mm256_sub_epi32(_mm256_xor_si256(v, sign_bit), sign_bit);
+
+		_mm256_storeu_si256((__m256i*) (values + i), v);
+	}
+
+	decode_scalar(decoder, first + k, count - k, data, decoder->report_size, values);
+}
+#endif
+
+/* Prepare the decoder of a report. Returns NULL if out of memory. */
+static struct report_decoder *create_report_decoder(const struct hid_report_info *report, int uses_numbered_reports)
+{
+	struct report_decoder *decoder;
+	size_t num_values = 0;
+	size_t *byte_run_len;
+	size_t i, j, n;
+
+	for (i = 0; i < report->num_fields; i++)
+		num_values += report->fields[i].count;
+
+	decoder = (struct report_decoder*) calloc(1, sizeof(struct report_decoder));
+	byte_run_len = (size_t*) calloc(num_values + 1, sizeof(size_t));
+	if (decoder) {
+		decoder->num_values = num_values;
+		decoder->report_size = report->size + (uses_numbered_reports? 1: 0);
+		decoder->byte_offset = (__u32*) calloc(num_values + 1, 4 * sizeof(__u32));
+		/* A value needs at most one run. */
+		decoder->runs = (struct decode_run*) calloc(num_values + 1, sizeof(struct decode_run));
+	}
+	if (!decoder || !byte_run_len || !decoder->byte_offset || !decoder->runs) {
+		if (decoder) {
+			free(decoder->byte_offset);
+			free(decoder->runs);
+		}
+		free(decoder);
+		free(byte_run_len);
+		return NULL;
+	}
+	decoder->shift = decoder->byte_offset + num_values;
+	decoder->mask = decoder->shift + num_values;
+	decoder->sign_bit = decoder->mask + num_values;
+
+	/* The tables. */
+	n = 0;
+	for (i = 0; i < report->num_fields; i++) {
+		const struct hid_report_field *field = &report->fields[i];
+		for (j = 0; j < field->count; j++) {
+			__u32 bit = field->bit_offset + j * field->bit_size;
+			if (uses_numbered_reports)
+				bit += 8; /* Skip the Report ID */
+
+			decoder->byte_offset[n] = bit / 8;
+			decoder->shift[n] = bit % 8;
+			decoder->mask[n] = (field->bit_size == 32)? 0xffffffff: ((__u32) 1 << field->bit_size) - 1;
+			decoder->sign_bit[n] = (field->logical_minimum < 0)? (__u32) 1 << (field->bit_size - 1): 0;
+			n++;
+		}
+	}
+
+	/* Length of the run of consecutive byte-aligned 8-bit values which
+	   starts at each value. */
+	for (i = num_values; i-- > 0; ) {
+		if (decoder->mask[i] != 0xff || decoder->shift[i] != 0)
+			continue;
+		byte_run_len[i] = 1;
+		if (i + 1 < num_values && byte_run_len[i + 1] &&
+		    decoder->byte_offset[i + 1] == decoder->byte_offset[i] + 1 &&
+		    decoder->sign_bit[i + 1] == decoder->sign_bit[i])
+			byte_run_len[i] += byte_run_len[i + 1];
+	}
+
+	/* Split the values into runs. */
+	for (i = 0; i < num_values; ) {
+		struct decode_run *run = &decoder->runs[decoder->num_runs++];
+		run->first = i;
+
+		if (byte_run_len[i] >= DECODE_BYTE_RUN_MIN) {
+			run->kind = DECODE_RUN_BYTES;
+			run->count = byte_run_len[i];
+			i += run->count;
+			continue;
+		}
+
+		/* A value can be gathered if the 32 bits read from its first
+		   byte contain all of it and are within the report. */
+#define DECODE_GATHERABLE(k) \
+	(decoder->shift[k] + (__u32) __builtin_popcount(decoder->mask[k]) <= 32 && \
+	 decoder->byte_offset[k] + 4 <= decoder->report_size)
+		run->kind = DECODE_GATHERABLE(i)? DECODE_RUN_GATHER: DECODE_RUN_SCALAR;
+		do {
+			i++;
+		} while (i < num_values && byte_run_len[i] < DECODE_BYTE_RUN_MIN &&
+		         (DECODE_GATHERABLE(i)? DECODE_RUN_GATHER: DECODE_RUN_SCALAR) == run->kind);
+#undef DECODE_GATHERABLE
+		run->count = i - run->first;
+	}
+
+#ifdef HAVE_AVX2_DECODE
+	decoder->use_avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+
+	free(byte_run_len);
+	return decoder;
+}
+
+static void free_report_decoders(struct report_decoder **decoders)
+{
+	int i;
+
+	if (!decoders)
+		return;
+
+	for (i = 0; i < REPORT_ID_COUNT; i++) {
+		if (decoders[i]) {
+			free(decoders[i]->byte_offset);
+			free(decoders[i]->runs);
+			free(decoders[i]);
+		}
+	}
+	free(decoders);
+}
+
+/* Prepare the decoders of all Input reports of a layout, indexed by
+   Report ID. Returns NULL if out of memory. */
+static struct report_decoder **create_report_decoders(const struct hid_report_layout *layout)
+{
+	struct report_decoder **decoders;
+	size_t i;
+
+	decoders = (struct report_decoder**) calloc(REPORT_ID_COUNT, sizeof(struct report_decoder*));
+	if (!decoders)
+		return NULL;
+
+	for (i = 0; i < layout->num_reports; i++) {
+		const struct hid_report_info *report = &layout->reports[i];
+		if (report->type != HID_REPORT_TYPE_INPUT)
+			continue;
+
+		decoders[report->report_id] = create_report_decoder(report, layout->uses_numbered_reports);
+		if (!decoders[report->report_id]) {
+			free_report_decoders(decoders);
+			return NULL;
+		}
+	}
+
+	return decoders;
+}
+
 /*
  * Retrieves the hidraw report descriptor from a file.
  * When using this form, <sysfs_path>/device/report_descriptor, elevated priviledges are not required.
  */
-static int get_hid_report_descriptor(const char *rpt_path, struct hidraw_report_descriptor *rpt_desc)
+static int get_hid_report_descriptor(int dir_fd, const char *rpt_path, struct hidraw_report_descriptor *rpt_desc)
 {
 	int rpt_handle;
 	ssize_t res;
 
-	rpt_handle = open(rpt_path, O_RDONLY);
+	/* rpt_path is relative to dir_fd, which may be AT_FDCWD */
+	rpt_handle = openat(dir_fd, rpt_path, O_RDONLY);
 	if (rpt_handle < 0) {
 		register_global_error_format("open failed (%s): %s", rpt_path, strerror(errno));
 		return -1;
@@ -401,7 +1194,7 @@ static int get_hid_report_descriptor_from_sysfs(const char *sysfs_path, struct h
 	char* rpt_path = (char*) calloc(1, rpt_path_len);
 	snprintf(rpt_path, rpt_path_len, "%s/device/report_descriptor", sysfs_path);
 
-	res = get_hid_report_descriptor(rpt_path, rpt_desc);
+	res = get_hid_report_descriptor(AT_FDCWD, rpt_path, rpt_desc);
 	free(rpt_path);
 
 	return res;
@@ -477,7 +1270,7 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 	/* Create the udev object */
 	udev = udev_new();
 	if (!udev) {
-		register_global_error("Couldn't create udev context");
+		register_global_error("Couldn't create udev context", 0);
 		return -1;
 	}
 
@@ -602,72 +1395,1609 @@ int HID_API_EXPORT hid_init(void)
 
 int HID_API_EXPORT hid_exit(void)
 {
+	/* Stop watching for devices */
+	hid_hotplug_exit();
+
 	/* Free global error message */
-	register_global_error(NULL);
+	free_error(&last_global_error);
 
 	return 0;
 }
 
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Memory for the records of an enumeration. Records and their strings
+   are carved out of a few large chunks, and while the enumeration is
+   being built, equal strings are stored only once, so the records of a
+   device with several usage pairs share them. The arena is freed with
+   its last record. */
+#define ENUMERATION_CHUNK_SIZE 8192
+#define ENUMERATION_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct enumeration_chunk {
+	struct enumeration_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct enumeration_string {
+	const void *data;
+	size_t size;
+	size_t hash;
+};
+
+struct enumeration_arena {
+	/* Newest first. The arena itself is at the start of the last one. */
+	struct enumeration_chunk *chunks;
+	/* Records which haven't been freed yet */
+	size_t records;
+	/* Hash table of the strings, while the enumeration is built */
+	int interning;
+	struct enumeration_string *strings;
+	size_t strings_size;
+	size_t strings_count;
+};
+
+/* Every hid_device_info allocated by this backend is one of these, so
+   that hid_free_enumeration() can tell who owns it. */
+struct device_info_record {
+	struct hid_device_info info;
+	/* NULL if the record and its strings are allocated one by one */
+	struct enumeration_arena *arena;
+};
+
+static struct enumeration_chunk *enumeration_chunk_new(size_t size, struct enumeration_chunk *next)
 {
-	struct udev *udev;
-	struct udev_enumerate *enumerate;
-	struct udev_list_entry *devices, *dev_list_entry;
+	struct enumeration_chunk *chunk;
 
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
-	struct hid_device_info *prev_dev = NULL; /* previous device */
+	chunk = (struct enumeration_chunk*) malloc(sizeof(struct enumeration_chunk) + size);
+	if (!chunk)
+		return NULL;
+	chunk->next = next;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
 
-	hid_init();
+static struct enumeration_arena *enumeration_arena_new(void)
+{
+	struct enumeration_chunk *chunk;
+	struct enumeration_arena *arena;
 
-	/* Create the udev object */
-	udev = udev_new();
-	if (!udev) {
-		register_global_error("Couldn't create udev context");
+	chunk = enumeration_chunk_new(ENUMERATION_CHUNK_SIZE, NULL);
+	if (!chunk)
 		return NULL;
-	}
 
-	/* Create a list of the devices in the 'hidraw' subsystem. */
-	enumerate = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
-	udev_enumerate_scan_devices(enumerate);
+	arena = (struct enumeration_arena*) chunk->data;
+	chunk->used = ENUMERATION_ALIGN(sizeof(struct enumeration_arena));
+	memset(arena, 0, sizeof(struct enumeration_arena));
+	arena->chunks = chunk;
+	arena->interning = 1;
+
+	return arena;
+}
+
+/* Stop interning strings, the enumeration is complete. */
+static void enumeration_arena_seal(struct enumeration_arena *arena)
+{
+	arena->interning = 0;
+	free(arena->strings);
+	arena->strings = NULL;
+	arena->strings_size = 0;
+	arena->strings_count = 0;
+}
+
+static void enumeration_arena_free(struct enumeration_arena *arena)
+{
+	struct enumeration_chunk *chunk = arena->chunks;
+
+	free(arena->strings);
+	/* The chunk holding the arena comes last. */
+	while (chunk) {
+		struct enumeration_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+static void *enumeration_arena_alloc(struct enumeration_arena *arena, size_t size)
+{
+	struct enumeration_chunk *chunk = arena->chunks;
+	void *ret;
+
+	size = ENUMERATION_ALIGN(size);
+	if (chunk->size - chunk->used < size) {
+		/* Each chunk is twice as large as the previous one. */
+		size_t chunk_size = chunk->size * 2;
+		while (chunk_size < size)
+			chunk_size *= 2;
+		chunk = enumeration_chunk_new(chunk_size, arena->chunks);
+		if (!chunk)
+			return NULL;
+		arena->chunks = chunk;
+	}
+
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+static size_t enumeration_string_hash(const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char*) data;
+	size_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	return hash;
+}
+
+/* data is the last thing allocated from the arena. If an equal string
+   is already stored, give data back and return that one. The size
+   includes the terminator, so narrow and wide strings can't match. */
+static void *enumeration_arena_intern(struct enumeration_arena *arena, void *data, size_t size)
+{
+	struct enumeration_string *entry;
+	size_t hash, mask, i;
+
+	if (!arena->interning)
+		return data;
+
+	/* Keep the table at most half full. */
+	if ((arena->strings_count + 1) * 2 > arena->strings_size) {
+		size_t new_size = arena->strings_size ? arena->strings_size * 2 : 64;
+		struct enumeration_string *strings;
+
+		strings = (struct enumeration_string*) calloc(new_size, sizeof(struct enumeration_string));
+		if (!strings)
+			return data;
+		for (i = 0; i < arena->strings_size; i++) {
+			const struct enumeration_string *old = &arena->strings[i];
+			size_t j;
+			if (!old->data)
+				continue;
+			for (j = old->hash & (new_size - 1); strings[j].data; j = (j + 1) & (new_size - 1))
+				;
+			strings[j] = *old;
+		}
+		free(arena->strings);
+		arena->strings = strings;
+		arena->strings_size = new_size;
+	}
+
+	hash = enumeration_string_hash(data, size);
+	mask = arena->strings_size - 1;
+	for (i = hash & mask; arena->strings[i].data; i = (i + 1) & mask) {
+		entry = &arena->strings[i];
+		if (entry->hash == hash && entry->size == size && memcmp(entry->data, data, size) == 0) {
+			arena->chunks->used = (char*) data - arena->chunks->data;
+			return (void*) entry->data;
+		}
+	}
+
+	entry = &arena->strings[i];
+	entry->data = data;
+	entry->size = size;
+	entry->hash = hash;
+	arena->strings_count++;
+
+	return data;
+}
+
+/* Copy a string into the arena, or with strdup() if arena is NULL. */
+static char *enumeration_strdup(struct enumeration_arena *arena, const char *s)
+{
+	size_t size;
+	char *ret;
+
+	if (!s)
+		return NULL;
+	if (!arena)
+		return strdup(s);
+
+	size = strlen(s) + 1;
+	ret = (char*) enumeration_arena_alloc(arena, size);
+	if (!ret)
+		return NULL;
+	memcpy(ret, s, size);
+	return (char*) enumeration_arena_intern(arena, ret, size);
+}
+
+/* Copy a string into the arena, or with wcsdup() if arena is NULL. */
+static wchar_t *enumeration_wcsdup(struct enumeration_arena *arena, const wchar_t *s)
+{
+	size_t size;
+	wchar_t *ret;
+
+	if (!s)
+		return NULL;
+	if (!arena)
+		return wcsdup(s);
+
+	size = (wcslen(s) + 1) * sizeof(wchar_t);
+	ret = (wchar_t*) enumeration_arena_alloc(arena, size);
+	if (!ret)
+		return NULL;
+	memcpy(ret, s, size);
+	return (wchar_t*) enumeration_arena_intern(arena, ret, size);
+}
+
+/* utf8_to_wchar_t(), into the arena unless it is NULL. */
+static wchar_t *enumeration_utf8_to_wchar_t(struct enumeration_arena *arena, const char *utf8)
+{
+	size_t wlen;
+	wchar_t *ret;
+
+	if (!arena)
+		return utf8_to_wchar_t(utf8);
+	if (!utf8)
+		return NULL;
+
+	wlen = mbstowcs(NULL, utf8, 0);
+	if ((size_t) -1 == wlen)
+		return enumeration_wcsdup(arena, L"");
+	ret = (wchar_t*) enumeration_arena_alloc(arena, (wlen + 1) * sizeof(wchar_t));
+	if (!ret)
+		return NULL;
+	mbstowcs(ret, utf8, wlen + 1);
+	ret[wlen] = 0x0000;
+	return (wchar_t*) enumeration_arena_intern(arena, ret, (wlen + 1) * sizeof(wchar_t));
+}
+
+/* A zeroed record, from the arena unless it is NULL. */
+static struct hid_device_info *new_device_info(struct enumeration_arena *arena)
+{
+	struct device_info_record *record;
+
+	if (arena) {
+		record = (struct device_info_record*) enumeration_arena_alloc(arena, sizeof(struct device_info_record));
+		if (record) {
+			memset(record, 0, sizeof(struct device_info_record));
+			record->arena = arena;
+			arena->records++;
+		}
+	}
+	else {
+		record = (struct device_info_record*) calloc(1, sizeof(struct device_info_record));
+	}
+
+	return record ? &record->info : NULL;
+}
+
+static struct enumeration_arena *device_info_arena(const struct hid_device_info *info)
+{
+	return ((const struct device_info_record*) info)->arena;
+}
+
+
+/* Matches every device, see hid_enumerate_ex(). */
+static const struct hid_enumerate_filter match_all_devices;
+
+static int bus_type_matches(const struct hid_enumerate_filter *filter, unsigned bus_type)
+{
+	switch (filter->bus_type) {
+		case HID_API_BUS_ANY:
+			return 1;
+		case HID_API_BUS_USB:
+			return bus_type == BUS_USB;
+		case HID_API_BUS_BLUETOOTH:
+			return bus_type == BUS_BLUETOOTH;
+		case HID_API_BUS_I2C:
+			return bus_type == BUS_I2C;
+	}
+	return 0;
+}
+
+static int usage_matches(const struct hid_enumerate_filter *filter, unsigned short usage_page, unsigned short usage)
+{
+	return (filter->usage_page == 0x0 || filter->usage_page == usage_page) &&
+	       (filter->usage == 0x0 || filter->usage == usage);
+}
+
+/* A device without a serial number matches the empty prefix only. */
+static int serial_number_matches(const struct hid_enumerate_filter *filter, const wchar_t *serial_number)
+{
+	if (!filter->serial_number_prefix)
+		return 1;
+
+	return wcsncmp(serial_number ? serial_number : L"", filter->serial_number_prefix, wcslen(filter->serial_number_prefix)) == 0;
+}
+
+static int serial_number_utf8_matches(const struct hid_enumerate_filter *filter, const char *serial_number_utf8)
+{
+	wchar_t *serial_number;
+	int ret;
+
+	if (!filter->serial_number_prefix)
+		return 1;
+
+	serial_number = utf8_to_wchar_t(serial_number_utf8);
+	ret = serial_number_matches(filter, serial_number);
+	free(serial_number);
+
+	return ret;
+}
+
+/* Whether a record matches the filter, apart from the bus type, which
+   it doesn't tell. */
+static int device_info_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
+{
+	return (filter->vendor_id == 0x0 || filter->vendor_id == info->vendor_id) &&
+	       (filter->product_id == 0x0 || filter->product_id == info->product_id) &&
+	       usage_matches(filter, info->usage_page, info->usage) &&
+	       (!(filter->flags & HID_API_ENUMERATE_MATCH_INTERFACE) || filter->interface_number == info->interface_number) &&
+	       serial_number_matches(filter, info->serial_number);
+}
+
+/* The sysfs path of a hidraw device is normally
+   .../<bus>:<vendor_id>:<product_id>.<n>/hidraw/hidrawN, so the
+   enumeration can skip devices which don't match the filter before
+   looking at them any closer.
+   Returns 0 if the device doesn't match, and 1 if it may. */
+static int sysfs_path_may_match(const char *sysfs_path, const struct hid_enumerate_filter *filter)
+{
+	const char *hidraw = NULL, *p, *name;
+	unsigned bus_type, dev_vid, dev_pid;
+
+	for (p = strstr(sysfs_path, "/hidraw/"); p; p = strstr(p + 1, "/hidraw/"))
+		hidraw = p;
+	if (!hidraw)
+		return 1;
+
+	for (name = hidraw; name > sysfs_path && name[-1] != '/'; name--)
+		;
+	if (sscanf(name, "%x:%x:%x.", &bus_type, &dev_vid, &dev_pid) != 3)
+		return 1;
+
+	return bus_type_matches(filter, bus_type) &&
+	       (filter->vendor_id == 0x0 || filter->vendor_id == dev_vid) &&
+	       (filter->product_id == 0x0 || filter->product_id == dev_pid);
+}
+
+/* A hidraw node, as create_device_info_for_device() sees it. Its
+   attributes come from libudev, or, with HIDAPI_SYSFS_ENUMERATION,
+   straight from sysfs. */
+struct hidraw_node {
+	/* The device's hidraw udev node, or NULL to use sysfs */
+	struct udev_device *raw_dev;
+
+	/* /sys/class/hidraw/hidrawN, if raw_dev is NULL */
+	int dir_fd;
+	char dev_path[sizeof("/dev/") + NAME_MAX];
+	/* Directories of the USB interface and the USB device above it,
+	   see open_sysfs_usb_parent(). -2 until they are looked up, and -1
+	   if there is none. */
+	int usb_interface_fd;
+	int usb_device_fd;
+	/* The attribute read last, see read_sysfs_attribute() */
+	char value[4096];
+};
+
+/* Read an attribute of a sysfs directory. Like udev, strip trailing
+   whitespace. The value is only good until the next call for the same
+   node.
+   Returns NULL if the attribute can't be read. */
+static const char *read_sysfs_attribute_at(struct hidraw_node *node, int dir_fd, const char *name)
+{
+	ssize_t len;
+	int fd;
+
+	fd = openat(dir_fd, name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	len = read(fd, node->value, sizeof(node->value) - 1);
+	close(fd);
+	if (len < 0)
+		return NULL;
+
+	while (len > 0 && isspace((unsigned char) node->value[len - 1]))
+		len--;
+	node->value[len] = '\0';
+
+	return node->value;
+}
+
+/* Read an attribute of a sysfs node, relative to its directory. */
+static const char *read_sysfs_attribute(struct hidraw_node *node, const char *name)
+{
+	return read_sysfs_attribute_at(node, node->dir_fd, name);
+}
+
+/* Whether the sysfs directory is a USB device of the devtype, which is
+   what udev_device_get_parent_with_subsystem_devtype() looks for: its
+   subsystem link names "usb", and its uevent has the DEVTYPE. */
+static int sysfs_dir_is_usb(struct hidraw_node *node, int dir_fd, const char *devtype)
+{
+	char link[PATH_MAX];
+	const char *subsystem, *uevent, *line;
+	ssize_t len;
+
+	len = readlinkat(dir_fd, "subsystem", link, sizeof(link) - 1);
+	if (len <= 0)
+		return 0;
+	link[len] = '\0';
+	subsystem = strrchr(link, '/');
+	if (strcmp(subsystem ? subsystem + 1 : link, "usb") != 0)
+		return 0;
+
+	uevent = read_sysfs_attribute_at(node, dir_fd, "uevent");
+	for (line = uevent; line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncmp(line, "DEVTYPE=", 8) == 0) {
+			size_t n = strcspn(line + 8, "\n");
+			return strlen(devtype) == n && strncmp(line + 8, devtype, n) == 0;
+		}
+	}
+	return 0;
+}
+
+/* Limit of the directories open_sysfs_usb_parent() walks up */
+#define SYSFS_MAX_DEPTH 32
+
+/* Open the first directory above the hidraw node's HID device which is
+   a USB device of the devtype. It isn't always the parent: the HID
+   devices behind a receiver, e.g. of hid-logitech-dj, sit below the
+   receiver's HID device. The walk ends at the top of /sys/devices,
+   which has no uevent.
+   Returns the directory fd, or -1 if there is none, e.g. for uhid
+   devices. */
+static int open_sysfs_usb_parent(struct hidraw_node *node, const char *devtype)
+{
+	int fd, depth;
+
+	fd = openat(node->dir_fd, "device/..", O_RDONLY | O_DIRECTORY);
+	for (depth = 0; fd >= 0 && depth < SYSFS_MAX_DEPTH; depth++) {
+		int parent;
+
+		if (faccessat(fd, "uevent", F_OK, 0) < 0)
+			break;
+		if (sysfs_dir_is_usb(node, fd, devtype))
+			return fd;
+
+		parent = openat(fd, "..", O_RDONLY | O_DIRECTORY);
+		close(fd);
+		fd = parent;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+static const char *hidraw_node_get_dev_path(struct hidraw_node *node)
+{
+	return node->raw_dev ? udev_device_get_devnode(node->raw_dev) : node->dev_path;
+}
+
+/* The uevent of the HID device above the hidraw node */
+static const char *hidraw_node_get_uevent(struct hidraw_node *node)
+{
+	struct udev_device *hid_dev; /* The device's HID udev node. */
+
+	if (!node->raw_dev)
+		return read_sysfs_attribute(node, "device/uevent");
+
+	hid_dev = udev_device_get_parent_with_subsystem_devtype(
+		node->raw_dev,
+		"hid",
+		NULL);
+	return hid_dev ? udev_device_get_sysattr_value(hid_dev, "uevent") : NULL;
+}
+
+/* An attribute of the USB interface (devtype "usb_interface") or the USB
+   device (devtype "usb_device") the hidraw node belongs to.
+   Returns NULL if there is none, e.g. for uhid devices. */
+static const char *hidraw_node_get_usb_attribute(struct hidraw_node *node, const char *devtype, const char *name)
+{
+	struct udev_device *usb_dev;
+
+	if (!node->raw_dev) {
+		int *fd = strcmp(devtype, "usb_device") == 0 ? &node->usb_device_fd : &node->usb_interface_fd;
+		if (*fd == -2)
+			*fd = open_sysfs_usb_parent(node, devtype);
+		return (*fd >= 0) ? read_sysfs_attribute_at(node, *fd, name) : NULL;
+	}
+
+	/* This will be several levels up the tree, but the function will
+	   find it. */
+	usb_dev = udev_device_get_parent_with_subsystem_devtype(
+			node->raw_dev,
+			"usb",
+			devtype);
+	return usb_dev ? udev_device_get_sysattr_value(usb_dev, name) : NULL;
+}
+
+static int hidraw_node_get_report_descriptor(struct hidraw_node *node, struct hidraw_report_descriptor *rpt_desc)
+{
+	if (!node->raw_dev)
+		return get_hid_report_descriptor(node->dir_fd, "device/report_descriptor", rpt_desc);
+	return get_hid_report_descriptor_from_sysfs(udev_device_get_syspath(node->raw_dev), rpt_desc);
+}
+
+/* The USB interface number of a hidraw device, or -1 if it isn't on
+   USB. */
+static int get_interface_number(struct hidraw_node *node)
+{
+	const char *str = hidraw_node_get_usb_attribute(node, "usb_interface", "bInterfaceNumber");
+	return (str)? strtol(str, NULL, 16): -1;
+}
+
+/* Create the hid_device_info records for a hidraw device, if it matches
+   the filter. There is one record for each top-level usage pair found in
+   the report descriptor which matches. The strings are left out, and
+   strings_pending is set, unless read_strings is set.
+   The records are allocated from arena, or one by one if it is NULL.
+   Returns NULL if the device doesn't match or isn't supported. */
+static struct hid_device_info *create_device_info_for_device(struct hidraw_node *node, const struct hid_enumerate_filter *filter, int read_strings, struct enumeration_arena *arena)
+{
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+	struct hid_device_info *prev_dev = NULL; /* previous device */
+
+	const char *dev_path;
+	const char *uevent;
+	const char *str;
+	unsigned short dev_vid;
+	unsigned short dev_pid;
+	char *serial_number_utf8 = NULL;
+	char *product_name_utf8 = NULL;
+	unsigned bus_type;
+	int result;
+	int desc_result;
+	struct hidraw_report_descriptor report_desc;
+
+	dev_path = hidraw_node_get_dev_path(node);
+
+	uevent = hidraw_node_get_uevent(node);
+	if (!uevent) {
+		/* Unable to find parent hid device. */
+		goto end;
+	}
+
+	result = parse_uevent_info(
+		uevent,
+		&bus_type,
+		&dev_vid,
+		&dev_pid,
+		&serial_number_utf8,
+		&product_name_utf8);
+
+	if (!result) {
+		/* parse_uevent_info() failed for at least one field. */
+		goto end;
+	}
+
+	/* Filter out unhandled devices right away */
+	switch (bus_type) {
+		case BUS_BLUETOOTH:
+		case BUS_I2C:
+		case BUS_USB:
+			break;
+
+		default:
+			goto end;
+	}
+
+	/* Check the rest of the filter, cheapest first. The strings are
+	   only read for devices which match. */
+	if (!bus_type_matches(filter, bus_type) ||
+	    !serial_number_utf8_matches(filter, serial_number_utf8))
+		goto end;
+
+	if ((filter->flags & HID_API_ENUMERATE_MATCH_INTERFACE) &&
+	    get_interface_number(node) != filter->interface_number)
+		goto end;
+
+	desc_result = hidraw_node_get_report_descriptor(node, &report_desc);
+	if (filter->usage_page != 0x0 || filter->usage != 0x0) {
+		unsigned short page = 0, usage = 0;
+		unsigned int pos = 0;
+
+		if (desc_result < 0)
+			goto end;
+		do {
+			if (get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage))
+				goto end;
+		} while (!usage_matches(filter, page, usage));
+	}
+
+	/* Check the VID/PID against the filter */
+	if ((filter->vendor_id == 0x0 || filter->vendor_id == dev_vid) &&
+	    (filter->product_id == 0x0 || filter->product_id == dev_pid)) {
+		struct hid_device_info *tmp;
+
+		/* VID/PID match. Create the record. */
+		tmp = new_device_info(arena);
+		if (cur_dev) {
+			cur_dev->next = tmp;
+		}
+		else {
+			root = tmp;
+		}
+		prev_dev = cur_dev;
+		cur_dev = tmp;
+
+		/* Fill out the record */
+		cur_dev->next = NULL;
+		cur_dev->path = enumeration_strdup(arena, dev_path);
+
+		/* VID/PID */
+		cur_dev->vendor_id = dev_vid;
+		cur_dev->product_id = dev_pid;
+
+		/* Serial Number */
+		if (read_strings)
+			cur_dev->serial_number = enumeration_utf8_to_wchar_t(arena, serial_number_utf8);
+		cur_dev->strings_pending = !read_strings;
+
+		/* Release Number */
+		cur_dev->release_number = 0x0;
+
+		/* Interface Number */
+		cur_dev->interface_number = -1;
+
+		switch (bus_type) {
+			case BUS_USB:
+				/* The node contains information about the hidraw device.
+				   The information about the USB device is in its parent
+				   with the subsystem/devtype pair of "usb"/"usb_device". */
+				str = hidraw_node_get_usb_attribute(node, "usb_device", "bcdDevice");
+
+				/* uhid USB devices
+				   Since this is a virtual hid interface, no USB information will
+				   be available. */
+				if (!str) {
+					/* Manufacturer and Product strings */
+					if (read_strings) {
+						cur_dev->manufacturer_string = enumeration_wcsdup(arena, L"");
+						cur_dev->product_string = enumeration_utf8_to_wchar_t(arena, product_name_utf8);
+					}
+					break;
+				}
+
+				/* Release Number */
+				cur_dev->release_number = strtol(str, NULL, 16);
+
+				/* Manufacturer and Product strings */
+				if (read_strings) {
+					cur_dev->manufacturer_string = enumeration_utf8_to_wchar_t(arena, hidraw_node_get_usb_attribute(node, "usb_device", device_string_names[DEVICE_STRING_MANUFACTURER]));
+					cur_dev->product_string = enumeration_utf8_to_wchar_t(arena, hidraw_node_get_usb_attribute(node, "usb_device", device_string_names[DEVICE_STRING_PRODUCT]));
+				}
+
+				/* Interface Number */
+				cur_dev->interface_number = get_interface_number(node);
+
+				break;
+
+			case BUS_BLUETOOTH:
+			case BUS_I2C:
+				/* Manufacturer and Product strings */
+				if (read_strings) {
+					cur_dev->manufacturer_string = enumeration_wcsdup(arena, L"");
+					cur_dev->product_string = enumeration_utf8_to_wchar_t(arena, product_name_utf8);
+				}
+
+				break;
+
+			default:
+				/* Unknown device type - this should never happen, as we
+				 * check for USB and Bluetooth devices above */
+				break;
+		}
+
+		/* Usage Page and Usage */
+		if (desc_result >= 0) {
+			unsigned short page = 0, usage = 0;
+			unsigned int pos = 0;
+			/*
+			 * Parse the first usage and usage page
+			 * out of the report descriptor.
+			 */
+			if (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
+				cur_dev->usage_page = page;
+				cur_dev->usage = usage;
+			}
+
+			/*
+			 * Parse any additional usage and usage pages
+			 * out of the report descriptor.
+			 */
+			while (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
+				/* Create new record for additional usage pairs */
+				tmp = new_device_info(arena);
+				cur_dev->next = tmp;
+				prev_dev = cur_dev;
+				cur_dev = tmp;
+
+				/* Update fields. In an arena, the strings are shared. */
+				cur_dev->path = enumeration_strdup(arena, dev_path);
+				cur_dev->vendor_id = dev_vid;
+				cur_dev->product_id = dev_pid;
+				cur_dev->serial_number = enumeration_wcsdup(arena, prev_dev->serial_number);
+				cur_dev->release_number = prev_dev->release_number;
+				cur_dev->interface_number = prev_dev->interface_number;
+				cur_dev->manufacturer_string = enumeration_wcsdup(arena, prev_dev->manufacturer_string);
+				cur_dev->product_string = enumeration_wcsdup(arena, prev_dev->product_string);
+				cur_dev->strings_pending = prev_dev->strings_pending;
+				cur_dev->usage_page = page;
+				cur_dev->usage = usage;
+			}
+
+			/* Drop the usage pairs which don't match the filter.
+			   At least one of them does, see above. */
+			if (filter->usage_page != 0x0 || filter->usage != 0x0) {
+				struct hid_device_info **link = &root;
+				while (*link) {
+					tmp = *link;
+					if (usage_matches(filter, tmp->usage_page, tmp->usage)) {
+						link = &tmp->next;
+						continue;
+					}
+					*link = tmp->next;
+					tmp->next = NULL;
+					hid_free_enumeration(tmp);
+				}
+			}
+		}
+	}
+
+end:
+	free(serial_number_utf8);
+	free(product_name_utf8);
+	/* The parents of raw_dev don't need to be (and can't be)
+	   unref()d.  It will cause a double-free() error.  I'm not
+	   sure why.  */
+
+	return root;
+}
+
+/* Put the records of a device at the end of the list. */
+static void append_device_infos(struct hid_device_info ***tail, struct hid_device_info *infos)
+{
+	**tail = infos;
+	/* A device can have several records. */
+	while (**tail)
+		*tail = &(**tail)->next;
+}
+
+#ifdef HIDAPI_SYSFS_ENUMERATION
+/* Create the records for /sys/class/hidraw/<name>, without libudev,
+   see create_device_info_for_device(). class_fd is /sys/class/hidraw. */
+static struct hid_device_info *create_device_info_for_sysfs_node(int class_fd, const char *name, const struct hid_enumerate_filter *filter, int read_strings, struct enumeration_arena *arena)
+{
+	struct hidraw_node node;
+	struct hid_device_info *ret;
+
+	node.raw_dev = NULL;
+	node.dir_fd = openat(class_fd, name, O_RDONLY | O_DIRECTORY);
+	if (node.dir_fd < 0)
+		return NULL;
+	snprintf(node.dev_path, sizeof(node.dev_path), "/dev/%s", name);
+	node.usb_interface_fd = -2;
+	node.usb_device_fd = -2;
+
+	ret = create_device_info_for_device(&node, filter, read_strings, arena);
+	if (node.usb_interface_fd >= 0)
+		close(node.usb_interface_fd);
+	if (node.usb_device_fd >= 0)
+		close(node.usb_device_fd);
+	close(node.dir_fd);
+
+	return ret;
+}
+
+/* List the hidraw nodes in /sys/class/hidraw. The link of each node
+   names its HID device, so devices which don't match the filter are
+   skipped before anything is opened. */
+static void enumerate_sysfs(const struct hid_enumerate_filter *filter, struct enumeration_arena *arena, struct hid_device_info ***tail)
+{
+	DIR *dir;
+	struct dirent *entry;
+
+	dir = opendir("/sys/class/hidraw");
+	if (!dir) {
+		/* Without the hidraw module, there are no devices. */
+		if (errno != ENOENT)
+			register_global_error("Couldn't open /sys/class/hidraw", errno);
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		char link[PATH_MAX];
+		ssize_t len;
+
+		if (strncmp(entry->d_name, "hidraw", 6) != 0)
+			continue;
+
+		len = readlinkat(dirfd(dir), entry->d_name, link, sizeof(link) - 1);
+		if (len > 0) {
+			link[len] = '\0';
+			if (!sysfs_path_may_match(link, filter))
+				continue;
+		}
+
+		append_device_infos(tail, create_device_info_for_sysfs_node(dirfd(dir), entry->d_name, filter, !(filter->flags & HID_API_ENUMERATE_LAZY), arena));
+	}
+
+	closedir(dir);
+}
+#else
+/* List the devices in the 'hidraw' subsystem with libudev. */
+static void enumerate_udev(const struct hid_enumerate_filter *filter, struct enumeration_arena *arena, struct hid_device_info ***tail)
+{
+	struct udev *udev;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *devices, *dev_list_entry;
+
+	/* Create the udev object */
+	udev = udev_new();
+	if (!udev) {
+		register_global_error("Couldn't create udev context", 0);
+		return;
+	}
+
+	/* Create a list of the devices in the 'hidraw' subsystem. */
+	enumerate = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
 	devices = udev_enumerate_get_list_entry(enumerate);
 	/* For each item, see if it matches the vid/pid, and if so
 	   create a udev_device record for it */
 	udev_list_entry_foreach(dev_list_entry, devices) {
 		const char *sysfs_path;
+		struct hidraw_node node;
+
+		/* Get the filename of the /sys entry for the device
+		   and create a udev_device object (dev) representing it */
+		sysfs_path = udev_list_entry_get_name(dev_list_entry);
+		if (!sysfs_path_may_match(sysfs_path, filter))
+			continue;
+		node.raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
+		if (!node.raw_dev)
+			continue;
+
+		append_device_infos(tail, create_device_info_for_device(&node, filter, !(filter->flags & HID_API_ENUMERATE_LAZY), arena));
+
+		udev_device_unref(node.raw_dev);
+	}
+	/* Free the enumerator and udev objects. */
+	udev_enumerate_unref(enumerate);
+	udev_unref(udev);
+}
+#endif
+
+/* See hid_enumerate_ex(). */
+static struct hid_device_info *enumerate_devices(const struct hid_enumerate_filter *filter)
+{
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info **tail = &root;
+	struct enumeration_arena *arena;
+
+	hid_init();
+
+	/* See hid_set_enumeration_cache(). */
+	if (hid_hotplug_enumerate_cached(filter, &root))
+		return root;
+
+	/* If this fails, the records are allocated one by one. */
+	arena = enumeration_arena_new();
+
+#ifdef HIDAPI_SYSFS_ENUMERATION
+	enumerate_sysfs(filter, arena, &tail);
+#else
+	enumerate_udev(filter, arena, &tail);
+#endif
+
+	if (arena) {
+		if (arena->records)
+			enumeration_arena_seal(arena);
+		else
+			enumeration_arena_free(arena);
+	}
+
+	return root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enumerate_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	return enumerate_devices(&filter);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_lazy(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enumerate_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	filter.flags = HID_API_ENUMERATE_LAZY;
+	return enumerate_devices(&filter);
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter)
+{
+	return enumerate_devices(filter ? filter : &match_all_devices);
+}
+
+/* Read the strings of a record of hid_enumerate_lazy(). */
+static void read_device_info_strings(struct hid_device_info *info)
+{
+	struct hid_device_info *tmp = NULL;
+	const char *sysname;
+
+	info->strings_pending = 0;
+
+	if (!info->path)
+		return;
+	sysname = strrchr(info->path, '/');
+	sysname = sysname ? sysname + 1 : info->path;
+
+	/* The records of a device all have the same strings, so any of
+	   them will do. */
+#ifdef HIDAPI_SYSFS_ENUMERATION
+	{
+		int class_fd = open("/sys/class/hidraw", O_RDONLY | O_DIRECTORY);
+		if (class_fd < 0)
+			return;
+		tmp = create_device_info_for_sysfs_node(class_fd, sysname, &match_all_devices, 1, device_info_arena(info));
+		close(class_fd);
+	}
+#else
+	{
+		struct udev *udev;
+		struct hidraw_node node;
+
+		udev = udev_new();
+		if (!udev) {
+			register_global_error("Couldn't create udev context", 0);
+			return;
+		}
+
+		node.raw_dev = udev_device_new_from_subsystem_sysname(udev, "hidraw", sysname);
+		if (node.raw_dev) {
+			tmp = create_device_info_for_device(&node, &match_all_devices, 1, device_info_arena(info));
+			udev_device_unref(node.raw_dev);
+		}
+
+		udev_unref(udev);
+	}
+#endif
+
+	if (tmp) {
+		/* The strings are allocated like info, whether in its arena or
+		   not, so they can be moved over. */
+		info->serial_number = tmp->serial_number;
+		info->manufacturer_string = tmp->manufacturer_string;
+		info->product_string = tmp->product_string;
+		tmp->serial_number = NULL;
+		tmp->manufacturer_string = NULL;
+		tmp->product_string = NULL;
+		hid_free_enumeration(tmp);
+	}
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_serial_number(struct hid_device_info *info)
+{
+	if (info->strings_pending)
+		read_device_info_strings(info);
+	return info->serial_number;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_manufacturer_string(struct hid_device_info *info)
+{
+	if (info->strings_pending)
+		read_device_info_strings(info);
+	return info->manufacturer_string;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_product_string(struct hid_device_info *info)
+{
+	if (info->strings_pending)
+		read_device_info_strings(info);
+	return info->product_string;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		struct enumeration_arena *arena = device_info_arena(d);
+		if (arena) {
+			/* The record and its strings go with the arena. */
+			if (--arena->records == 0)
+				enumeration_arena_free(arena);
+		}
+		else {
+			free(d->path);
+			free(d->serial_number);
+			free(d->manufacturer_string);
+			free(d->product_string);
+			free(d);
+		}
+		d = next;
+	}
+}
+
+/* A registered hotplug callback. */
+struct hid_hotplug_callback {
+	hid_hotplug_callback_handle handle;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	int events; /* 0 once deregistered, until it is freed */
+	hid_hotplug_callback_fn callback;
+	void *user_data;
+
+	struct hid_hotplug_callback *next;
+};
+
+/* State of hotplug monitoring. A thread watches a udev monitor for
+   hidraw devices coming and going, and keeps a list of the devices
+   which are currently attached. It is started with the first
+   registration of a callback, or with the enumeration cache, and runs
+   until hid_exit(). */
+static struct hid_hotplug_context {
+	/* Protects everything below. Recursive, so that callbacks can
+	   register and deregister callbacks. */
+	pthread_mutex_t mutex;
+
+	int thread_running;
+	pthread_t thread;
+	/* Written to by hid_exit() to stop the thread */
+	int wakeup_pipe[2];
+
+	struct udev *udev;
+	struct udev_monitor *monitor;
+
+	/* The currently attached devices */
+	struct hid_device_info *devs;
+	/* hid_enumerate() copies from devs, see hid_set_enumeration_cache() */
+	int cache_enabled;
+
+	struct hid_hotplug_callback *callbacks;
+	hid_hotplug_callback_handle next_handle;
+	/* Callbacks are being called. Deregistered ones are only freed
+	   when this drops to 0. */
+	int callbacks_in_use;
+	int callbacks_to_free;
+} hid_hotplug_context = {
+	.wakeup_pipe = { -1, -1 },
+	.next_handle = 1,
+};
+
+static pthread_once_t hid_hotplug_once = PTHREAD_ONCE_INIT;
+
+static void hid_hotplug_init_mutex(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&hid_hotplug_context.mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Free the callbacks which have been deregistered while callbacks were
+   being called.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_free_callbacks(void)
+{
+	struct hid_hotplug_callback **cur = &hid_hotplug_context.callbacks;
+
+	if (hid_hotplug_context.callbacks_in_use || !hid_hotplug_context.callbacks_to_free)
+		return;
+
+	while (*cur) {
+		struct hid_hotplug_callback *cb = *cur;
+		if (cb->events == 0) {
+			*cur = cb->next;
+			free(cb);
+		}
+		else {
+			cur = &cb->next;
+		}
+	}
+	hid_hotplug_context.callbacks_to_free = 0;
+}
+
+/* Call a callback if it is interested in the event and device. A
+   callback which returns non-zero is deregistered.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_call(struct hid_hotplug_callback *cb, struct hid_device_info *info, hid_hotplug_event event)
+{
+	struct hid_device_info *next;
+
+	if (!(cb->events & event) ||
+	    (cb->vendor_id != 0x0 && cb->vendor_id != info->vendor_id) ||
+	    (cb->product_id != 0x0 && cb->product_id != info->product_id))
+		return;
+
+	/* Hand out the device on its own. */
+	next = info->next;
+	info->next = NULL;
+
+	hid_hotplug_context.callbacks_in_use++;
+	if (cb->callback(cb->handle, info, event, cb->user_data)) {
+		cb->events = 0;
+		hid_hotplug_context.callbacks_to_free = 1;
+	}
+	hid_hotplug_context.callbacks_in_use--;
+
+	info->next = next;
+}
+
+/* Tell all callbacks about an event.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_notify(struct hid_device_info *info, hid_hotplug_event event)
+{
+	struct hid_hotplug_callback *cb;
+
+	hid_hotplug_context.callbacks_in_use++;
+	for (cb = hid_hotplug_context.callbacks; cb; cb = cb->next)
+		hid_hotplug_call(cb, info, event);
+	hid_hotplug_context.callbacks_in_use--;
+
+	hid_hotplug_free_callbacks();
+}
+
+/* A hidraw device is gone. Drop its records and tell the callbacks.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_device_left(const char *path)
+{
+	struct hid_device_info **cur = &hid_hotplug_context.devs;
+
+	while (*cur) {
+		struct hid_device_info *info = *cur;
+		if (info->path && strcmp(info->path, path) == 0) {
+			*cur = info->next;
+			info->next = NULL;
+			hid_hotplug_notify(info, HID_API_HOTPLUG_EVENT_DEVICE_LEFT);
+			hid_free_enumeration(info);
+		}
+		else {
+			cur = &info->next;
+		}
+	}
+}
+
+/* A hidraw device has been added. Record it and tell the callbacks.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_device_arrived(struct udev_device *raw_dev)
+{
+	struct hid_device_info *infos, *info, **tail;
+	struct hidraw_node node;
+
+	node.raw_dev = raw_dev;
+	infos = create_device_info_for_device(&node, &match_all_devices, 1, NULL);
+	if (!infos)
+		return;
+
+	/* A device which is added while hid_hotplug_start() enumerates
+	   can be seen twice. Don't list it twice. */
+	for (tail = &hid_hotplug_context.devs; *tail; tail = &(*tail)->next) {
+		if ((*tail)->path && infos->path && strcmp((*tail)->path, infos->path) == 0) {
+			hid_free_enumeration(infos);
+			return;
+		}
+	}
+	*tail = infos;
+
+	for (info = infos; info; info = info->next)
+		hid_hotplug_notify(info, HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED);
+}
+
+static void *hid_hotplug_thread(void *param)
+{
+	struct pollfd fds[2];
+
+	(void)param;
+
+	fds[0].fd = udev_monitor_get_fd(hid_hotplug_context.monitor);
+	fds[0].events = POLLIN;
+	fds[1].fd = hid_hotplug_context.wakeup_pipe[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		struct udev_device *raw_dev;
+		const char *action;
+
+		fds[0].revents = 0;
+		fds[1].revents = 0;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* hid_exit() asks us to stop. */
+		if (fds[1].revents)
+			break;
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		raw_dev = udev_monitor_receive_device(hid_hotplug_context.monitor);
+		if (!raw_dev)
+			continue;
+
+		action = udev_device_get_action(raw_dev);
+		pthread_mutex_lock(&hid_hotplug_context.mutex);
+		if (action && strcmp(action, "add") == 0) {
+			hid_hotplug_device_arrived(raw_dev);
+		}
+		else if (action && strcmp(action, "remove") == 0) {
+			const char *path = udev_device_get_devnode(raw_dev);
+			if (path)
+				hid_hotplug_device_left(path);
+		}
+		pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+		udev_device_unref(raw_dev);
+	}
+
+	/* Errors of this thread are of no interest to anyone. */
+	free_error(&last_global_error);
+
+	return NULL;
+}
+
+/* Release what hid_hotplug_start() set up, apart from the thread.
+   This should be called with hid_hotplug_context.mutex locked. */
+static void hid_hotplug_cleanup(void)
+{
+	int i;
+
+	hid_free_enumeration(hid_hotplug_context.devs);
+	hid_hotplug_context.devs = NULL;
+
+	if (hid_hotplug_context.monitor)
+		udev_monitor_unref(hid_hotplug_context.monitor);
+	hid_hotplug_context.monitor = NULL;
+	if (hid_hotplug_context.udev)
+		udev_unref(hid_hotplug_context.udev);
+	hid_hotplug_context.udev = NULL;
+
+	for (i = 0; i < 2; i++) {
+		if (hid_hotplug_context.wakeup_pipe[i] >= 0)
+			close(hid_hotplug_context.wakeup_pipe[i]);
+		hid_hotplug_context.wakeup_pipe[i] = -1;
+	}
+}
+
+/* Start watching for devices.
+   This should be called with hid_hotplug_context.mutex locked.
+   Returns 0 on success and -1 on failure. */
+static int hid_hotplug_start(void)
+{
+	hid_hotplug_context.udev = udev_new();
+	if (!hid_hotplug_context.udev) {
+		register_global_error("Couldn't create udev context", 0);
+		goto error;
+	}
+
+	hid_hotplug_context.monitor = udev_monitor_new_from_netlink(hid_hotplug_context.udev, "udev");
+	if (!hid_hotplug_context.monitor ||
+	    udev_monitor_filter_add_match_subsystem_devtype(hid_hotplug_context.monitor, "hidraw", NULL) < 0 ||
+	    udev_monitor_enable_receiving(hid_hotplug_context.monitor) < 0) {
+		register_global_error("Couldn't create udev monitor", 0);
+		goto error;
+	}
+
+	if (pipe(hid_hotplug_context.wakeup_pipe) < 0) {
+		register_global_error("pipe", errno);
+		goto error;
+	}
+	fcntl(hid_hotplug_context.wakeup_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(hid_hotplug_context.wakeup_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	/* The monitor is receiving already, so no device can be missed
+	   between enumerating and starting the thread. */
+	hid_hotplug_context.devs = hid_enumerate(0x0, 0x0);
+
+	if (pthread_create(&hid_hotplug_context.thread, NULL, hid_hotplug_thread, NULL) != 0) {
+		register_global_error("pthread_create", errno);
+		goto error;
+	}
+	hid_hotplug_context.thread_running = 1;
+
+	return 0;
+
+error:
+	hid_hotplug_cleanup();
+	return -1;
+}
+
+/* Stop watching for devices and drop all callbacks. Called by
+   hid_exit(). */
+static void hid_hotplug_exit(void)
+{
+	int thread_running;
+
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+	thread_running = hid_hotplug_context.thread_running;
+	if (thread_running) {
+		char c = 0;
+		if (write(hid_hotplug_context.wakeup_pipe[1], &c, 1) < 0)
+			register_global_error("write", errno);
+	}
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	/* The thread may be waiting for the mutex to handle an event. */
+	if (thread_running)
+		pthread_join(hid_hotplug_context.thread, NULL);
+
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+	hid_hotplug_context.thread_running = 0;
+	hid_hotplug_context.cache_enabled = 0;
+	hid_hotplug_cleanup();
+	while (hid_hotplug_context.callbacks) {
+		struct hid_hotplug_callback *cb = hid_hotplug_context.callbacks;
+		hid_hotplug_context.callbacks = cb->next;
+		free(cb);
+	}
+	hid_hotplug_context.callbacks_to_free = 0;
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+}
+
+static struct hid_device_info *copy_device_info(const struct hid_device_info *info, struct enumeration_arena *arena)
+{
+	struct hid_device_info *copy;
+
+	copy = new_device_info(arena);
+	if (!copy)
+		return NULL;
+
+	*copy = *info;
+	copy->path = enumeration_strdup(arena, info->path);
+	copy->serial_number = enumeration_wcsdup(arena, info->serial_number);
+	copy->manufacturer_string = enumeration_wcsdup(arena, info->manufacturer_string);
+	copy->product_string = enumeration_wcsdup(arena, info->product_string);
+	copy->next = NULL;
+
+	return copy;
+}
+
+/* Copy the records of the attached devices which match the filter, if
+   the enumeration cache is enabled. The records don't tell which bus a
+   device is on, so a filter with a bus type always needs a scan.
+   Returns 1 if *devs has been set from the cache, and 0 if the system
+   has to be scanned. */
+static int hid_hotplug_enumerate_cached(const struct hid_enumerate_filter *filter, struct hid_device_info **devs)
+{
+	const struct hid_device_info *info;
+	struct hid_device_info **tail = devs;
+	struct enumeration_arena *arena = NULL;
+	int cached;
+
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+
+	cached = hid_hotplug_context.cache_enabled && filter->bus_type == HID_API_BUS_ANY;
+	if (cached) {
+		*devs = NULL;
+		for (info = hid_hotplug_context.devs; info; info = info->next) {
+			if (!device_info_matches(filter, info))
+				continue;
+
+			if (!arena)
+				arena = enumeration_arena_new();
+			*tail = copy_device_info(info, arena);
+			if (!*tail)
+				break;
+			tail = &(*tail)->next;
+		}
+		if (arena) {
+			if (arena->records)
+				enumeration_arena_seal(arena);
+			else
+				enumeration_arena_free(arena);
+		}
+	}
+
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	return cached;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_enumeration_cache(int enable)
+{
+	int res = 0;
+
+	/* Set global error to none */
+	register_global_error(NULL, 0);
+
+	hid_init();
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+
+	if (enable && !hid_hotplug_context.thread_running)
+		res = hid_hotplug_start();
+	if (res == 0)
+		hid_hotplug_context.cache_enabled = enable ? 1 : 0;
+
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	return res;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, int flags, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	struct hid_hotplug_callback *cb, **tail;
+
+	/* Set global error to none */
+	register_global_error(NULL, 0);
+
+	if (!callback || !events ||
+	    (events & ~(HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED | HID_API_HOTPLUG_EVENT_DEVICE_LEFT)) ||
+	    (flags & ~HID_API_HOTPLUG_ENUMERATE)) {
+		register_global_error("hid_hotplug_register_callback: invalid argument", 0);
+		return -1;
+	}
+
+	cb = (struct hid_hotplug_callback*) calloc(1, sizeof(struct hid_hotplug_callback));
+	if (!cb) {
+		register_global_error("hid_hotplug_register_callback", ENOMEM);
+		return -1;
+	}
+	cb->vendor_id = vendor_id;
+	cb->product_id = product_id;
+	cb->events = events;
+	cb->callback = callback;
+	cb->user_data = user_data;
+
+	hid_init();
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+
+	if (!hid_hotplug_context.thread_running && hid_hotplug_start() < 0) {
+		pthread_mutex_unlock(&hid_hotplug_context.mutex);
+		free(cb);
+		return -1;
+	}
+
+	/* Handles are positive, and reused only after wrapping around. */
+	cb->handle = hid_hotplug_context.next_handle++;
+	if (hid_hotplug_context.next_handle == INT_MAX)
+		hid_hotplug_context.next_handle = 1;
+
+	tail = &hid_hotplug_context.callbacks;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = cb;
+
+	if (callback_handle)
+		*callback_handle = cb->handle;
+
+	if (flags & HID_API_HOTPLUG_ENUMERATE) {
+		struct hid_device_info *info;
+
+		hid_hotplug_context.callbacks_in_use++;
+		for (info = hid_hotplug_context.devs; info; info = info->next)
+			hid_hotplug_call(cb, info, HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED);
+		hid_hotplug_context.callbacks_in_use--;
+		hid_hotplug_free_callbacks();
+	}
+
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	struct hid_hotplug_callback *cb;
+	int res = -1;
+
+	pthread_once(&hid_hotplug_once, hid_hotplug_init_mutex);
+	pthread_mutex_lock(&hid_hotplug_context.mutex);
+
+	for (cb = hid_hotplug_context.callbacks; cb; cb = cb->next) {
+		if (cb->handle == callback_handle && cb->events) {
+			/* Freed right away, unless callbacks are running. */
+			cb->events = 0;
+			hid_hotplug_context.callbacks_to_free = 1;
+			hid_hotplug_free_callbacks();
+			res = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&hid_hotplug_context.mutex);
+
+	return res;
+}
+
+/* Get the hidraw node of a HID device.
+   Returns a path to be freed, or NULL. */
+static char *find_hidraw_path(struct udev *udev, struct udev_device *hid_dev)
+{
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *entry;
+	char *path = NULL;
+
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate)
+		return NULL;
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_add_match_parent(enumerate, hid_dev);
+	udev_enumerate_scan_devices(enumerate);
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *raw_dev;
 		const char *dev_path;
-		const char *str;
-		struct udev_device *raw_dev; /* The device's hidraw udev node. */
-		struct udev_device *hid_dev; /* The device's HID udev node. */
-		struct udev_device *usb_dev; /* The device's USB udev node. */
-		struct udev_device *intf_dev; /* The device's interface (in the USB sense). */
+
+		raw_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+		if (!raw_dev)
+			continue;
+		dev_path = udev_device_get_devnode(raw_dev);
+		if (dev_path)
+			path = strdup(dev_path);
+		udev_device_unref(raw_dev);
+		if (path)
+			break;
+	}
+
+	udev_enumerate_unref(enumerate);
+
+	return path;
+}
+
+/* Find the hidraw node of the first device with the given VID/PID and,
+   unless it is NULL, serial number. Unlike hid_enumerate(), udev only
+   lists the HID devices with the right IDs, and no records are created
+   for them.
+   Returns a path to be freed, or NULL. */
+static char *find_device_path(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct udev *udev;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *entry;
+	char hid_id[32];
+	char *path = NULL;
+
+	udev = udev_new();
+	if (!udev) {
+		register_global_error("Couldn't create udev context", 0);
+		return NULL;
+	}
+
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate) {
+		udev_unref(udev);
+		register_global_error("Couldn't create udev enumeration", 0);
+		return NULL;
+	}
+
+	/* HID_ID is "bus:vendor:product", see parse_uevent_info(). udev
+	   matches property values as shell globs. */
+	snprintf(hid_id, sizeof(hid_id), "*:%08X:%08X", vendor_id, product_id);
+	udev_enumerate_add_match_subsystem(enumerate, "hid");
+	udev_enumerate_add_match_property(enumerate, "HID_ID", hid_id);
+	udev_enumerate_scan_devices(enumerate);
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *hid_dev;
 		unsigned short dev_vid;
 		unsigned short dev_pid;
 		char *serial_number_utf8 = NULL;
 		char *product_name_utf8 = NULL;
 		unsigned bus_type;
-		int result;
-		struct hidraw_report_descriptor report_desc;
-
-		/* Get the filename of the /sys entry for the device
-		   and create a udev_device object (dev) representing it */
-		sysfs_path = udev_list_entry_get_name(dev_list_entry);
-		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
-		dev_path = udev_device_get_devnode(raw_dev);
-
-		hid_dev = udev_device_get_parent_with_subsystem_devtype(
-			raw_dev,
-			"hid",
-			NULL);
+		int match;
 
-		if (!hid_dev) {
-			/* Unable to find parent hid device. */
-			goto next;
-		}
+		hid_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+		if (!hid_dev)
+			continue;
 
-		result = parse_uevent_info(
+		match = parse_uevent_info(
 			udev_device_get_sysattr_value(hid_dev, "uevent"),
 			&bus_type,
 			&dev_vid,
@@ -675,331 +3005,614 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 			&serial_number_utf8,
 			&product_name_utf8);
 
-		if (!result) {
-			/* parse_uevent_info() failed for at least one field. */
-			goto next;
+		/* The same checks as in create_device_info_for_device() */
+		match = match &&
+			(bus_type == BUS_BLUETOOTH || bus_type == BUS_I2C || bus_type == BUS_USB) &&
+			dev_vid == vendor_id && dev_pid == product_id;
+
+		if (match && serial_number) {
+			wchar_t *serial = utf8_to_wchar_t(serial_number_utf8);
+			match = serial && wcscmp(serial_number, serial) == 0;
+			free(serial);
+		}
+
+		if (match)
+			path = find_hidraw_path(udev, hid_dev);
+
+		free(serial_number_utf8);
+		free(product_name_utf8);
+		udev_device_unref(hid_dev);
+
+		if (path)
+			break;
+	}
+
+	udev_enumerate_unref(enumerate);
+	udev_unref(udev);
+
+	return path;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	/* Set global error to none */
+	register_global_error(NULL, 0);
+
+	struct hid_enumerate_filter filter;
+	struct hid_device_info *devs, *cur_dev;
+	char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	hid_init();
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	if (hid_hotplug_enumerate_cached(&filter, &devs)) {
+		/* The cached list is quicker to search than udev. */
+		for (cur_dev = devs; cur_dev; cur_dev = cur_dev->next) {
+			if (cur_dev->vendor_id == vendor_id &&
+			    cur_dev->product_id == product_id &&
+			    (!serial_number ||
+			     (cur_dev->serial_number && wcscmp(serial_number, cur_dev->serial_number) == 0))) {
+				path_to_open = cur_dev->path ? strdup(cur_dev->path) : NULL;
+				break;
+			}
+		}
+		hid_free_enumeration(devs);
+	}
+	else {
+		path_to_open = find_device_path(vendor_id, product_id, serial_number);
+	}
+
+	if (path_to_open) {
+		/* Open the device */
+		handle = hid_open_path(path_to_open);
+	} else {
+		register_global_error("No such device", 0);
+	}
+
+	free(path_to_open);
+
+	return handle;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	/* Set global error to none */
+	register_global_error(NULL, 0);
+
+	hid_device *dev = NULL;
+
+	hid_init();
+
+	dev = new_hid_device();
+
+	/* OPEN HERE. The handle is non-blocking so that hid_read_many()
+	   can drain all queued reports after a single poll(). Reads always
+	   poll() first, so blocking reads still block. */
+	dev->device_handle = open(path, O_RDWR | O_NONBLOCK);
+
+	/* If we have a good handle, return it. */
+	if (dev->device_handle >= 0) {
+		/* Set device error to none */
+		register_device_error(dev, NULL, 0);
+
+		/* Get the report descriptor */
+		int res, desc_size = 0;
+		struct hidraw_report_descriptor rpt_desc;
+
+		memset(&rpt_desc, 0x0, sizeof(rpt_desc));
+
+		/* Get Report Descriptor Size */
+		res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
+		if (res < 0)
+			register_device_error(dev, "ioctl (GRDESCSIZE)", errno);
+
+		/* Get Report Descriptor */
+		rpt_desc.size = desc_size;
+		res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
+		if (res < 0) {
+			register_device_error(dev, "ioctl (GRDESC)", errno);
+		} else {
+			/* Compile the layout of the reports, and prepare
+			   decoding them. */
+			dev->report_layout = create_report_layout(rpt_desc.value, rpt_desc.size);
+			if (dev->report_layout)
+				dev->input_decoders = create_report_decoders(dev->report_layout);
+
+			/* Determine if this device uses numbered reports. */
+			if (dev->report_layout)
+				dev->uses_numbered_reports = dev->report_layout->uses_numbered_reports;
+			else
+				dev->uses_numbered_reports =
+					uses_numbered_reports(rpt_desc.value,
+					                      rpt_desc.size);
+		}
+
+		return dev;
+	}
+	else {
+		/* Unable to open any devices. */
+		register_global_error(NULL, errno);
+		free_hid_device(dev);
+		return NULL;
+	}
+}
+
+
+static int queue_output_report(hid_device *dev, const unsigned char *data, size_t length);
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int bytes_written;
+	int output_queue;
+
+	pthread_mutex_lock(&dev->write_mutex);
+	output_queue = dev->output_queue;
+	pthread_mutex_unlock(&dev->write_mutex);
+
+	if (output_queue)
+		return queue_output_report(dev, data, length);
+
+	bytes_written = write(dev->device_handle, data, length);
+
+	register_device_error(dev, NULL, (bytes_written == -1)? errno: 0);
+
+	return bytes_written;
+}
+
+
+static void *write_thread(void *param)
+{
+	hid_device *dev = (hid_device*) param;
+
+	pthread_mutex_lock(&dev->write_mutex);
+	for (;;) {
+		struct pending_write *pending;
+		int queued;
+		int res, err;
+
+		while (!dev->write_queue && !dev->write_shutdown)
+			pthread_cond_wait(&dev->write_cond, &dev->write_mutex);
+		if (dev->write_shutdown)
+			break;
+
+		pending = dev->write_queue;
+		dev->write_queue = pending->next;
+		if (!dev->write_queue)
+			dev->write_queue_tail = &dev->write_queue;
+
+		/* Unlocked, so that the callback can queue the next report */
+		pthread_mutex_unlock(&dev->write_mutex);
+		res = write(dev->device_handle, pending->data, pending->length);
+		err = errno;
+		queued = !pending->callback;
+		if (!queued)
+			pending->callback(dev, res, pending->user_data);
+		free(pending);
+		pthread_mutex_lock(&dev->write_mutex);
+
+		if (queued) {
+			if (res < 0)
+				dev->output_queue_error = err;
+			if (--dev->num_queued_reports == 0)
+				pthread_cond_broadcast(&dev->write_drained_cond);
 		}
+		dev->num_pending_writes--;
+	}
+	pthread_mutex_unlock(&dev->write_mutex);
+
+	return NULL;
+}
+
+/* Start the writer thread, if it isn't running yet. Called with
+   write_mutex locked. Returns 0 or an errno value. */
+static int start_write_thread(hid_device *dev)
+{
+	int err;
+
+	if (dev->write_thread_running)
+		return 0;
+
+	err = pthread_create(&dev->write_thread, NULL, write_thread, dev);
+	if (err == 0)
+		dev->write_thread_running = 1;
+
+	return err;
+}
+
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	struct pending_write *pending;
+	int err;
+
+	if (!data || length == 0 || !callback) {
+		register_device_error(dev, "Invalid argument", 0);
+		return -1;
+	}
+
+	pending = (struct pending_write*) malloc(sizeof(*pending) + length);
+	if (!pending) {
+		register_device_error(dev, "malloc", ENOMEM);
+		return -1;
+	}
+	pending->next = NULL;
+	pending->callback = callback;
+	pending->user_data = user_data;
+	pending->length = length;
+	memcpy(pending->data, data, length);
+
+	pthread_mutex_lock(&dev->write_mutex);
+
+	if (dev->num_pending_writes >= MAX_PENDING_WRITES) {
+		pthread_mutex_unlock(&dev->write_mutex);
+		free(pending);
+		register_device_error(dev, "Too many writes in flight", 0);
+		return -1;
+	}
+
+	err = start_write_thread(dev);
+	if (err != 0) {
+		pthread_mutex_unlock(&dev->write_mutex);
+		free(pending);
+		register_device_error(dev, "pthread_create", err);
+		return -1;
+	}
+
+	*dev->write_queue_tail = pending;
+	dev->write_queue_tail = &pending->next;
+	dev->num_pending_writes++;
+	pthread_cond_signal(&dev->write_cond);
+
+	pthread_mutex_unlock(&dev->write_mutex);
+
+	return 0;
+}
 
-		/* Filter out unhandled devices right away */
-		switch (bus_type) {
-			case BUS_BLUETOOTH:
-			case BUS_I2C:
-			case BUS_USB:
-				break;
+/* Queue a report of hid_write() for the writer thread. It replaces an
+   unsent report with the same Report ID, so the queue holds at most one
+   report per Report ID. */
+static int queue_output_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	struct pending_write *pending, **link;
+	int err;
 
-			default:
-				goto next;
-		}
+	if (!data || length == 0) {
+		register_device_error(dev, "Invalid argument", 0);
+		return -1;
+	}
 
-		/* Check the VID/PID against the arguments */
-		if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-		    (product_id == 0x0 || product_id == dev_pid)) {
-			struct hid_device_info *tmp;
+	pending = (struct pending_write*) malloc(sizeof(*pending) + length);
+	if (!pending) {
+		register_device_error(dev, "malloc", ENOMEM);
+		return -1;
+	}
+	pending->next = NULL;
+	pending->callback = NULL;
+	pending->user_data = NULL;
+	pending->length = length;
+	memcpy(pending->data, data, length);
+
+	pthread_mutex_lock(&dev->write_mutex);
+
+	if (dev->output_queue_error) {
+		err = dev->output_queue_error;
+		dev->output_queue_error = 0;
+		pthread_mutex_unlock(&dev->write_mutex);
+		free(pending);
+		register_device_error(dev, "write (queued report)", err);
+		return -1;
+	}
 
-			/* VID/PID match. Create the record. */
-			tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-			if (cur_dev) {
-				cur_dev->next = tmp;
-			}
-			else {
-				root = tmp;
-			}
-			prev_dev = cur_dev;
-			cur_dev = tmp;
+	err = start_write_thread(dev);
+	if (err != 0) {
+		pthread_mutex_unlock(&dev->write_mutex);
+		free(pending);
+		register_device_error(dev, "pthread_create", err);
+		return -1;
+	}
 
-			/* Fill out the record */
-			cur_dev->next = NULL;
-			cur_dev->path = dev_path? strdup(dev_path): NULL;
+	for (link = &dev->write_queue; *link; link = &(*link)->next) {
+		struct pending_write *old = *link;
+
+		if (!old->callback && old->data[0] == data[0]) {
+			pending->next = old->next;
+			if (!pending->next)
+				dev->write_queue_tail = &pending->next;
+			*link = pending;
+			pthread_mutex_unlock(&dev->write_mutex);
+			free(old);
+			register_device_error(dev, NULL, 0);
+			return (int) length;
+		}
+	}
 
-			/* VID/PID */
-			cur_dev->vendor_id = dev_vid;
-			cur_dev->product_id = dev_pid;
+	*dev->write_queue_tail = pending;
+	dev->write_queue_tail = &pending->next;
+	dev->num_pending_writes++;
+	dev->num_queued_reports++;
+	pthread_cond_signal(&dev->write_cond);
 
-			/* Serial Number */
-			cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
+	pthread_mutex_unlock(&dev->write_mutex);
 
-			/* Release Number */
-			cur_dev->release_number = 0x0;
+	register_device_error(dev, NULL, 0);
+	return (int) length;
+}
 
-			/* Interface Number */
-			cur_dev->interface_number = -1;
+/* Wait for the writer thread to send the reports of the output queue,
+   for at most OUTPUT_QUEUE_DRAIN_TIMEOUT. Called with write_mutex
+   locked. Returns 0 when they are sent (or failed), and -1 on
+   timeout. */
+static int drain_output_queue(hid_device *dev)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += OUTPUT_QUEUE_DRAIN_TIMEOUT / 1000;
+	ts.tv_nsec += (OUTPUT_QUEUE_DRAIN_TIMEOUT % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
 
-			switch (bus_type) {
-				case BUS_USB:
-					/* The device pointed to by raw_dev contains information about
-					   the hidraw device. In order to get information about the
-					   USB device, get the parent device with the
-					   subsystem/devtype pair of "usb"/"usb_device". This will
-					   be several levels up the tree, but the function will find
-					   it. */
-					usb_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_device");
-
-					/* uhid USB devices
-					   Since this is a virtual hid interface, no USB information will
-					   be available. */
-					if (!usb_dev) {
-						/* Manufacturer and Product strings */
-						cur_dev->manufacturer_string = wcsdup(L"");
-						cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
-						break;
-					}
+	while (dev->num_queued_reports > 0) {
+		if (pthread_cond_timedwait(&dev->write_drained_cond, &dev->write_mutex, &ts) == ETIMEDOUT)
+			return -1;
+	}
 
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]);
-					cur_dev->product_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]);
-
-					/* Release Number */
-					str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
-					cur_dev->release_number = (str)? strtol(str, NULL, 16): 0x0;
-
-					/* Get a handle to the interface's udev node. */
-					intf_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_interface");
-					if (intf_dev) {
-						str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
-						cur_dev->interface_number = (str)? strtol(str, NULL, 16): -1;
-					}
+	return 0;
+}
 
-					break;
+int HID_API_EXPORT hid_set_output_queue(hid_device *dev, int enable)
+{
+	int res = 0;
 
-				case BUS_BLUETOOTH:
-				case BUS_I2C:
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = wcsdup(L"");
-					cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
+	pthread_mutex_lock(&dev->write_mutex);
+	if (enable) {
+		dev->output_queue = 1;
+	}
+	else if (dev->output_queue) {
+		/* hid_write() would overtake the queued reports otherwise.
+		   The queue stays on if they aren't sent in time. */
+		res = drain_output_queue(dev);
+		if (res == 0)
+			dev->output_queue = 0;
+	}
+	pthread_mutex_unlock(&dev->write_mutex);
 
-					break;
+	if (res < 0)
+		register_device_error(dev, "hid_set_output_queue: timed out sending the queued reports", 0);
 
-				default:
-					/* Unknown device type - this should never happen, as we
-					 * check for USB and Bluetooth devices above */
-					break;
-			}
+	return res;
+}
 
-			/* Usage Page and Usage */
-			result = get_hid_report_descriptor_from_sysfs(sysfs_path, &report_desc);
-			if (result >= 0) {
-				unsigned short page = 0, usage = 0;
-				unsigned int pos = 0;
-				/*
-				 * Parse the first usage and usage page
-				 * out of the report descriptor.
-				 */
-				if (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
+struct hid_device_group_ {
+	hid_device **devices;
+	size_t num_devices;
+	size_t capacity;
+};
 
-				/*
-				 * Parse any additional usage and usage pages
-				 * out of the report descriptor.
-				 */
-				while (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					/* Create new record for additional usage pairs */
-					tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-					cur_dev->next = tmp;
-					prev_dev = cur_dev;
-					cur_dev = tmp;
-
-					/* Update fields */
-					cur_dev->path = strdup(dev_path);
-					cur_dev->vendor_id = dev_vid;
-					cur_dev->product_id = dev_pid;
-					cur_dev->serial_number = prev_dev->serial_number? wcsdup(prev_dev->serial_number): NULL;
-					cur_dev->release_number = prev_dev->release_number;
-					cur_dev->interface_number = prev_dev->interface_number;
-					cur_dev->manufacturer_string = prev_dev->manufacturer_string? wcsdup(prev_dev->manufacturer_string): NULL;
-					cur_dev->product_string = prev_dev->product_string? wcsdup(prev_dev->product_string): NULL;
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
-			}
-		}
+hid_device_group HID_API_EXPORT *hid_group_create(void)
+{
+	return (hid_device_group*) calloc(1, sizeof(hid_device_group));
+}
 
-	next:
-		free(serial_number_utf8);
-		free(product_name_utf8);
-		udev_device_unref(raw_dev);
-		/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
-		   unref()d.  It will cause a double-free() error.  I'm not
-		   sure why.  */
-	}
-	/* Free the enumerator and udev objects. */
-	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
+void HID_API_EXPORT hid_group_free(hid_device_group *group)
+{
+	if (!group)
+		return;
 
-	return root;
+	free(group->devices);
+	free(group);
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+int HID_API_EXPORT hid_group_add(hid_device_group *group, hid_device *dev)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
+	size_t i;
+
+	if (!group || !dev)
+		return -1;
+
+	/* A device added twice would get the report twice */
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev)
+			return -1;
+	}
+
+	if (group->num_devices == group->capacity) {
+		size_t capacity = group->capacity? group->capacity * 2: 8;
+		hid_device **devices = (hid_device**) realloc(group->devices, capacity * sizeof(hid_device*));
+		if (!devices)
+			return -1;
+		group->devices = devices;
+		group->capacity = capacity;
 	}
+
+	group->devices[group->num_devices] = dev;
+	return (int) group->num_devices++;
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+int HID_API_EXPORT hid_group_remove(hid_device_group *group, hid_device *dev)
 {
-	/* Set global error to none */
-	register_global_error(NULL);
+	size_t i;
 
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	if (!group)
+		return -1;
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev) {
+			memmove(&group->devices[i], &group->devices[i + 1],
+				(group->num_devices - i - 1) * sizeof(hid_device*));
+			group->num_devices--;
+			return 0;
 		}
-		cur_dev = cur_dev->next;
 	}
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	} else {
-		register_global_error("No such device");
-	}
+	return -1;
+}
 
-	hid_free_enumeration(devs);
+/* A hid_group_write() in progress */
+struct group_write {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t writes_pending;
+};
 
-	return handle;
-}
+/* The write to one device of a group */
+struct group_write_member {
+	struct group_write *state;
+	int result;
+};
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+static void group_write_callback(hid_device *dev, int result, void *user_data)
 {
-	/* Set global error to none */
-	register_global_error(NULL);
+	struct group_write_member *member = (struct group_write_member*) user_data;
+	struct group_write *state = member->state;
 
-	hid_device *dev = NULL;
+	(void) dev;
 
-	hid_init();
+	pthread_mutex_lock(&state->mutex);
+	member->result = result;
+	if (--state->writes_pending == 0)
+		pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+}
 
-	dev = new_hid_device();
+int HID_API_EXPORT hid_group_write(hid_device_group *group, const unsigned char *data, size_t length, int *results)
+{
+	struct group_write state;
+	struct group_write_member *members;
+	int written = 0;
+	size_t i;
 
-	/* OPEN HERE */
-	dev->device_handle = open(path, O_RDWR);
+	if (!group || !data || length == 0)
+		return -1;
+	if (group->num_devices == 0)
+		return 0;
 
-	/* If we have a good handle, return it. */
-	if (dev->device_handle >= 0) {
-		/* Set device error to none */
-		register_device_error(dev, NULL);
+	members = (struct group_write_member*) calloc(group->num_devices, sizeof(struct group_write_member));
+	if (!members)
+		return -1;
 
-		/* Get the report descriptor */
-		int res, desc_size = 0;
-		struct hidraw_report_descriptor rpt_desc;
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	state.writes_pending = group->num_devices;
+
+	/* Submit all writes before waiting for any of them */
+	for (i = 0; i < group->num_devices; i++) {
+		members[i].state = &state;
+		members[i].result = -1;
+		if (hid_write_async(group->devices[i], data, length, group_write_callback, &members[i]) < 0) {
+			pthread_mutex_lock(&state.mutex);
+			state.writes_pending--;
+			pthread_mutex_unlock(&state.mutex);
+		}
+	}
 
-		memset(&rpt_desc, 0x0, sizeof(rpt_desc));
+	pthread_mutex_lock(&state.mutex);
+	while (state.writes_pending > 0)
+		pthread_cond_wait(&state.cond, &state.mutex);
+	pthread_mutex_unlock(&state.mutex);
 
-		/* Get Report Descriptor Size */
-		res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
-		if (res < 0)
-			register_device_error_format(dev, "ioctl (GRDESCSIZE): %s", strerror(errno));
+	for (i = 0; i < group->num_devices; i++) {
+		if (members[i].result >= 0)
+			written++;
+		if (results)
+			results[i] = members[i].result;
+	}
 
-		/* Get Report Descriptor */
-		rpt_desc.size = desc_size;
-		res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
-		if (res < 0) {
-			register_device_error_format(dev, "ioctl (GRDESC): %s", strerror(errno));
-		} else {
-			/* Determine if this device uses numbered reports. */
-			dev->uses_numbered_reports =
-				uses_numbered_reports(rpt_desc.value,
-				                      rpt_desc.size);
-		}
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.mutex);
+	free(members);
 
-		return dev;
+	return written;
+}
+
+/* Stop the writer thread after the report it is writing, and fail the
+   reports which are still queued. */
+static void stop_write_thread(hid_device *dev)
+{
+	struct pending_write *pending;
+
+	pthread_mutex_lock(&dev->write_mutex);
+	if (!dev->write_thread_running) {
+		pthread_mutex_unlock(&dev->write_mutex);
+		return;
 	}
-	else {
-		/* Unable to open any devices. */
-		register_global_error(strerror(errno));
-		free(dev);
-		return NULL;
+	dev->write_shutdown = 1;
+	pthread_cond_signal(&dev->write_cond);
+	pthread_mutex_unlock(&dev->write_mutex);
+
+	pthread_join(dev->write_thread, NULL);
+	dev->write_thread_running = 0;
+
+	/* The thread is gone, no need to lock any more */
+	while ((pending = dev->write_queue) != NULL) {
+		dev->write_queue = pending->next;
+		if (pending->callback)
+			pending->callback(dev, -1, pending->user_data);
+		free(pending);
 	}
+	dev->write_queue_tail = &dev->write_queue;
+	dev->num_pending_writes = 0;
+	dev->num_queued_reports = 0;
 }
 
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+/* Wait for the device to become readable. Returns 1 when there is data
+   to read, 0 on timeout and -1 on error. */
+static int wait_readable(hid_device *dev, int milliseconds)
 {
-	int bytes_written;
-
-	bytes_written = write(dev->device_handle, data, length);
-
-	register_device_error(dev, (bytes_written == -1)? strerror(errno): NULL);
+	/* Always call poll() and wait for data to arrive, even though the
+	   handle is non-blocking, since some kernels don't seem to properly
+	   report device disconnection through read() when in non-blocking
+	   mode. */
+	int ret;
+	struct pollfd fds;
+
+	fds.fd = dev->device_handle;
+	fds.events = POLLIN;
+	fds.revents = 0;
+	ret = poll(&fds, 1, milliseconds);
+	if (ret == 0) {
+		/* Timeout */
+		return ret;
+	}
+	if (ret == -1) {
+		/* Error */
+		register_device_error(dev, NULL, errno);
+		return ret;
+	}
+	else {
+		/* Check for errors on the file descriptor. This will
+		   indicate a device disconnection. */
+		if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
+			// We cannot use strerror() here as no -1 was returned from poll().
+			return -1;
+	}
 
-	return bytes_written;
+	return 1;
 }
 
-
 int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
 {
 	/* Set device error to none */
-	register_device_error(dev, NULL);
+	register_device_error(dev, NULL, 0);
 
 	int bytes_read;
+	int ret;
 
-	if (milliseconds >= 0) {
-		/* Milliseconds is either 0 (non-blocking) or > 0 (contains
-		   a valid timeout). In both cases we want to call poll()
-		   and wait for data to arrive.  Don't rely on non-blocking
-		   operation (O_NONBLOCK) since some kernels don't seem to
-		   properly report device disconnection through read() when
-		   in non-blocking mode.  */
-		int ret;
-		struct pollfd fds;
-
-		fds.fd = dev->device_handle;
-		fds.events = POLLIN;
-		fds.revents = 0;
-		ret = poll(&fds, 1, milliseconds);
-		if (ret == 0) {
-			/* Timeout */
-			return ret;
-		}
-		if (ret == -1) {
-			/* Error */
-			register_device_error(dev, strerror(errno));
-			return ret;
-		}
-		else {
-			/* Check for errors on the file descriptor. This will
-			   indicate a device disconnection. */
-			if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
-				// We cannot use strerror() here as no -1 was returned from poll().
-				return -1;
-		}
-	}
+	ret = wait_readable(dev, milliseconds);
+	if (ret <= 0)
+		return ret;
 
 	bytes_read = read(dev->device_handle, data, length);
 	if (bytes_read < 0) {
 		if (errno == EAGAIN || errno == EINPROGRESS)
 			bytes_read = 0;
 		else
-			register_device_error(dev, strerror(errno));
+			register_device_error(dev, NULL, errno);
 	}
 
 	return bytes_read;
@@ -1010,6 +3623,105 @@ int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
 }
 
+int HID_API_EXPORT hid_read_many(hid_device *dev, unsigned char *data, size_t report_stride, size_t max_reports, int milliseconds, size_t *lengths)
+{
+	/* Set device error to none */
+	register_device_error(dev, NULL, 0);
+
+	size_t num_reports = 0;
+	int ret;
+
+	if (max_reports == 0)
+		return 0;
+
+	ret = wait_readable(dev, milliseconds);
+	if (ret <= 0)
+		return ret;
+
+	/* hidraw returns one report per read(). Keep reading until the
+	   kernel's queue is empty. */
+	while (num_reports < max_reports) {
+		ssize_t bytes_read = read(dev->device_handle,
+		                          data + num_reports * report_stride,
+		                          report_stride);
+		if (bytes_read < 0) {
+			if (errno == EAGAIN || errno == EINPROGRESS)
+				break;
+			register_device_error(dev, NULL, errno);
+			/* Hand out what has been read so far. The error will
+			   show up again on the next call. */
+			if (num_reports == 0)
+				return -1;
+			break;
+		}
+		lengths[num_reports++] = bytes_read;
+	}
+
+	return num_reports;
+}
+
+/* The hidraw handle itself can be polled for Input reports, and reports
+   are read from it directly. */
+int HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *dev)
+{
+	return dev->device_handle;
+}
+
+/* Number of devices hid_wait_any() handles without allocating. */
+#define WAIT_ANY_STACK_FDS 32
+
+int HID_API_EXPORT HID_API_CALL hid_wait_any(hid_device **devs, size_t num_devs, int milliseconds, int *ready)
+{
+	struct pollfd stack_fds[WAIT_ANY_STACK_FDS];
+	struct pollfd *fds = stack_fds;
+	size_t i;
+	int ret;
+
+	if (!devs || !ready) {
+		register_global_error("hid_wait_any", EINVAL);
+		return -1;
+	}
+
+	if (num_devs > WAIT_ANY_STACK_FDS) {
+		fds = (struct pollfd*) calloc(num_devs, sizeof(struct pollfd));
+		if (!fds) {
+			register_global_error("hid_wait_any", ENOMEM);
+			return -1;
+		}
+	}
+
+	/* A single poll() over all devices. This avoids setting up an
+	   epoll instance for every call. */
+	for (i = 0; i < num_devs; i++) {
+		fds[i].fd = devs[i]->device_handle;
+		/* poll() would skip the device, and never report it */
+		if (fds[i].fd < 0) {
+			register_global_error("hid_wait_any: device has no file descriptor", 0);
+			ret = -1;
+			goto end;
+		}
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+
+	ret = poll(fds, num_devs, milliseconds);
+	if (ret < 0) {
+		register_global_error(NULL, errno);
+	}
+	else {
+		/* Errors on a file descriptor count as ready too, so the
+		   disconnection is reported by the next read. */
+		for (i = 0; i < num_devs; i++)
+			ready[i] = (fds[i].revents != 0);
+	}
+
+end:
+	if (fds != stack_fds)
+		free(fds);
+
+	return ret;
+}
+
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	/* Do all non-blocking in userspace using poll(), since it looks
@@ -1020,6 +3732,44 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	return 0; /* Success */
 }
 
+/* The input report queue of hidraw lives in the kernel and has a fixed
+   size. */
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_size(hid_device *dev, size_t size)
+{
+	(void)size;
+	register_device_error(dev, "hid_set_input_queue_size: not supported by hidraw", 0);
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_policy(hid_device *dev, hid_input_queue_policy policy)
+{
+	(void)policy;
+	register_device_error(dev, "hid_set_input_queue_policy: not supported by hidraw", 0);
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_dropped_input_reports(hid_device *dev, unsigned long *count)
+{
+	(void)count;
+	register_device_error(dev, "hid_get_dropped_input_reports: not supported by hidraw", 0);
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_timeout(hid_device *dev, hid_timeout_type type, int milliseconds)
+{
+	(void)type;
+	(void)milliseconds;
+	register_device_error(dev, "hid_set_timeout: not supported by hidraw", 0);
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_transfer_count(hid_device *dev, int count)
+{
+	(void)count;
+	register_device_error(dev, "hid_set_input_transfer_count: not supported by hidraw", 0);
+	return -1;
+}
+
 
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
@@ -1027,7 +3777,7 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 
 	res = ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
 	if (res < 0)
-		register_device_error_format(dev, "ioctl (SFEATURE): %s", strerror(errno));
+		register_device_error(dev, "ioctl (SFEATURE)", errno);
 
 	return res;
 }
@@ -1038,18 +3788,26 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 	res = ioctl(dev->device_handle, HIDIOCGFEATURE(length), data);
 	if (res < 0)
-		register_device_error_format(dev, "ioctl (GFEATURE): %s", strerror(errno));
+		register_device_error(dev, "ioctl (GFEATURE)", errno);
 
 	return res;
 }
 
-// Not supported by Linux HidRaw yet
 int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned char *data, size_t length)
 {
-	(void)dev;
-	(void)data;
-	(void)length;
-	return -1;
+	int res;
+
+	res = ioctl(dev->device_handle, HIDIOCGINPUT(length), data);
+	if (res < 0) {
+		/* Kernels before 5.11 don't know the ioctl. Failing it is
+		   as cheap as remembering that, so it isn't cached. */
+		if (errno == ENOTTY)
+			register_device_error(dev, "ioctl (GINPUT): needs Linux 5.11 or newer", 0);
+		else
+			register_device_error(dev, "ioctl (GINPUT)", errno);
+	}
+
+	return res;
 }
 
 void HID_API_EXPORT hid_close(hid_device *dev)
@@ -1057,14 +3815,25 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
+	/* hid_write() has reported the queued reports as written, so send
+	   them before stopping the writer thread. */
+	pthread_mutex_lock(&dev->write_mutex);
+	drain_output_queue(dev);
+	pthread_mutex_unlock(&dev->write_mutex);
+
+	stop_write_thread(dev);
+
 	int ret = close(dev->device_handle);
 
-	register_global_error((ret == -1)? strerror(errno): NULL);
+	register_global_error(NULL, (ret == -1)? errno: 0);
 
 	/* Free the device error message */
-	register_device_error(dev, NULL);
+	free_error(&dev->last_error);
 
-	free(dev);
+	free_report_decoders(dev->input_decoders);
+	free(dev->report_layout);
+
+	free_hid_device(dev);
 }
 
 
@@ -1093,16 +3862,73 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+HID_API_EXPORT const struct hid_report_layout * HID_API_CALL hid_get_report_layout(hid_device *dev)
+{
+	return dev->report_layout;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_decode_report(hid_device *dev, const unsigned char *data, size_t length, int *values, size_t max_values)
+{
+	const struct report_decoder *decoder;
+	size_t i;
+
+	/* Set device error to none */
+	register_device_error(dev, NULL, 0);
+
+	if (!dev->input_decoders) {
+		register_device_error(dev, "hid_decode_report: the report layout is not available", 0);
+		return -1;
+	}
+
+	if (dev->uses_numbered_reports)
+		decoder = (length > 0)? dev->input_decoders[data[0]]: NULL;
+	else
+		decoder = dev->input_decoders[0];
+	if (!decoder) {
+		register_device_error(dev, "hid_decode_report: unknown Input report", 0);
+		return -1;
+	}
+
+	if (length < decoder->report_size || max_values < decoder->num_values) {
+		/* A short report or not enough room for all values. Decode
+		   what fits, with bounds checks. */
+		size_t num_values = (max_values < decoder->num_values)? max_values: decoder->num_values;
+		decode_scalar(decoder, 0, num_values, data, length, values);
+		return (int) num_values;
+	}
+
+	for (i = 0; i < decoder->num_runs; i++) {
+		const struct decode_run *run = &decoder->runs[i];
+
+		switch (run->kind) {
+#ifdef HAVE_SSE2_DECODE
+		case DECODE_RUN_BYTES:
+			decode_bytes_sse2(decoder, run->first, run->count, data, values);
+			break;
+#endif
+#ifdef HAVE_AVX2_DECODE
+		case DECODE_RUN_GATHER:
+			if (decoder->use_avx2)
+				decode_gather_avx2(decoder, run->first, run->count, data, values);
+			else
+				decode_scalar(decoder, run->first, run->count, data, length, values);
+			break;
+#endif
+		default:
+			decode_scalar(decoder, run->first, run->count, data, length, values);
+			break;
+		}
+	}
+
+	return (int) decoder->num_values;
+}
+
+
 /* Passing in NULL means asking for the last global error message. */
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
-	if (dev) {
-		if (dev->last_error_str == NULL)
-			return L"Success";
-		return dev->last_error_str;
-	}
+	if (dev)
+		return get_error_str(&dev->last_error);
 
-	if (last_global_error_str == NULL)
-		return L"Success";
-	return last_global_error_str;
+	return get_error_str(&last_global_error);
 }
@@ -126,6 +126,7 @@ struct hid_device_ {
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	pthread_barrier_t shutdown_barrier; /* Ensures correct shutdown sequence */
 	int shutdown_thread;
+	const wchar_t *last_error_str;
 };
 
 static hid_device *new_hid_device(void)
@@ -141,6 +142,7 @@ static hid_device *new_hid_device(void)
 	dev->input_report_buf = NULL;
 	dev->input_reports = NULL;
 	dev->shutdown_thread = 0;
+	dev->last_error_str = NULL;
 
 	/* Thread objects */
 	pthread_mutex_init(&dev->mutex, NULL);
@@ -201,6 +203,20 @@ static void register_error(hid_device *dev, const char *op)
 }
 #endif
 
+/* Only the functions this backend doesn't support register errors, so the
+   messages are string constants. */
+static const wchar_t *last_global_error_str = NULL;
+
+static void register_global_error(const wchar_t *msg)
+{
+	last_global_error_str = msg;
+}
+
+static void register_device_error(hid_device *dev, const wchar_t *msg)
+{
+	dev->last_error_str = msg;
+}
+
 static CFArrayRef get_array_property(IOHIDDeviceRef device, CFStringRef key)
 {
 	CFTypeRef ref = IOHIDDeviceGetProperty(device, key);
@@ -625,6 +641,60 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	return root;
 }
 
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_lazy(unsigned short vendor_id, unsigned short product_id)
+{
+	/* Not supported by this backend: the strings are read along with
+	   everything else, so the list is returned complete. */
+	return hid_enumerate(vendor_id, product_id);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_ex(const struct hid_enumerate_filter *filter)
+{
+	struct hid_device_info *root, **link;
+
+	if (!filter)
+		return hid_enumerate(0x0, 0x0);
+
+	/* The bus type of a device isn't known. */
+	if (filter->bus_type != HID_API_BUS_ANY)
+		return NULL;
+
+	/* This backend filters the enumerated list afterwards. */
+	root = hid_enumerate(filter->vendor_id, filter->product_id);
+	link = &root;
+	while (*link) {
+		struct hid_device_info *info = *link;
+		if ((filter->usage_page == 0x0 || filter->usage_page == info->usage_page) &&
+		    (filter->usage == 0x0 || filter->usage == info->usage) &&
+		    (!(filter->flags & HID_API_ENUMERATE_MATCH_INTERFACE) || filter->interface_number == info->interface_number) &&
+		    (!filter->serial_number_prefix ||
+		     wcsncmp(info->serial_number ? info->serial_number : L"", filter->serial_number_prefix, wcslen(filter->serial_number_prefix)) == 0)) {
+			link = &info->next;
+			continue;
+		}
+		*link = info->next;
+		info->next = NULL;
+		hid_free_enumeration(info);
+	}
+
+	return root;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_serial_number(struct hid_device_info *info)
+{
+	return info->serial_number;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_manufacturer_string(struct hid_device_info *info)
+{
+	return info->manufacturer_string;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_product_string(struct hid_device_info *info)
+{
+	return info->product_string;
+}
+
 void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 {
 	/* This function is identical to the Linux version. Platform independent. */
@@ -640,6 +710,40 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 	}
 }
 
+int HID_API_EXPORT HID_API_CALL hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, int flags, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	(void) vendor_id;
+	(void) product_id;
+	(void) events;
+	(void) flags;
+	(void) callback;
+	(void) user_data;
+	(void) callback_handle;
+
+	/* Not supported by this backend. */
+	register_global_error(L"hid_hotplug_register_callback: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	(void) callback_handle;
+
+	/* Not supported by this backend. */
+	register_global_error(L"hid_hotplug_deregister_callback: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_enumeration_cache(int enable)
+{
+	(void) enable;
+
+	/* Not supported by this backend: the cache is kept up to date by the
+	   hotplug notifications. */
+	register_global_error(L"hid_set_enumeration_cache: not supported by this backend");
+	return -1;
+}
+
 hid_device * HID_API_EXPORT hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	/* This function is identical to the Linux version. Platform independent. */
@@ -963,6 +1067,115 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	return set_report(dev, kIOHIDReportTypeOutput, data, length);
 }
 
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	(void) data;
+	(void) length;
+	(void) callback;
+	(void) user_data;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_write_async: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_output_queue(hid_device *dev, int enable)
+{
+	(void) enable;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_set_output_queue: not supported by this backend");
+	return -1;
+}
+
+struct hid_device_group_ {
+	hid_device **devices;
+	size_t num_devices;
+	size_t capacity;
+};
+
+hid_device_group HID_API_EXPORT *hid_group_create(void)
+{
+	return (hid_device_group*) calloc(1, sizeof(hid_device_group));
+}
+
+void HID_API_EXPORT hid_group_free(hid_device_group *group)
+{
+	if (!group)
+		return;
+
+	free(group->devices);
+	free(group);
+}
+
+int HID_API_EXPORT hid_group_add(hid_device_group *group, hid_device *dev)
+{
+	size_t i;
+
+	if (!group || !dev)
+		return -1;
+
+	/* A device added twice would get the report twice */
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev)
+			return -1;
+	}
+
+	if (group->num_devices == group->capacity) {
+		size_t capacity = group->capacity? group->capacity * 2: 8;
+		hid_device **devices = (hid_device**) realloc(group->devices, capacity * sizeof(hid_device*));
+		if (!devices)
+			return -1;
+		group->devices = devices;
+		group->capacity = capacity;
+	}
+
+	group->devices[group->num_devices] = dev;
+	return (int) group->num_devices++;
+}
+
+int HID_API_EXPORT hid_group_remove(hid_device_group *group, hid_device *dev)
+{
+	size_t i;
+
+	if (!group)
+		return -1;
+
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev) {
+			memmove(&group->devices[i], &group->devices[i + 1],
+				(group->num_devices - i - 1) * sizeof(hid_device*));
+			group->num_devices--;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int HID_API_EXPORT hid_group_write(hid_device_group *group, const unsigned char *data, size_t length, int *results)
+{
+	int written = 0;
+	size_t i;
+
+	if (!group || !data || length == 0)
+		return -1;
+	if (group->num_devices == 0)
+		return 0;
+
+	/* Not supported by this backend: writing to all devices at the
+	   same time. */
+	for (i = 0; i < group->num_devices; i++) {
+		int res = hid_write(group->devices[i], data, length);
+		if (res >= 0)
+			written++;
+		if (results)
+			results[i] = res;
+	}
+
+	return written;
+}
+
 /* Helper function, so that this isn't duplicated in hid_read(). */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
@@ -1097,6 +1310,44 @@ int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
 }
 
+int HID_API_EXPORT hid_read_many(hid_device *dev, unsigned char *data, size_t report_stride, size_t max_reports, int milliseconds, size_t *lengths)
+{
+	size_t num_reports = 0;
+
+	/* Wait for the first report, then take whatever else is already
+	   available without waiting. */
+	while (num_reports < max_reports) {
+		int res = hid_read_timeout(dev, data + num_reports * report_stride, report_stride, (num_reports == 0)? milliseconds: 0);
+		if (res < 0)
+			return (num_reports == 0)? -1: (int) num_reports;
+		if (res == 0)
+			break;
+		lengths[num_reports++] = res;
+	}
+
+	return num_reports;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *dev)
+{
+	/* Not supported by this backend: input reports arrive on the read
+	   thread's run loop, there is no file descriptor to hand out. */
+	register_device_error(dev, L"hid_get_pollable_fd: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_wait_any(hid_device **devs, size_t num_devs, int milliseconds, int *ready)
+{
+	(void) devs;
+	(void) num_devs;
+	(void) milliseconds;
+	(void) ready;
+
+	/* Not supported by this backend. */
+	register_global_error(L"hid_wait_any: not supported by this backend");
+	return -1;
+}
+
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	/* All Nonblocking operation is handled by the library. */
@@ -1105,6 +1356,52 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	return 0;
 }
 
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_size(hid_device *dev, size_t size)
+{
+	(void) size;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_set_input_queue_size: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_policy(hid_device *dev, hid_input_queue_policy policy)
+{
+	(void) policy;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_set_input_queue_policy: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_dropped_input_reports(hid_device *dev, unsigned long *count)
+{
+	(void) count;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_get_dropped_input_reports: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_timeout(hid_device *dev, hid_timeout_type type, int milliseconds)
+{
+	(void) type;
+	(void) milliseconds;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_set_timeout: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_transfer_count(hid_device *dev, int count)
+{
+	(void) count;
+
+	/* Not supported by this backend: IOHIDManager does the transfers. */
+	register_device_error(dev, L"hid_set_input_transfer_count: not supported by this backend");
+	return -1;
+}
+
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	return set_report(dev, kIOHIDReportTypeFeature, data, length);
@@ -1202,11 +1499,34 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+HID_API_EXPORT const struct hid_report_layout * HID_API_CALL hid_get_report_layout(hid_device *dev)
+{
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_get_report_layout: not supported by this backend");
+	return NULL;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_decode_report(hid_device *dev, const unsigned char *data, size_t length, int *values, size_t max_values)
+{
+	(void) data;
+	(void) length;
+	(void) values;
+	(void) max_values;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_decode_report: not supported by this backend");
+	return -1;
+}
+
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
-	(void) dev;
-	/* TODO: */
+	if (dev && dev->last_error_str)
+		return dev->last_error_str;
+	if (!dev && last_global_error_str)
+		return last_global_error_str;
 
+	/* The errors of the supported functions aren't recorded. */
 	return L"hid_error is not implemented yet";
 }
 
@@ -154,6 +154,7 @@ struct hid_device_ {
 		char *read_buf;
 		OVERLAPPED ol;
 		OVERLAPPED write_ol;			  
+		DWORD write_timeout; /* milliseconds, see hid_set_timeout() */
 };
 
 static hid_device *new_hid_device()
@@ -170,6 +171,7 @@ static hid_device *new_hid_device()
 	dev->last_error_num = 0;
 	dev->read_pending = FALSE;
 	dev->read_buf = NULL;
+	dev->write_timeout = 1000;
 	memset(&dev->ol, 0, sizeof(dev->ol));
 	dev->ol.hEvent = CreateEvent(NULL, FALSE, FALSE /*initial state f=nonsignaled*/, NULL);
 	memset(&dev->write_ol, 0, sizeof(dev->write_ol));
@@ -220,6 +222,28 @@ static void register_error(hid_device *dev, const char *op)
 	dev->last_error_str = msg;
 }
 
+/* Global errors are only registered by the functions this backend doesn't
+   support, so they are string constants. */
+static const wchar_t *last_global_error_str = NULL;
+
+static void register_global_error(const wchar_t *msg)
+{
+	last_global_error_str = msg;
+}
+
+/* Like register_error(), for errors that don't come from the system. */
+static void register_device_error(hid_device *dev, const wchar_t *msg)
+{
+	size_t size = (wcslen(msg) + 1) * sizeof(wchar_t);
+	WCHAR *copy = (WCHAR*) LocalAlloc(LMEM_FIXED, size);
+
+	if (copy)
+		memcpy(copy, msg, size);
+
+	LocalFree(dev->last_error_str);
+	dev->last_error_str = copy;
+}
+
 #ifndef HIDAPI_USE_DDK
 static int lookup_functions()
 {
@@ -530,6 +554,60 @@ cont:
 
 }
 
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_lazy(unsigned short vendor_id, unsigned short product_id)
+{
+	/* Not supported by this backend: the strings are read along with
+	   everything else, so the list is returned complete. */
+	return hid_enumerate(vendor_id, product_id);
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter)
+{
+	struct hid_device_info *root, **link;
+
+	if (!filter)
+		return hid_enumerate(0x0, 0x0);
+
+	/* The bus type of a device isn't known. */
+	if (filter->bus_type != HID_API_BUS_ANY)
+		return NULL;
+
+	/* This backend filters the enumerated list afterwards. */
+	root = hid_enumerate(filter->vendor_id, filter->product_id);
+	link = &root;
+	while (*link) {
+		struct hid_device_info *info = *link;
+		if ((filter->usage_page == 0x0 || filter->usage_page == info->usage_page) &&
+		    (filter->usage == 0x0 || filter->usage == info->usage) &&
+		    (!(filter->flags & HID_API_ENUMERATE_MATCH_INTERFACE) || filter->interface_number == info->interface_number) &&
+		    (!filter->serial_number_prefix ||
+		     wcsncmp(info->serial_number ? info->serial_number : L"", filter->serial_number_prefix, wcslen(filter->serial_number_prefix)) == 0)) {
+			link = &info->next;
+			continue;
+		}
+		*link = info->next;
+		info->next = NULL;
+		hid_free_enumeration(info);
+	}
+
+	return root;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_serial_number(struct hid_device_info *info)
+{
+	return info->serial_number;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_manufacturer_string(struct hid_device_info *info)
+{
+	return info->manufacturer_string;
+}
+
+const wchar_t HID_API_EXPORT * HID_API_CALL hid_device_info_get_product_string(struct hid_device_info *info)
+{
+	return info->product_string;
+}
+
 void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs)
 {
 	/* TODO: Merge this with the Linux version. This function is platform-independent. */
@@ -545,6 +623,40 @@ void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *d
 	}
 }
 
+int HID_API_EXPORT HID_API_CALL hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, int flags, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	(void)vendor_id;
+	(void)product_id;
+	(void)events;
+	(void)flags;
+	(void)callback;
+	(void)user_data;
+	(void)callback_handle;
+
+	/* Not supported by this backend. */
+	register_global_error(L"hid_hotplug_register_callback: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	(void)callback_handle;
+
+	/* Not supported by this backend. */
+	register_global_error(L"hid_hotplug_deregister_callback: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_enumeration_cache(int enable)
+{
+	(void)enable;
+
+	/* Not supported by this backend: the cache is kept up to date by the
+	   hotplug notifications. */
+	register_global_error(L"hid_set_enumeration_cache: not supported by this backend");
+	return -1;
+}
+
 
 HID_API_EXPORT hid_device * HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
@@ -691,7 +803,7 @@ int HID_API_EXPORT HID_API_CALL hid_write(hid_device *dev, const unsigned char *
 	if (overlapped) {
 		/* Wait for the transaction to complete. This makes
 		   hid_write() synchronous. */
-		res = WaitForSingleObject(dev->write_ol.hEvent, 1000);
+		res = WaitForSingleObject(dev->write_ol.hEvent, dev->write_timeout);
 		if (res != WAIT_OBJECT_0) {
 			/* There was a Timeout. */
 			register_error(dev, "WriteFile/WaitForSingleObject Timeout");
@@ -714,6 +826,115 @@ end_of_function:
 	return function_result;
 }
 
+int HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	(void) data;
+	(void) length;
+	(void) callback;
+	(void) user_data;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_write_async: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_output_queue(hid_device *dev, int enable)
+{
+	(void) enable;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_set_output_queue: not supported by this backend");
+	return -1;
+}
+
+struct hid_device_group_ {
+	hid_device **devices;
+	size_t num_devices;
+	size_t capacity;
+};
+
+hid_device_group HID_API_EXPORT * HID_API_CALL hid_group_create(void)
+{
+	return (hid_device_group*) calloc(1, sizeof(hid_device_group));
+}
+
+void HID_API_EXPORT HID_API_CALL hid_group_free(hid_device_group *group)
+{
+	if (!group)
+		return;
+
+	free(group->devices);
+	free(group);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_group_add(hid_device_group *group, hid_device *dev)
+{
+	size_t i;
+
+	if (!group || !dev)
+		return -1;
+
+	/* A device added twice would get the report twice */
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev)
+			return -1;
+	}
+
+	if (group->num_devices == group->capacity) {
+		size_t capacity = group->capacity? group->capacity * 2: 8;
+		hid_device **devices = (hid_device**) realloc(group->devices, capacity * sizeof(hid_device*));
+		if (!devices)
+			return -1;
+		group->devices = devices;
+		group->capacity = capacity;
+	}
+
+	group->devices[group->num_devices] = dev;
+	return (int) group->num_devices++;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_group_remove(hid_device_group *group, hid_device *dev)
+{
+	size_t i;
+
+	if (!group)
+		return -1;
+
+	for (i = 0; i < group->num_devices; i++) {
+		if (group->devices[i] == dev) {
+			memmove(&group->devices[i], &group->devices[i + 1],
+				(group->num_devices - i - 1) * sizeof(hid_device*));
+			group->num_devices--;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_group_write(hid_device_group *group, const unsigned char *data, size_t length, int *results)
+{
+	int written = 0;
+	size_t i;
+
+	if (!group || !data || length == 0)
+		return -1;
+	if (group->num_devices == 0)
+		return 0;
+
+	/* Not supported by this backend: writing to all devices at the
+	   same time. */
+	for (i = 0; i < group->num_devices; i++) {
+		int res = hid_write(group->devices[i], data, length);
+		if (res >= 0)
+			written++;
+		if (results)
+			results[i] = res;
+	}
+
+	return written;
+}
+
 
 int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
 {
@@ -797,12 +1018,118 @@ int HID_API_EXPORT HID_API_CALL hid_read(hid_device *dev, unsigned char *data, s
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
 }
 
+int HID_API_EXPORT HID_API_CALL hid_read_many(hid_device *dev, unsigned char *data, size_t report_stride, size_t max_reports, int milliseconds, size_t *lengths)
+{
+	size_t num_reports = 0;
+
+	/* Wait for the first report, then take whatever else is already
+	   available without waiting. */
+	while (num_reports < max_reports) {
+		int res = hid_read_timeout(dev, data + num_reports * report_stride, report_stride, (num_reports == 0)? milliseconds: 0);
+		if (res < 0)
+			return (num_reports == 0)? -1: (int) num_reports;
+		if (res == 0)
+			break;
+		lengths[num_reports++] = res;
+	}
+
+	return num_reports;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_pollable_fd(hid_device *dev)
+{
+	/* Not supported by this backend: Windows has no file descriptors.
+	   Reads complete through overlapped I/O on the device handle. */
+	register_device_error(dev, L"hid_get_pollable_fd: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_wait_any(hid_device **devs, size_t num_devs, int milliseconds, int *ready)
+{
+	(void)devs;
+	(void)num_devs;
+	(void)milliseconds;
+	(void)ready;
+
+	/* Not supported by this backend. */
+	register_global_error(L"hid_wait_any: not supported by this backend");
+	return -1;
+}
+
 int HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	dev->blocking = !nonblock;
 	return 0; /* Success */
 }
 
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_size(hid_device *dev, size_t size)
+{
+	BOOL res;
+
+	/* The HID class driver accepts between 2 and 512 buffers. */
+	if (size < 2 || size > 512) {
+		register_device_error(dev, L"hid_set_input_queue_size: the size must be between 2 and 512");
+		return -1;
+	}
+
+	res = HidD_SetNumInputBuffers(dev->device_handle, (ULONG) size);
+	if (!res) {
+		register_error(dev, "HidD_SetNumInputBuffers");
+		return -1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_queue_policy(hid_device *dev, hid_input_queue_policy policy)
+{
+	/* The HID class driver always drops the oldest report. */
+	if (policy != HID_INPUT_QUEUE_DROP_OLDEST) {
+		register_device_error(dev, L"hid_set_input_queue_policy: not supported by this backend");
+		return -1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_dropped_input_reports(hid_device *dev, unsigned long *count)
+{
+	(void)count;
+
+	/* Not supported by this backend: the HID class driver doesn't report
+	   them. */
+	register_device_error(dev, L"hid_get_dropped_input_reports: not supported by this backend");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_timeout(hid_device *dev, hid_timeout_type type, int milliseconds)
+{
+	if (milliseconds == 0 || milliseconds < -1) {
+		register_device_error(dev, L"hid_set_timeout: invalid timeout");
+		return -1;
+	}
+
+	/* Not supported by this backend: feature reports and reads wait for
+	   the HID class driver. */
+	if (type != HID_API_TIMEOUT_WRITE) {
+		register_device_error(dev, L"hid_set_timeout: not supported by this backend");
+		return -1;
+	}
+
+	dev->write_timeout = (milliseconds == -1)? INFINITE: (DWORD) milliseconds;
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_transfer_count(hid_device *dev, int count)
+{
+	(void)count;
+
+	/* Not supported by this backend: the HID class driver does the
+	   transfers. */
+	register_device_error(dev, L"hid_set_input_transfer_count: not supported by this backend");
+	return -1;
+}
+
 int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	BOOL res = FALSE;
@@ -995,6 +1322,26 @@ int HID_API_EXPORT_CALL HID_API_CALL hid_get_indexed_string(hid_device *dev, int
 }
 
 
+HID_API_EXPORT const struct hid_report_layout * HID_API_CALL hid_get_report_layout(hid_device *dev)
+{
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_get_report_layout: not supported by this backend");
+	return NULL;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_decode_report(hid_device *dev, const unsigned char *data, size_t length, int *values, size_t max_values)
+{
+	(void)data;
+	(void)length;
+	(void)values;
+	(void)max_values;
+
+	/* Not supported by this backend. */
+	register_device_error(dev, L"hid_decode_report: not supported by this backend");
+	return -1;
+}
+
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	if (dev) {
@@ -1003,7 +1350,10 @@ HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 		return (wchar_t*)dev->last_error_str;
 	}
 
-	// Global error messages are not (yet) implemented on Windows.
+	if (last_global_error_str)
+		return last_global_error_str;
+
+	// Other global error messages are not (yet) implemented on Windows.
 	return L"hid_error for global errors is not implemented yet";
 }
 